@@ -0,0 +1,97 @@
+//
+// Compares batched gets (sharded_cache::get_many) against a get per key.
+//
+// usage: get_many_bench [keys] [batch]. Defaults to 1M keys, batches of 100.
+// Only this file is built optimized, build the cache sources with -O3 as
+// well for meaningful numbers.
+//
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <algorithm>
+
+#include "../sharded_cache.h"
+
+using namespace memcache;
+
+typedef std::chrono::steady_clock clock_type;
+
+static std::string key_name(size_t i) {
+  return "user:" + std::to_string(i * 2654435761ULL % 1000000007ULL) + ":" + std::to_string(i);
+}
+
+static std::string set_request(const std::string &key, const std::string &value) {
+  protocol_binary_request_header h;
+  memset(&h, 0, sizeof(h));
+  h.request.magic = (uint8_t) PROTOCOL_BINARY_REQ;
+  h.request.opcode = (uint8_t) PROTOCOL_BINARY_CMD_SET;
+  h.request.keylen = (uint16_t) key.length();
+  h.request.extlen = (uint8_t) PACKET_EXTRAS_SIZE;
+  h.request.bodylen = (uint32_t) (key.length() + value.length() + PACKET_EXTRAS_SIZE);
+
+  std::string ret((const char *) &h, sizeof(h));
+  ret.append(PACKET_EXTRAS_SIZE, 0);
+  ret.append(key);
+  ret.append(value);
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+  size_t batch = argc > 2 ? strtoull(argv[2], nullptr, 10) : 100;
+
+  sharded_cache c(n * 512, 4);
+  std::vector<std::string> names(n);
+  for (size_t i = 0; i < n; ++i) {
+    names[i] = key_name(i);
+    std::string pak = set_request(names[i], std::string(32, 'v'));
+    c.set(cache::value(std::move(pak), *util::get_header(pak)));
+  }
+
+  // Batches of random keys, so the lookups are not cache friendly.
+  std::vector<cache::key> keys;
+  std::mt19937 rng(42);
+  for (size_t i = 0; i < n; ++i) {
+    const std::string &k = names[rng() % n];
+    keys.push_back(cache::key(k.data(), k.length()));
+  }
+
+  size_t batches = n / batch;
+  size_t found = 0;
+  char out[64];
+
+  auto start = clock_type::now();
+  for (size_t b = 0; b < batches; ++b) {
+    for (size_t i = 0; i < batch; ++i) {
+      cache::item_ptr it = c.get(keys[b * batch + i]);
+      if (it) {
+        memcpy(out, it->get_value(), std::min(sizeof(out), it->value_len()));
+        ++found;
+      }
+    }
+  }
+  double single = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+
+  start = clock_type::now();
+  for (size_t b = 0; b < batches; ++b) {
+    c.get_many(&keys[b * batch], batch, [&](size_t, cache::item_ptr it) {
+      if (it) {
+        memcpy(out, it->get_value(), std::min(sizeof(out), it->value_len()));
+        ++found;
+      }
+    });
+  }
+  double many = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+
+  if (found != 2 * batches * batch) {
+    std::cerr << "found " << found << " of " << 2 * batches * batch << std::endl;
+  }
+
+  std::cout << std::setw(12) << "keys" << std::setw(12) << "batch"
+            << std::setw(14) << "get ns/key" << std::setw(18) << "get_many ns/key" << std::endl;
+  std::cout << std::setw(12) << c.count() << std::setw(12) << batch << std::fixed << std::setprecision(1)
+            << std::setw(14) << single / (batches * batch)
+            << std::setw(18) << many / (batches * batch) << std::endl;
+}
@@ -0,0 +1,151 @@
+//
+// Compares the cache lookup index (hash_index) against std::unordered_map.
+//
+// usage: hash_index_bench [keys...]. Defaults to 1M, 10M and 50M keys.
+//
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+
+#include "../cache.h"
+
+using namespace memcache;
+
+typedef std::shared_ptr<cache::value> item_ptr;
+typedef std::unordered_map<cache::key, item_ptr, cache::hasher> map_t;
+typedef hash_index<cache::key, item_ptr, cache::hasher> index_t;
+
+/*!
+ * \brief Keys, stored back to back in a single arena.
+ */
+struct keys {
+  explicit keys(size_t n) {
+    offsets_.reserve(n + 1);
+    for (size_t i = 0; i < n; ++i) {
+      offsets_.push_back(data_.size());
+      data_ += "user:" + std::to_string(i * 2654435761ULL % 1000000007ULL) + ":" + std::to_string(i);
+    }
+    offsets_.push_back(data_.size());
+  }
+
+  cache::key at(size_t i) const {
+    return cache::key(data_.data() + offsets_[i], offsets_[i + 1] - offsets_[i]);
+  }
+
+  size_t size() const {
+    return offsets_.size() - 1;
+  }
+
+  std::string data_;
+  std::vector<size_t> offsets_;
+};
+
+typedef std::chrono::steady_clock clock_type;
+
+static double ns_per_op(clock_type::time_point start, size_t ops) {
+  auto d = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start);
+  return (double) d.count() / ops;
+}
+
+static void report(const char *name, size_t n, double insert, double hit, double miss,
+                   size_t memory) {
+  std::cout << std::setw(14) << name << std::setw(12) << n
+            << std::fixed << std::setprecision(1)
+            << std::setw(12) << insert << std::setw(12) << hit << std::setw(12) << miss
+            << std::setw(14) << memory / n << std::endl;
+}
+
+template<typename Insert, typename Find>
+static void run(const char *name, const keys &k, const keys &missing,
+                const std::vector<uint32_t> &order, Insert insert, Find find,
+                std::function<size_t()> memory) {
+  size_t n = k.size();
+
+  auto start = clock_type::now();
+  for (size_t i = 0; i < n; ++i) {
+    insert(k.at(i));
+  }
+  double ins = ns_per_op(start, n);
+
+  size_t found = 0;
+  start = clock_type::now();
+  for (size_t i = 0; i < n; ++i) {
+    found += find(k.at(order[i]));
+  }
+  double hit = ns_per_op(start, n);
+
+  start = clock_type::now();
+  for (size_t i = 0; i < missing.size(); ++i) {
+    found += find(missing.at(order[i]));
+  }
+  double miss = ns_per_op(start, missing.size());
+
+  if (found != n) {
+    std::cerr << name << ": found " << found << " of " << n << std::endl;
+  }
+
+  report(name, n, ins, hit, miss, memory());
+}
+
+static void bench(size_t n) {
+  keys k(n);
+
+  // Keys which are not in the index.
+  keys missing(n);
+  for (auto &c : missing.data_) {
+    if (c == ':') {
+      c = ';';
+    }
+  }
+
+  // Look keys up in random order, so the lookups are not cache friendly.
+  std::vector<uint32_t> order(n);
+  for (size_t i = 0; i < n; ++i) {
+    order[i] = (uint32_t) i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+  {
+    map_t m;
+    run("unordered_map", k, missing, order,
+        [&](const cache::key &key) { m.emplace(key, item_ptr()); },
+        [&](const cache::key &key) { return (size_t) (m.find(key) != m.end()); },
+        [&]() {
+          // Estimated: bucket array, plus a node per item with the next
+          // pointer, the cached hash and malloc overhead.
+          return m.bucket_count() * sizeof(void *) +
+              m.size() * (sizeof(map_t::value_type) + 2 * sizeof(void *) + 16);
+        });
+  }
+
+  {
+    index_t idx;
+    run("hash_index", k, missing, order,
+        [&](const cache::key &key) { idx.insert(key, item_ptr(), cache::hash(key)); },
+        [&](const cache::key &key) { return (size_t) (idx.find(key, cache::hash(key)) != nullptr); },
+        [&]() { return idx.memory(); });
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; ++i) {
+    sizes.push_back(strtoull(argv[i], nullptr, 10));
+  }
+
+  if (sizes.empty()) {
+    sizes = {1000000, 10000000, 50000000};
+  }
+
+  std::cout << std::setw(14) << "index" << std::setw(12) << "keys"
+            << std::setw(12) << "insert ns" << std::setw(12) << "hit ns"
+            << std::setw(12) << "miss ns" << std::setw(14) << "bytes/key" << std::endl;
+
+  for (auto n : sizes) {
+    bench(n);
+  }
+}
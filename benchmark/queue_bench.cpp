@@ -0,0 +1,110 @@
+//
+// Compares the executor queue (mpsc_queue) against a mutex and condition
+// variable queue, as the executors used before.
+//
+// usage: queue_bench [producers] [items]. Defaults to 4 producers, 1M items
+// each. Producers push their push time, and the consumer measures the
+// enqueue to dequeue latency.
+//
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "../mpsc_queue.h"
+
+using namespace memcache;
+
+typedef std::chrono::steady_clock clock_type;
+
+/*!
+ * \brief The queue of the executors before mpsc_queue.
+ */
+template<typename T>
+struct sync_queue {
+  bool push(T v) {
+    std::unique_lock<std::mutex> lock(m_);
+    q_.push_back(std::move(v));
+    if (q_.size() == 1) {
+      con_.notify_one();
+      return true;
+    }
+    return false;
+  }
+
+  T pop() {
+    std::unique_lock<std::mutex> lock(m_);
+    while (q_.empty()) {
+      con_.wait(lock);
+    }
+    T v(std::move(q_.front()));
+    q_.pop_front();
+    return v;
+  }
+
+private:
+  std::mutex m_;
+  std::condition_variable con_;
+  std::deque<T> q_;
+};
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      clock_type::now().time_since_epoch()).count();
+}
+
+template<typename Q>
+static void run(const char *name, size_t producers, size_t items) {
+  Q q;
+  std::vector<uint64_t> latency;
+  latency.reserve(producers * items);
+
+  auto start = clock_type::now();
+  std::vector<std::thread> ts;
+  for (size_t p = 0; p < producers; ++p) {
+    ts.push_back(std::thread([&q, items]() {
+      for (size_t i = 0; i < items; ++i) {
+        q.push(now_ns());
+      }
+    }));
+  }
+
+  for (size_t n = 0; n < producers * items; ++n) {
+    uint64_t pushed = q.pop();
+    latency.push_back(now_ns() - pushed);
+  }
+  double secs = std::chrono::duration<double>(clock_type::now() - start).count();
+
+  for (auto &t : ts) {
+    t.join();
+  }
+
+  std::sort(latency.begin(), latency.end());
+  double sum = 0;
+  for (auto l : latency) {
+    sum += l;
+  }
+
+  std::cout << std::setw(12) << name << std::fixed << std::setprecision(1)
+            << std::setw(14) << latency.size() / secs / 1e6
+            << std::setw(12) << sum / latency.size() / 1e3
+            << std::setw(12) << latency[latency.size() / 2] / 1e3
+            << std::setw(12) << latency[latency.size() * 99 / 100] / 1e3 << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t producers = argc > 1 ? strtoull(argv[1], nullptr, 10) : 4;
+  size_t items = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000;
+
+  std::cout << std::setw(12) << "queue" << std::setw(14) << "Mops/sec"
+            << std::setw(12) << "avg us" << std::setw(12) << "p50 us"
+            << std::setw(12) << "p99 us" << std::endl;
+  run<sync_queue<uint64_t>>("sync_queue", producers, items);
+  run<mpsc_queue<uint64_t>>("mpsc_queue", producers, items);
+}
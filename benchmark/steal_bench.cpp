@@ -0,0 +1,155 @@
+//
+// Per IO executor utilization with skewed connections, with connections
+// served by the executor they are assigned to for life, with work stealing
+// and with rebalancing (IOPoolExecutor::init with steal, or balance).
+//
+// usage: steal_bench [executors] [seconds]. Defaults to 4 executors, 2
+// seconds per run. Twice as many connections as executors are assigned
+// round-robin, and the two assigned to executor 0 send pipelined batches
+// of gets back to back, while the others send a get now and then.
+//
+
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <sys/socket.h>
+
+#include "../executor.h"
+
+using namespace memcache;
+
+typedef std::chrono::steady_clock clock_type;
+
+static const size_t HEAVY_BATCH = 64;
+
+static buffer get_request(const std::string &key) {
+  protocol_binary_request_header h;
+  memset(&h, 0, sizeof(h));
+  h.request.magic = (uint8_t) PROTOCOL_BINARY_REQ;
+  h.request.opcode = (uint8_t) PROTOCOL_BINARY_CMD_GET;
+  h.request.keylen = htons((uint16_t) key.length());
+  h.request.bodylen = htonl((uint32_t) key.length());
+
+  buffer ret((unsigned char *) &h, (unsigned char *) &h + sizeof(h));
+  ret.insert(ret.end(), key.begin(), key.end());
+  return ret;
+}
+
+static void write_all(int fd, const buffer &b) {
+  size_t n = 0;
+  while (n < b.size()) {
+    ssize_t r = ::write(fd, b.data() + n, b.size() - n);
+    assert(r > 0);
+    n += r;
+  }
+}
+
+/*!
+ * \brief Read the responses to a number of requests.
+ */
+static void read_responses(int fd, size_t count) {
+  std::string b;
+  char chunk[16 * KB];
+  while (count) {
+    ssize_t r = ::read(fd, chunk, sizeof(chunk));
+    assert(r > 0);
+    b.append(chunk, r);
+
+    size_t pos = 0;
+    while (count && b.size() - pos >= sizeof(protocol_binary_response_header)) {
+      const protocol_binary_response_header *h = (const protocol_binary_response_header *) &b[pos];
+      size_t size = sizeof(*h) + ntohl(h->response.bodylen);
+      if (b.size() - pos < size) {
+        break;
+      }
+      pos += size;
+      --count;
+    }
+    b.erase(0, pos);
+  }
+}
+
+static void run(size_t executors, double seconds, bool steal, bool balance) {
+  sharded_cache c(0, executors);
+  IOPoolExecutor io;
+  io.init(executors, steal, balance);
+
+  std::vector<int> fds;
+  std::vector<connection *> conns;
+  std::vector<bool> heavy;
+  for (size_t i = 0; i < 2 * executors; ++i) {
+    int pair[2];
+    int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(!err);
+    ::fcntl(pair[0], F_SETFL, ::fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
+
+    conns.push_back(new connection(pair[0], c, io.pick()));
+    fds.push_back(pair[1]);
+    heavy.push_back(conns.back()->executor_index_ == 0);
+    io.add(task(task::NEW, conns.back()), conns.back()->executor_index_);
+  }
+
+  std::vector<uint64_t> busy(executors);
+  for (size_t i = 0; i < executors; ++i) {
+    busy[i] = io.executors_[i]->busy_ns();
+  }
+
+  std::atomic<uint64_t> ops{0};
+  auto start = clock_type::now();
+  auto end = start + std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double>(seconds));
+
+  std::vector<std::thread> ts;
+  for (size_t n = 0; n < conns.size(); ++n) {
+    ts.push_back(std::thread([&, n]() {
+      size_t batch = heavy[n] ? HEAVY_BATCH : 1;
+      buffer b;
+      for (size_t i = 0; i < batch; ++i) {
+        buffer r = get_request("key_" + std::to_string(n) + "_" + std::to_string(i));
+        b.insert(b.end(), r.begin(), r.end());
+      }
+
+      while (clock_type::now() < end) {
+        write_all(fds[n], b);
+        io.add(task(task::READ, conns[n]), conns[n]->executor_index_);
+        read_responses(fds[n], batch);
+        ops.fetch_add(batch);
+        if (!heavy[n]) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+    }));
+  }
+
+  for (auto &t : ts) {
+    t.join();
+  }
+  double wall = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+
+  std::cout << (steal ? "work stealing" : balance ? "rebalancing" : "round-robin, for life")
+            << ": " << std::fixed << std::setprecision(0) << ops.load() * 1e9 / wall << " gets/sec, "
+            << io.migrations() << " migrations" << std::endl;
+  std::cout << std::setw(10) << "executor" << std::setw(10) << "busy %" << std::setw(10) << "steals"
+            << std::endl;
+  for (size_t i = 0; i < executors; ++i) {
+    std::cout << std::setw(10) << i << std::setw(10) << std::setprecision(1)
+              << (io.executors_[i]->busy_ns() - busy[i]) * 100.0 / wall
+              << std::setw(10) << io.executors_[i]->steals() << std::endl;
+  }
+
+  for (size_t i = 0; i < conns.size(); ++i) {
+    io.add(task(task::CLOSE, conns[i]), conns[i]->executor_index_);
+    ::close(fds[i]);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t executors = argc > 1 ? strtoull(argv[1], nullptr, 10) : 4;
+  double seconds = argc > 2 ? atof(argv[2]) : 2;
+
+  run(executors, seconds, false, false);
+  run(executors, seconds, true, false);
+  run(executors, seconds, false, true);
+}
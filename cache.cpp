@@ -1,45 +1,712 @@
+#include <algorithm>
+
 #include "cache.h"
 
 namespace memcache {
 
-bool cache::remove(const value &v, uint64_t cas) {
-  std::unique_lock<std::mutex> lock(mutex_);
+static_assert(sizeof(cache::item) + MAX_KEY_SIZE + cache::item::RESPONSE_PREFIX_SIZE +
+                  MAX_VALUE_SIZE <= SLAB_PAGE_SIZE,
+              "The largest item must fit in a slab page");
+
+cache::cache(size_t capacity, bool locked, eviction_policy policy, admission_policy admission,
+             bool encoded)
+    : locked_(locked), policy_(policy), admission_(admission), encoded_(encoded), capacity_(capacity),
+      wheel_(coarse_clock::now()) {
+  if (capacity_ == 0) {
+    capacity_ = DEFAULT_CACHE_CAPACITY;
+  }
+
+  assert(capacity_);
+  assert(admission_ == admission_policy::NONE || policy_ != eviction_policy::CLOCK);
+
+  lru_.resize(slab_.classes() * SEGMENTS);
+  clock_hand_.resize(slab_.classes());
+  reclaim_.resize(slab_.classes());
+  reset_sketch_inl();
+  slab_.set_max_pages(max_pages());
+}
+
+void cache::set_watermarks(size_t low, size_t high, std::function<void()> notify) {
+  assert(low <= high && high <= 100);
+
+  auto l = lock();
+  low_watermark_ = low;
+  high_watermark_ = high;
+  notify_ = std::move(notify);
+}
+
+size_t cache::reclaim(size_t max_items) {
+  auto l = lock();
+
+  size_t evicted = 0;
+  bool wanted = false;
+  for (size_t cls = 0; cls < reclaim_.size(); ++cls) {
+    if (!reclaim_[cls]) {
+      continue;
+    }
+
+    // Stop at the high watermark, or once the class has nothing left to evict.
+    bool done = true;
+    size_t batch = 0;
+    while (true) {
+      // Evicted items only give their chunks back once no one reads them.
+      // Readers are only waited for once a batch of evictions still leaves
+      // the class under the watermark, as the shard stays locked meanwhile.
+      collect_inl(batch == RETIRE_BATCH_SIZE);
+      if (batch == RETIRE_BATCH_SIZE) {
+        batch = 0;
+      }
+      if (!under_watermark_inl(cls, high_watermark_)) {
+        break;
+      }
+
+      if (evicted == max_items) {
+        done = false;
+        break;
+      }
+
+      if (!evict_item_inl(cls, true)) {
+        break;
+      }
+      ++evicted;
+      ++batch;
+    }
+
+    reclaim_[cls] = !done;
+    wanted |= !done;
+  }
+
+  reclaim_wanted_.store(wanted, std::memory_order_relaxed);
+  stats_.background_reclaims_.add(evicted);
+  return evicted;
+}
+
+size_t cache::expire(size_t max_items) {
+  auto l = lock();
+
+  size_t expired = wheel_.advance(coarse_clock::now(), max_items, [this](timer_node *n) {
+    unlink_inl(item::from_timer(n));
+    stats_.expired_.add();
+  });
+
+  // Freed once no one reads them, by a later collect.
+  collect_inl(false);
+  return expired;
+}
+
+bool cache::remove(const value &v, uint64_t cas, uint32_t hash) {
+  auto l = lock();
 
   if (cas > 0) {
-    auto p = get_inl(v.get_key());
-    if (p && p->header_.request.cas != cas) {
+    item *p = get_inl(v.get_key(), hash);
+    if (p && p->cas_ != cas) {
       return false;
     }
   }
 
-  return delete_inl(v.get_key());
+  return delete_inl(v.get_key(), hash);
 }
 
-bool cache::cas(value v, uint64_t cas) {
-  std::unique_lock<std::mutex> lock(mutex_);
+bool cache::cas(value v, uint64_t cas, uint32_t hash) {
+  auto l = lock();
 
   if (cas > 0) {
-    std::shared_ptr<value> p = get_inl(v.get_key());
-    if (p && p->header_.request.cas != cas) {
+    item *p = get_inl(v.get_key(), hash);
+    if (p && p->cas_ != cas) {
       return false;
     }
   }
 
-  set_inl(std::move(v));
+  return set_inl(std::move(v), hash);
+}
+
+void cache::get_many(const key *keys, const uint32_t *hashes, const uint32_t *idx, size_t n,
+                     item_ptr *out) {
+  if (policy_ == eviction_policy::CLOCK) {
+    auto l = shared_lock();
+    get_many_inl(keys, hashes, idx, n, out);
+    return;
+  }
+
+  auto l = lock();
+  get_many_inl(keys, hashes, idx, n, out);
+}
+
+void cache::get_many_inl(const key *keys, const uint32_t *hashes, const uint32_t *idx, size_t n,
+                         item_ptr *out) {
+  // A few keys at a time, as only so many cache misses can be in flight.
+  for (size_t start = 0; start < n; start += GET_MANY_PREFETCH) {
+    size_t end = std::min(n, start + GET_MANY_PREFETCH);
+    item *items[GET_MANY_PREFETCH];
+
+    for (size_t i = start; i < end; ++i) {
+      lookup_.prefetch(hashes[idx[i]]);
+    }
+
+    // The item header, and the key compared by the lookup right after it.
+    for (size_t i = start; i < end; ++i) {
+      item *const *v = lookup_.probe(hashes[idx[i]]);
+      if (v) {
+        __builtin_prefetch(*v);
+        __builtin_prefetch((*v)->data_);
+      }
+    }
+
+    // The LRU neighbours, which a hit relinks.
+    for (size_t i = start; i < end; ++i) {
+      item **v = lookup_.find(keys[idx[i]], hashes[idx[i]]);
+      items[i - start] = v ? *v : nullptr;
+      if (v && policy_ != eviction_policy::CLOCK) {
+        __builtin_prefetch((*v)->prev_, 1);
+        __builtin_prefetch((*v)->next_, 1);
+      }
+    }
+
+    for (size_t i = start; i < end; ++i) {
+      if (sketch_) {
+        sketch_->increment(hashes[idx[i]]);
+      }
+
+      item *it = items[i - start];
+      if (it && !it->expired(coarse_clock::now())) {
+        touch_inl(it);
+        out[idx[i]] = item_ptr(it, locked_ ? epoch_.enter() : nullptr);
+      }
+    }
+  }
+}
+
+void cache::set_many(value *v, const uint32_t *hashes, const uint32_t *idx, size_t n, bool *out) {
+  auto l = lock();
+
+  // Chunks needed per slab class.
+  std::vector<size_t> need(slab_.classes(), 0);
+  size_t prefix = encoded_ ? item::RESPONSE_PREFIX_SIZE : 0;
+  for (size_t i = 0; i < n; ++i) {
+    const value &r = v[idx[i]];
+    int cls = slab_.size_class(sizeof(item) + r.header_.request.keylen + prefix + r.packet_value_len());
+    if (cls >= 0) {
+      ++need[cls];
+    }
+  }
+
+  for (size_t cls = 0; cls < need.size(); ++cls) {
+    if (need[cls]) {
+      make_room_inl((int) cls, need[cls]);
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    value &r = v[idx[i]];
+    uint64_t cas = r.header_.request.cas;
+    if (cas > 0) {
+      item *p = get_inl(r.get_key(), hashes[idx[i]]);
+      if (p && p->cas_ != cas) {
+        out[idx[i]] = false;
+        continue;
+      }
+    }
+
+    out[idx[i]] = set_inl(std::move(r), hashes[idx[i]]);
+  }
+}
+
+void cache::make_room_inl(int cls, size_t items) {
+  while (slab_.free_chunks(cls) < items && slab_.add_page(cls)) {
+  }
+
+  // Evicted items give their chunks back once collected. Those still pinned
+  // or read don't, and are made up for by the sets, evicting inline.
+  size_t evicted = 0;
+  while (slab_.free_chunks(cls) + evicted < items && evict_item_inl(cls)) {
+    ++evicted;
+  }
+
+  if (evicted) {
+    stats_.inline_reclaims_.add(evicted);
+    collect_inl(true);
+  }
+}
+
+cache::reserved_item cache::reserve(const protocol_binary_request_header &h, const char *body,
+                                    uint32_t hash) {
+  assert(locked_);
+  auto l = lock();
+
+  item *it = alloc_item_inl(h, body, hash);
+  if (!it) {
+    return reserved_item();
+  }
+  return reserved_item(this, it, value_inl(it), hash);
+}
+
+bool cache::commit(item *it, uint64_t cas, uint32_t hash) {
+  auto l = lock();
+
+  if (cas > 0) {
+    item *p = get_inl(it->get_key(), hash);
+    if (p && p->cas_ != cas) {
+      free_inl(it);
+      return false;
+    }
+  }
+
+  set_item_inl(it, hash);
   return true;
 }
 
-void cache::reclaim(size_t size) {
-  assert(size);
+cache::item *cache::alloc_inl(size_t size) {
+  int cls = slab_.size_class(size);
+  if (cls < 0) {
+    return nullptr;
+  }
+
+  void *p = slab_.alloc(cls);
+  if (!p && slab_.add_page(cls)) {
+    p = slab_.alloc(cls);
+  }
+
+  // Items evicted earlier may be free by now.
+  if (!p && (retired_items_.head_ || pinned_items_.head_)) {
+    collect_inl(false);
+    p = slab_.alloc(cls);
+  }
+
+  // Evicted items which are pinned or still read don't free their chunk,
+  // try the next ones.
+  for (size_t tries = 0; !p && tries < MAX_EVICTION_TRIES && evict_inl(cls); ++tries) {
+    collect_inl(false);
+    p = slab_.alloc(cls);
+  }
+
+  // Wait for the readers of the evicted items, once rather than per eviction.
+  if (!p && retired_items_.head_) {
+    collect_inl(true);
+    p = slab_.alloc(cls);
+  }
+
+  if (!p) {
+    return nullptr;
+  }
+
+  check_watermark_inl(cls);
+
+  item *it = static_cast<item *>(p);
+  assert(!it->flags_);
+  it->timer_.prev_ = it->timer_.next_ = nullptr;
+  it->timer_.expires_ = 0;
+  it->prev_ = it->next_ = nullptr;
+  it->segment_ = admission_ == admission_policy::TINYLFU ? WINDOW : HOT;
+  it->ref_.store(0, std::memory_order_relaxed);
+  it->pins_.store(0, std::memory_order_relaxed);
+  it->class_ = (uint8_t) cls;
+  it->flags_ = item::ALLOCATED;
+  return it;
+}
+
+bool cache::evict_inl(int cls) {
+  if (evict_item_inl(cls)) {
+    stats_.inline_reclaims_.add();
+    return true;
+  }
 
-  size_t freed = 0;
-  //remove according to LRU
-  for (auto it = lru_.begin(); it != lru_.end() && freed < size;) {
-    freed += it->value_size_;
-    auto tmp = it;
-    ++it;
-    bool d = delete_inl(*tmp);
-    assert(d);
+  // Take a page from the class with the most pages.
+  long page = victim_page_inl(cls);
+  if (page == -1 || !evict_page_inl(page)) {
+    return false;
   }
+
+  slab_.release_page(page, false);
+  return slab_.add_page(cls);
+}
+
+bool cache::evict_item_inl(int cls, bool admission_only) {
+  if (policy_ == eviction_policy::CLOCK) {
+    return evict_clock_inl(cls);
+  }
+
+  if (admission_ == admission_policy::TINYLFU) {
+    if (evict_admission_inl(cls)) {
+      return true;
+    }
+
+    if (admission_only) {
+      return false;
+    }
+  }
+
+  if (policy_ == eviction_policy::SEGMENTED) {
+    return evict_tail_inl(lru(cls, COLD)) || evict_tail_inl(lru(cls, WARM)) ||
+        evict_tail_inl(lru(cls, HOT)) || evict_tail_inl(lru(cls, WINDOW));
+  }
+
+  return evict_tail_inl(lru(cls, HOT)) || evict_tail_inl(lru(cls, WINDOW));
+}
+
+bool cache::evict_tail_inl(lru_list &l) {
+  item *it = l.tail_;
+  if (!it) {
+    return false;
+  }
+
+  unlink_inl(it);
+  return true;
+}
+
+bool cache::evict_admission_inl(int cls) {
+  // Contest the window tail even when the window is not full, as the
+  // reclaimer evicts ahead of the sets.
+  lru_list &window = lru(cls, WINDOW);
+  item *candidate = window.tail_;
+  if (!candidate) {
+    return false;
+  }
+
+  item *victim = nullptr;
+  if (policy_ == eviction_policy::SEGMENTED) {
+    for (int seg : {COLD, WARM, HOT}) {
+      if ((victim = lru(cls, seg).tail_)) {
+        break;
+      }
+    }
+  } else {
+    victim = lru(cls, HOT).tail_;
+  }
+
+  // Admit the candidate if it was accessed more often than the victim.
+  if (victim && sketch_->estimate(hash(candidate->get_key())) >
+                sketch_->estimate(hash(victim->get_key()))) {
+    if (window.size_ >= window_limit(cls)) {
+      uint8_t hits = candidate->ref_.load(std::memory_order_relaxed);
+      lru_move(candidate, HOT);
+      candidate->ref_.store(hits, std::memory_order_relaxed);
+    }
+    unlink_inl(victim);
+    stats_.admitted_.add();
+    return true;
+  }
+
+  unlink_inl(candidate);
+  stats_.rejected_.add();
+  return true;
+}
+
+void cache::balance_window_inl(int cls) {
+  // Admitted for free, while there is memory for them.
+  lru_list &window = lru(cls, WINDOW);
+  while (window.size_ > window_limit(cls)) {
+    item *it = window.tail_;
+    uint8_t hits = it->ref_.load(std::memory_order_relaxed);
+    lru_move(it, HOT);
+    it->ref_.store(hits, std::memory_order_relaxed);
+  }
+}
+
+void cache::reset_sketch_inl() {
+  if (admission_ == admission_policy::TINYLFU) {
+    sketch_.reset(new frequency_sketch(capacity_ / TINYLFU_BYTES_PER_COUNTER));
+  }
+}
+
+bool cache::evict_clock_inl(int cls) {
+  size_t chunks = slab_.pages(cls) * slab_.chunks_per_page(cls);
+  size_t &hand = clock_hand_[cls];
+
+  // Two turns at most, as the first may only clear reference bits.
+  for (size_t n = 0; n < 2 * chunks; ++n) {
+    if (hand >= chunks) {
+      hand = 0;
+    }
+
+    item *it = class_chunk(cls, hand++);
+    if (!(it->flags_ & item::LINKED)) {
+      continue;
+    }
+
+    if (it->ref_.load(std::memory_order_relaxed)) {
+      it->ref_.store(0, std::memory_order_relaxed);
+      continue;
+    }
+
+    unlink_inl(it);
+    return true;
+  }
+
+  return false;
+}
+
+bool cache::under_watermark_inl(int cls, size_t percent) const {
+  // Pages left to add to the class, which add_page hands out first.
+  if (slab_.pages() < slab_.max_pages() || slab_.free_pages()) {
+    return false;
+  }
+
+  // In whole chunks, so that classes with few large chunks don't have
+  // their only items evicted to keep a fraction of a chunk free.
+  size_t chunks = slab_.pages(cls) * slab_.chunks_per_page(cls);
+  return slab_.free_chunks(cls) < percent * chunks / 100;
+}
+
+void cache::check_watermark_inl(int cls) {
+  if (!low_watermark_ || reclaim_[cls] || !under_watermark_inl(cls, low_watermark_)) {
+    return;
+  }
+
+  reclaim_[cls] = true;
+  if (!reclaim_wanted_.load(std::memory_order_relaxed)) {
+    reclaim_wanted_.store(true, std::memory_order_relaxed);
+    if (notify_) {
+      notify_();
+    }
+  }
+}
+
+long cache::victim_page_inl(int exclude) const {
+  int cls = slab_.victim_class(exclude);
+  if (cls == -1) {
+    return -1;
+  }
+
+  // Page the CLOCK hand is about to sweep.
+  if (policy_ == eviction_policy::CLOCK) {
+    size_t i = clock_hand_[cls] / slab_.chunks_per_page(cls);
+    return slab_.class_page(cls, i < slab_.pages(cls) ? i : 0);
+  }
+
+  // Page of the LRU tail, or any page of the class if it has no items.
+  const item *tail = lru_tail(cls);
+  if (!tail) {
+    tail = reinterpret_cast<const item *>(slab_.page_memory(slab_.class_page(cls, 0)));
+  }
+
+  return slab_.page_of(tail, cls);
+}
+
+bool cache::evict_page_inl(size_t page) {
+  int cls = slab_.page_class(page);
+  size_t size = slab_.chunk_size(cls);
+  size_t n = slab_.chunks_per_page(cls);
+  char *mem = slab_.page_memory(page);
+
+  for (size_t i = 0; i < n; ++i) {
+    item *it = reinterpret_cast<item *>(mem + i * size);
+    if (it->flags_ & item::LINKED) {
+      unlink_inl(it);
+      stats_.inline_reclaims_.add();
+    }
+  }
+
+  // Items still read by the calling thread, or pinned, can't be freed yet.
+  collect_inl(true);
+  for (size_t i = 0; i < n; ++i) {
+    if (reinterpret_cast<item *>(mem + i * size)->flags_) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+const cache::item *cache::lru_tail(int cls) const {
+  if (policy_ != eviction_policy::SEGMENTED) {
+    return lru(cls, HOT).tail_ ? lru(cls, HOT).tail_ : lru(cls, WINDOW).tail_;
+  }
+
+  for (int seg : {COLD, WARM, HOT, WINDOW}) {
+    if (lru(cls, seg).tail_) {
+      return lru(cls, seg).tail_;
+    }
+  }
+
+  return nullptr;
+}
+
+void cache::balance_inl(int cls) {
+  lru_list &hot = lru(cls, HOT);
+  lru_list &warm = lru(cls, WARM);
+  // Limits relative to the chunks of the class, so that a class which is
+  // still filling up keeps its working set in warm.
+  size_t total = slab_.pages(cls) * slab_.chunks_per_page(cls);
+
+  // Hot items flow to cold, or to warm if hit twice. The newest item stays.
+  while (hot.size_ > 1 && hot.size_ * 100 > total * SLRU_HOT_PERCENT) {
+    item *it = hot.tail_;
+    if (it->ref_.load(std::memory_order_relaxed) >= 2) {
+      lru_move(it, WARM);
+      stats_.promotions_.add();
+    } else {
+      // Keep the hit, so that the next one promotes the item.
+      uint8_t hits = it->ref_.load(std::memory_order_relaxed);
+      lru_move(it, COLD);
+      it->ref_.store(hits, std::memory_order_relaxed);
+    }
+  }
+
+  // Warm items which were hit get another round, the others are demoted.
+  // Bounded, as every round clears a hit.
+  while (warm.size_ * 100 > total * SLRU_WARM_PERCENT) {
+    item *it = warm.tail_;
+    if (it->ref_.load(std::memory_order_relaxed)) {
+      lru_move(it, WARM);
+    } else {
+      lru_move(it, COLD);
+      stats_.demotions_.add();
+    }
+  }
+}
+
+void cache::shrink_inl() {
+  slab_.set_max_pages(max_pages());
+
+  while (slab_.pages() > slab_.max_pages()) {
+    if (slab_.release_free_page()) {
+      continue;
+    }
+
+    long page = victim_page_inl(-1);
+    if (page == -1 || !evict_page_inl(page)) {
+      break;
+    }
+
+    slab_.release_page(page, true);
+  }
+}
+
+void cache::link_inl(item *it, uint32_t hash) {
+  assert((it->flags_ & (item::ALLOCATED | item::LINKED)) == item::ALLOCATED);
+
+  size_t capacity = lookup_.capacity();
+  lookup_.insert(it->get_key(), it, hash);
+  if (it->timer_.expires_) {
+    wheel_.add(&it->timer_, it->timer_.expires_);
+  }
+  if (policy_ != eviction_policy::CLOCK) {
+    lru_push(it);
+  }
+  it->flags_ |= item::LINKED;
+  used_ += slab_.chunk_size(it->class_);
+
+  if (admission_ == admission_policy::TINYLFU) {
+    balance_window_inl(it->class_);
+  }
+
+  if (policy_ == eviction_policy::SEGMENTED) {
+    balance_inl(it->class_);
+  }
+
+  // Make room for the index, if it grew.
+  if (lookup_.capacity() != capacity) {
+    shrink_inl();
+  }
+}
+
+void cache::unlink_inl(item *it, uint32_t hash) {
+  assert(it->flags_ & item::LINKED);
+
+  bool erased = lookup_.erase(it->get_key(), hash);
+  assert(erased);
+  if (it->timer_.linked()) {
+    wheel_.remove(&it->timer_);
+  }
+  if (policy_ != eviction_policy::CLOCK) {
+    lru_remove(it);
+  }
+  it->flags_ &= ~item::LINKED;
+  used_ -= slab_.chunk_size(it->class_);
+
+  retire_inl(it);
+}
+
+void cache::retire_inl(item *it) {
+  if (!locked_) {
+    collect_pinned_inl();
+    release_inl(it);
+    return;
+  }
+
+  it->retired_ = epoch_.retire();
+  it->next_ = nullptr;
+  if (retired_items_.tail_) {
+    retired_items_.tail_->next_ = it;
+  } else {
+    retired_items_.head_ = it;
+  }
+  retired_items_.tail_ = it;
+
+  if (++retired_items_.size_ >= RETIRE_BATCH_SIZE) {
+    collect_inl(false);
+  }
+}
+
+void cache::collect_inl(bool wait) {
+  collect_pinned_inl();
+  if (!retired_items_.head_) {
+    return;
+  }
+
+  if (wait) {
+    epoch_.synchronize(retired_items_.tail_->retired_);
+  }
+
+  uint64_t safe = epoch_.safe_epoch();
+  while (retired_items_.head_ && retired_items_.head_->retired_ < safe) {
+    item *it = retired_items_.head_;
+    retired_items_.head_ = it->next_;
+    --retired_items_.size_;
+    release_inl(it);
+  }
+
+  if (!retired_items_.head_) {
+    retired_items_.tail_ = nullptr;
+  }
+}
+
+void cache::collect_pinned_inl() {
+  for (item **p = &pinned_items_.head_; *p;) {
+    item *it = *p;
+    if (it->pins_.load(std::memory_order_acquire)) {
+      p = &it->next_;
+      continue;
+    }
+
+    *p = it->next_;
+    --pinned_items_.size_;
+    free_inl(it);
+  }
+}
+
+void cache::release_inl(item *it) {
+  if (!it->pins_.load(std::memory_order_acquire)) {
+    free_inl(it);
+    return;
+  }
+
+  it->next_ = pinned_items_.head_;
+  pinned_items_.head_ = it;
+  ++pinned_items_.size_;
+}
+
+void cache::free_inl(item *it) {
+  assert(!(it->flags_ & item::LINKED));
+
+  it->flags_ = 0;
+  slab_.free(it, it->class_);
+}
+
+void cache::clear_inl() {
+  std::fill(reclaim_.begin(), reclaim_.end(), false);
+  reclaim_wanted_.store(false, std::memory_order_relaxed);
+
+  for (size_t cls = 0; cls < slab_.classes(); ++cls) {
+    size_t chunks = slab_.pages(cls) * slab_.chunks_per_page(cls);
+    for (size_t i = 0; i < chunks; ++i) {
+      item *it = class_chunk(cls, i);
+      if (it->flags_ & item::LINKED) {
+        unlink_inl(it);
+      }
+    }
+  }
+
+  collect_inl(true);
 }
 }
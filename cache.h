@@ -1,12 +1,12 @@
 #pragma once
 
 #include <assert.h>
-#include <unordered_map>
+#include <atomic>
 #include <vector>
-#include <list>
 #include <string.h>
 #include <functional>
 #include <mutex>
+#include <shared_mutex>
 #include <memory>
 #include <iostream>
 
@@ -14,222 +14,1229 @@
 #include "limits.h"
 #include "util.h"
 #include "murmur3_hash.h"
+#include "hash_index.h"
+#include "slab.h"
+#include "stats.h"
+#include "frequency_sketch.h"
+#include "timer_wheel.h"
+#include "clock.h"
+#include "epoch.h"
+#include "iobuf.h"
 
 namespace memcache {
 /*!
- * \brief LRU cache. Lookups using std::unordered_map and LRU using
- * std::list.
+ * \brief Cache. Lookups using an open addressing hash_index, and eviction
+ * per slab class using LRU, CLOCK or a segmented LRU (see eviction_policy).
  *
- * All external operations a locked using a std::mutex.
- * We reclaim entries when we run out of pre-set memory capacity.
+ * Items are stored in chunks of a slab allocator, and the cache memory
+ * (slab pages plus the index) is kept under the pre-set capacity. When a
+ * slab class runs out of chunks, we evict an item of the class, or take
+ * a page away from another class.
+ *
+ * With LRU, items are kept in intrusive lists, one per slab class, and hits
+ * move the item to the head of its list. With CLOCK, hits only set the item
+ * reference bit, and a hand sweeps over the chunks of the class to find an
+ * item to evict, clearing the reference bits on its way. Gets then only
+ * take the cache lock shared.
+ *
+ * Items set with an expiration time are misses once expired, and are freed
+ * by a timer_wheel driven from the clock thread (see expire), so expired
+ * items don't hold on to memory until they are evicted.
+ *
+ * The segmented LRU splits the list of each class into hot, warm and cold
+ * segments. New items go to hot, and flow from the hot tail to cold, or to
+ * warm if they were hit twice. Cold items move to warm on their second hit,
+ * and items are evicted from the cold tail. Hits don't move hot and warm
+ * items: they are only marked, and warm items which were hit get another
+ * round in warm when they reach its tail, otherwise they are demoted to cold.
+ *
+ * With TinyLFU admission (LRU and segmented LRU only), new items enter a
+ * small window LRU per class. Once memory is full, the item at the window
+ * tail only moves on to the main lists by evicting their victim if it was
+ * accessed more often, as estimated by a frequency_sketch of the key hashes
+ * of gets and sets. Otherwise the window item is evicted.
+ *
+ * Eviction mostly happens in the background (see reclaimer): once the free
+ * chunks of a class drop under the low watermark, the reclaimer evicts from
+ * the class LRU in small batches until they are back over the high
+ * watermark. Sets only evict inline if the reclaimer falls behind.
+ *
+ * All external operations a locked using a std::mutex, unless the cache
+ * is owned by a single thread (see CPUPoolExecutor), in which case locking
+ * is skipped altogether.
  */
   struct cache {
 
     /*!
      * \brief Cache key.
      */
-		struct key {
+    struct key {
       explicit key(const char* d, size_t len,
                    size_t memsize = 0) :
           key_ptr_(d), length_(len), value_size_(memsize) {}
 
-			const char* key_ptr_ = nullptr;
-			size_t length_ = 0;
-			size_t value_size_ = 0;
+      const char* key_ptr_ = nullptr;
+      size_t length_ = 0;
+      size_t value_size_ = 0;
 
-			bool operator==(const key& k) const {
-				if (this == &k) {
-					return true;
+      bool operator==(const key& k) const {
+        if (this == &k) {
+          return true;
         }
 
-				if (length_ != k.length_) {
-					return false;
-				}
+        if (length_ != k.length_) {
+          return false;
+        }
 
-				return length_ == 0 || ::memcmp(key_ptr_, k.key_ptr_, length_) == 0;
-			}
-		};
+        return length_ == 0 || ::memcmp(key_ptr_, k.key_ptr_, length_) == 0;
+      }
+    };
 
     /*!
-     * \brief Cache value.
-     * Stores the entire write packet and also the LRU reference.
+     * \brief Set request.
+     * Holds the entire write packet. Only the key, value and extras are
+     * copied into the item.
      */
-		struct value {
-      explicit value(std::string&& d, const protocol_binary_request_header& h)
-          :data_str_(std::move(d)), header_(h) {
-        assert(data_str_.size() >= header_.request.extlen + sizeof(header_));
+    struct value {
+      explicit value(iobuf&& d, const protocol_binary_request_header& h)
+          :data_(std::move(d)), header_(h) {
+        data_.coalesce();
+        assert(data_.size() >= header_.request.extlen + sizeof(header_));
       }
 
-      value(value&& v) :data_str_(std::move(v.data_str_)), header_(v.header_),
-                      lru_ref_(v.lru_ref_) {}
+      explicit value(std::string&& d, const protocol_binary_request_header& h)
+          :value(iobuf(std::move(d)), h) {}
 
-      std::string data_str_;
-			protocol_binary_request_header header_;
+      value(value&& v) :data_(std::move(v.data_)), header_(v.header_) {}
 
-      typedef std::list<key>::iterator lru_ref;
-      lru_ref lru_ref_;
+      /*!
+       * \brief The packet, contiguous. Usually a slice of the receive buffer
+       * the packet was read into.
+       */
+      iobuf data_;
+      protocol_binary_request_header header_;
 
-			key get_key() const {
-				return key(data_str_.data() + sizeof(header_) + header_.request.extlen
-						,header_.request.keylen
-						,data_str_.size()
-						);
-			}
+      key get_key() const {
+        return key(data_.data() + sizeof(header_) + header_.request.extlen
+            ,header_.request.keylen
+            ,data_.size()
+            );
+      }
 
       protocol_binary_request_header* header() const {
-        return (protocol_binary_request_header* ) data_str_.data();
+        return (protocol_binary_request_header* ) data_.data();
       }
 
       const size_t packet_data_len() const {
-        return data_str_.size() - header_.request.extlen - sizeof(header_);
+        return data_.size() - header_.request.extlen - sizeof(header_);
       }
 
-			const char* packet_user_data() const {
-        return data_str_.data() + header_.request.extlen + sizeof(header_);
-			}
+      const char* packet_user_data() const {
+        return data_.data() + header_.request.extlen + sizeof(header_);
+      }
 
-			const size_t packet_value_len() const {
-				return packet_data_len() - header_.request.keylen;
-			}
+      const size_t packet_value_len() const {
+        return packet_data_len() - header_.request.keylen;
+      }
 
-      const char* get_value() {
+      const char* get_value() const {
         return packet_user_data() + header_.request.keylen;
       }
 
-			void set_lru(lru_ref it) {
-				lru_ref_ = it;
-			}
+      /*!
+       * \brief Flags from the extras, in network byte order.
+       */
+      uint32_t flags() const {
+        uint32_t f;
+        memcpy(&f, data_.data() + sizeof(header_), sizeof(f));
+        return f;
+      }
+
+      /*!
+       * \brief Expiration from the extras, after the flags.
+       */
+      uint32_t exptime() const {
+        uint32_t e;
+        memcpy(&e, data_.data() + sizeof(header_) + sizeof(uint32_t), sizeof(e));
+        return ntohl(e);
+      }
+
+    private:
+      value(const value&) = delete;
+      value& operator=(const value&) = delete;
+    };
+
+    /*!
+     * \brief Cached item, placed in a slab chunk.
+     * The header is followed by the key and the value. Encoded items also
+     * have the GET response header and flags right before the value, ready
+     * to send but for the opaque of the request.
+     */
+    struct item {
+      enum flags {
+        /*!
+         * The chunk holds an item. Cleared once the chunk is freed.
+         */
+        ALLOCATED = 1,
+        /*!
+         * The item is in the index and LRU.
+         */
+        LINKED = 2,
+        /*!
+         * The item has a pre-encoded GET response.
+         */
+        ENCODED = 4,
+      };
+
+      /*!
+       * \brief Size of the pre-encoded GET response before the value.
+       */
+      static const size_t RESPONSE_PREFIX_SIZE = sizeof(protocol_binary_response_header) + sizeof(uint32_t);
+
+      /*!
+       * \brief Expiry timer, with the expiry time or 0 for never. The timer
+       * links overlap the slab free list links once freed.
+       */
+      timer_node timer_;
 
-		private:
-			value(const value&) = delete;
-			value& operator=(const value&) = delete;
-		};
+      /*!
+       * \brief LRU links. Once unlinked, next_ links the retired items, and
+       * retired_ has the epoch the item was retired with.
+       */
+      union {
+        item* prev_;
+        uint64_t retired_;
+      };
+      item* next_;
 
-    cache(size_t capacity = 0) : capacity_(capacity) {
-      if (capacity_ == 0) {
-        capacity_ = DEFAULT_CACHE_CAPACITY;
+      uint64_t cas_;
+      uint32_t value_len_;
+
+      /*!
+       * \brief Flags set by the client, in network byte order.
+       */
+      uint32_t client_flags_;
+      uint16_t keylen_;
+      uint8_t class_;
+      uint8_t flags_;
+
+      /*!
+       * \brief LRU segment, see segment.
+       */
+      uint8_t segment_;
+
+      /*!
+       * \brief Reference bit for CLOCK eviction, set on hits which may only
+       * hold the cache lock shared. Hits so far in the segment, up to 2,
+       * for the segmented LRU.
+       */
+      std::atomic<uint8_t> ref_;
+
+      /*!
+       * \brief Pins held by responses sending the item (see pinned_item).
+       */
+      std::atomic<uint16_t> pins_;
+
+      char data_[];
+
+      key get_key() const {
+        return key(data_, keylen_, keylen_ + value_len_);
       }
 
-      assert(capacity_);
+      const char* get_value() const {
+        return data_ + keylen_ + (flags_ & ENCODED ? RESPONSE_PREFIX_SIZE : 0);
+      }
 
-      size_t unit_mem =  sizeof(protocol_binary_request_header) + (MAX_VALUE_SIZE + MAX_KEY_SIZE);
+      size_t value_len() const {
+        return value_len_;
+      }
 
-      // Twice the number of max sized values.
-      // XXX TODO Make this pluggable.
-      size_t items = 2 * (capacity_/unit_mem);
+      uint64_t cas() const {
+        return cas_;
+      }
 
-      // XXX TODO set according to optimal load factor.
-      lookup_.reserve(items);
-    }
+      uint32_t client_flags() const {
+        return client_flags_;
+      }
 
-		~cache() {}
+      bool encoded() const {
+        return flags_ & ENCODED;
+      }
+
+      /*!
+       * \brief Pre-encoded GET response, of response_len bytes.
+       */
+      const char* response() const {
+        assert(encoded());
+        return data_ + keylen_;
+      }
+
+      size_t response_len() const {
+        return RESPONSE_PREFIX_SIZE + value_len_;
+      }
+
+      /*!
+       * \brief Encode the GET response from the item fields.
+       */
+      void encode_response() {
+        protocol_binary_response_header r;
+        memset(&r, 0, sizeof(r));
+        r.response.magic = (uint8_t) PROTOCOL_BINARY_RES;
+        r.response.opcode = (uint8_t) PROTOCOL_BINARY_CMD_GET;
+        r.response.datatype = (uint8_t) PROTOCOL_BINARY_RAW_BYTES;
+        r.response.extlen = (uint8_t) sizeof(client_flags_);
+        r.response.bodylen = htonl((uint32_t) (sizeof(client_flags_) + value_len_));
+        r.response.cas = htonll(cas_);
+
+        char* p = data_ + keylen_;
+        memcpy(p, &r, sizeof(r));
+        memcpy(p + sizeof(r), &client_flags_, sizeof(client_flags_));
+        flags_ |= ENCODED;
+      }
+
+      uint32_t exptime() const {
+        return timer_.expires_;
+      }
+
+      bool expired(uint32_t now) const {
+        return timer_.expires_ && timer_.expires_ <= now;
+      }
+
+      static item* from_timer(timer_node* n) {
+        return reinterpret_cast<item*>(n);
+      }
+    };
+
+    /*!
+     * \brief Item pinned while its memory is sent to a socket.
+     * Counted on the item rather than announced in the epoch domain, so
+     * that slow sends only keep their own items from being freed. Pinned
+     * items may be unlinked, in which case they are freed once unpinned.
+     */
+    class pinned_item {
+    public:
+      pinned_item() {}
+
+      explicit pinned_item(item* it) : it_(it) {}
+
+      pinned_item(pinned_item&& p) : it_(p.it_) {
+        p.it_ = nullptr;
+      }
+
+      pinned_item& operator=(pinned_item&& p) {
+        if (this != &p) {
+          reset();
+          it_ = p.it_;
+          p.it_ = nullptr;
+        }
+        return *this;
+      }
+
+      ~pinned_item() {
+        reset();
+      }
+
+      void reset() {
+        if (it_) {
+          it_->pins_.fetch_sub(1, std::memory_order_release);
+          it_ = nullptr;
+        }
+      }
+
+      const item* get() const {
+        return it_;
+      }
+
+      explicit operator bool() const {
+        return it_ != nullptr;
+      }
+
+    private:
+      item* it_ = nullptr;
+
+      pinned_item(const pinned_item&) = delete;
+      pinned_item& operator=(const pinned_item&) = delete;
+    };
+
+    /*!
+     * \brief Reference to an item.
+     * Keeps the item memory from being reused until released, by reading
+     * in the epoch domain of the cache (when locked), so there is no count
+     * to update on the item. Sets and reclaims of the cache may wait for
+     * the reference to be released under the cache lock, so the thread
+     * holding it should not wait for another thread to take the lock.
+     */
+    class item_ptr {
+    public:
+      item_ptr() {}
+
+      item_ptr(item* it, epoch_domain::slot* s) : it_(it), slot_(s) {}
+
+      item_ptr(item_ptr&& p) : it_(p.it_), slot_(p.slot_) {
+        p.it_ = nullptr;
+        p.slot_ = nullptr;
+      }
+
+      item_ptr& operator=(item_ptr&& p) {
+        if (this != &p) {
+          reset();
+          it_ = p.it_;
+          slot_ = p.slot_;
+          p.it_ = nullptr;
+          p.slot_ = nullptr;
+        }
+        return *this;
+      }
+
+      ~item_ptr() {
+        reset();
+      }
+
+      void reset();
+
+      /*!
+       * \brief Pin the item, and release the reference.
+       */
+      pinned_item pin() {
+        assert(it_);
+        it_->pins_.fetch_add(1, std::memory_order_relaxed);
+        pinned_item p(it_);
+        reset();
+        return p;
+      }
+
+      item* get() const {
+        return it_;
+      }
+
+      item* operator->() const {
+        return it_;
+      }
+
+      explicit operator bool() const {
+        return it_ != nullptr;
+      }
+
+    private:
+      item* it_ = nullptr;
+      epoch_domain::slot* slot_ = nullptr;
+
+      item_ptr(const item_ptr&) = delete;
+      item_ptr& operator=(const item_ptr&) = delete;
+    };
+
+    /*!
+     * \brief Item of a set whose value is still being received (see reserve).
+     * The value is written straight into the item memory, then the item is
+     * linked by commit. Until then, no other thread sees the item and its
+     * page is not taken away. The item is freed if the reservation is reset
+     * before the commit, e.g. when the client disconnects.
+     */
+    class reserved_item {
+    public:
+      reserved_item() {}
+
+      reserved_item(cache* c, item* it, char* value, uint32_t hash)
+          : c_(c), it_(it), value_(value), hash_(hash) {}
+
+      reserved_item(reserved_item&& r)
+          : c_(r.c_), it_(r.it_), value_(r.value_), hash_(r.hash_) {
+        r.it_ = nullptr;
+      }
+
+      reserved_item& operator=(reserved_item&& r) {
+        if (this != &r) {
+          reset();
+          c_ = r.c_;
+          it_ = r.it_;
+          value_ = r.value_;
+          hash_ = r.hash_;
+          r.it_ = nullptr;
+        }
+        return *this;
+      }
+
+      ~reserved_item() {
+        reset();
+      }
+
+      /*!
+       * \brief Free the item, unless committed.
+       */
+      void reset();
+
+      /*!
+       * \brief Link the item, once its value is written, replacing the existing one.
+       * @param cas Only replace an existing item with this cas, unless 0.
+       * @return False if the cas did not match, in which case the item is freed.
+       */
+      bool commit(uint64_t cas);
+
+      /*!
+       * \brief Where to write the value, of value_len bytes.
+       */
+      char* value() const {
+        return value_;
+      }
+
+      size_t value_len() const {
+        return it_->value_len_;
+      }
+
+      explicit operator bool() const {
+        return it_ != nullptr;
+      }
+
+    private:
+      cache* c_ = nullptr;
+      item* it_ = nullptr;
+      char* value_ = nullptr;
+      uint32_t hash_ = 0;
+
+      reserved_item(const reserved_item&) = delete;
+      reserved_item& operator=(const reserved_item&) = delete;
+    };
+
+    /*!
+     * \brief Segments of the segmented LRU. Other policies only use HOT,
+     * and the TinyLFU window.
+     */
+    enum segment {
+      HOT = 0,
+      WARM,
+      COLD,
+      WINDOW,
+      SEGMENTS,
+    };
+
+    /*!
+     * \brief Cache counters.
+     */
+    struct cache_stats {
+      /*!
+       * \brief Items evicted on the set path.
+       */
+      counter inline_reclaims_;
+      /*!
+       * \brief Items evicted by the background reclaimer.
+       */
+      counter background_reclaims_;
+      /*!
+       * \brief Items moved to the warm segment, and from warm to cold.
+       */
+      counter promotions_;
+      counter demotions_;
+      /*!
+       * \brief TinyLFU window items which evicted a main item, or were evicted.
+       */
+      counter admitted_;
+      counter rejected_;
+      /*!
+       * \brief Expired items freed.
+       */
+      counter expired_;
+    };
+
+    cache(size_t capacity = 0, bool locked = true,
+          eviction_policy policy = eviction_policy::LRU,
+          admission_policy admission = admission_policy::NONE,
+          bool encoded = true);
+
+    ~cache() {}
 
     /*!
      * \brief Reset capacity. Used for testing.
      * @param capacity
      */
     void rehash(size_t capacity) {
-      clear();
+      auto l = lock();
+      clear_inl();
 
       assert(capacity);
       capacity_ = capacity;
+      reset_sketch_inl();
+      shrink_inl();
+    }
+
+    item_ptr get(const key& k) {
+      return get(k, hash(k));
+    }
+
+    /*!
+     * \brief Get, with the key hash already computed.
+     */
+    item_ptr get(const key& k, uint32_t hash) {
+      // CLOCK hits only set the reference bit, so gets can share the lock.
+      if (policy_ == eviction_policy::CLOCK) {
+        auto l = shared_lock();
+        return get_ref_inl(k, hash);
+      }
+
+      auto l = lock();
+      return get_ref_inl(k, hash);
+    }
+
+    /*!
+     * \brief Set.
+     * @return False if there was no memory for the item.
+     */
+    bool set(value v) {
+      uint32_t h = hash(v.get_key());
+      return set(std::move(v), h);
+    }
+
+    bool set(value v, uint32_t hash) {
+      auto l = lock();
+      return set_inl(std::move(v), hash);
     }
 
-		std::shared_ptr<value> get(const key& k) {
-      std::unique_lock<std::mutex> lock(mutex_);
-      return get_inl(k);
+    /*!
+     * \brief Set, if the cas of the existing item matches.
+     * @return False if the cas did not match, or there was no memory for the item.
+     */
+    bool cas(value v, uint64_t cas) {
+      uint32_t h = hash(v.get_key());
+      return this->cas(std::move(v), cas, h);
     }
 
-		void set(value v) {
-      std::unique_lock<std::mutex> lock(mutex_);
-      set_inl(std::move(v));
+    bool remove(const value& v, uint64_t cas) {
+      return remove(v, cas, hash(v.get_key()));
     }
 
-		bool cas(value v, uint64_t cas);
-		bool remove(const value& v, uint64_t cas);
+    bool cas(value v, uint64_t cas, uint32_t hash);
+    bool remove(const value& v, uint64_t cas, uint32_t hash);
+
+    /*!
+     * \brief Get a batch of keys, under a single lock. The lookups are done
+     * in passes over the batch, prefetching the index and then the items, so
+     * their cache misses overlap.
+     * @param keys Keys.
+     * @param hashes Key hashes.
+     * @param idx Indexes of the keys to get, in keys and hashes.
+     * @param n Number of indexes.
+     * @param out Items, at the index of their key. Left empty on a miss.
+     */
+    void get_many(const key* keys, const uint32_t* hashes, const uint32_t* idx, size_t n,
+                  item_ptr* out);
+
+    /*!
+     * \brief Set a batch, under a single lock. Room is made for the whole
+     * batch up front: the chunks each slab class needs are counted, and the
+     * items to make room for them are evicted together and collected once,
+     * rather than evicting as each set runs out of room.
+     * @param v Set requests, checking the cas of those which have one.
+     * @param hashes Key hashes.
+     * @param idx Indexes of the sets to do, in v and hashes, in order.
+     * @param n Number of indexes.
+     * @param out Whether each set was done, at the index of its request:
+     * false if the cas did not match, or there was no memory for the item.
+     */
+    void set_many(value* v, const uint32_t* hashes, const uint32_t* idx, size_t n, bool* out);
+
+    /*!
+     * \brief Allocate the item of a set ahead of its value, so the value can
+     * be received straight into the item memory. Only for locked caches.
+     * @param h Set request header, in host byte order.
+     * @param body The extras and key of the request, which are copied.
+     * @param hash Key hash.
+     * @return The reservation, empty if there was no memory for the item.
+     */
+    reserved_item reserve(const protocol_binary_request_header& h, const char* body, uint32_t hash);
 
     size_t count() const {
       return lookup_.size();
     }
 
     void clear() {
-      if (size_)
-        reclaim(size_);
+      auto l = lock();
+      clear_inl();
+    }
+
+    /*!
+     * \brief Memory used, in bytes. Includes the slab pages and the index.
+     */
+    size_t size() const {
+      return slab_.pages() * slab_.page_size() + lookup_.memory() + sketch_memory();
+    }
+
+    size_t capacity() const {
+      return capacity_;
+    }
+
+    /*!
+     * \brief Bytes of slab chunks holding items.
+     */
+    size_t used() const {
+      return used_;
+    }
+
+    const cache_stats& stats() const {
+      return stats_;
+    }
+
+    eviction_policy policy() const {
+      return policy_;
+    }
+
+    admission_policy admission() const {
+      return admission_;
+    }
+
+    /*!
+     * \brief Number of items in an LRU segment, across the slab classes.
+     */
+    size_t segment_count(segment seg) const {
+      size_t n = 0;
+      for (size_t cls = 0; cls < slab_.classes(); ++cls) {
+        n += lru(cls, seg).size_;
+      }
+      return n;
+    }
+
+    /*!
+     * \brief Items and memory of the cache, as reported by STAT.
+     */
+    struct cache_usage {
+      size_t count_ = 0;
+      size_t size_ = 0;
+      size_t used_ = 0;
+      size_t segments_[SEGMENTS] = {};
+    };
+
+    /*!
+     * \brief Read the items and memory together, under the shared lock.
+     * Unlocked, the sizes they are read from are gauges, so they can be
+     * read while the owner of the cache updates them (e.g. by STAT on
+     * another CPU executor), if not all at the same point.
+     */
+    cache_usage usage() const {
+      auto l = shared_lock();
+      cache_usage u;
+      u.count_ = count();
+      u.size_ = size();
+      u.used_ = used();
+      for (int seg = 0; seg < SEGMENTS; ++seg) {
+        u.segments_[seg] = segment_count((segment) seg);
+      }
+      return u;
+    }
+
+    /*!
+     * \brief Enable background reclaim.
+     * @param low Low watermark, in percent of the memory of a slab class.
+     * Reclaim starts when the free chunks of a class drop under it, and there
+     * are no more pages to add to the class. 0 disables background reclaim.
+     * @param high High watermark, in percent. Reclaim stops when the free
+     * chunks of the class reach it.
+     * @param notify Called when reclaim is wanted, under the cache lock.
+     */
+    void set_watermarks(size_t low, size_t high, std::function<void()> notify = nullptr);
+
+    /*!
+     * \brief Whether some class is under the low watermark. Does not lock.
+     */
+    bool reclaim_wanted() const {
+      return reclaim_wanted_.load(std::memory_order_relaxed);
     }
-	
-	private:
+
+    /*!
+     * \brief Background reclaim. Evict from the LRU of the classes under the
+     * low watermark, until they reach the high watermark.
+     * @param max_items Most items to evict, to bound the time the lock is held.
+     * @return Number of items evicted.
+     */
+    size_t reclaim(size_t max_items);
+
+    /*!
+     * \brief Free the items which expired by now.
+     * @param max_items Most items to free, to bound the time the lock is held.
+     * @return Number of items freed.
+     */
+    size_t expire(size_t max_items);
+
+    /*!
+     * \brief Key hasher. Also used by sharded_cache to pick the shard.
+     */
     struct hasher {
       size_t operator()(const key& k) const {
         return MurmurHash3_x86_32(k.key_ptr_, k.length_);
       }
     };
 
-    std::mutex mutex_;
-		size_t capacity_ = 0;
-		size_t size_ = 0;
-    std::unordered_map<key, std::shared_ptr<value>, hasher> lookup_;
-    std::list<key> lru_;
+    static uint32_t hash(const key& k) {
+      return (uint32_t) hasher()(k);
+    }
+
+  private:
+    /*!
+     * \brief Intrusive LRU list. Most recently used at the head.
+     */
+    struct lru_list {
+      item* head_ = nullptr;
+      item* tail_ = nullptr;
+      gauge<size_t> size_;
+    };
+
+    mutable std::shared_timed_mutex mutex_;
+    bool locked_ = true;
+    eviction_policy policy_ = eviction_policy::LRU;
+    admission_policy admission_ = admission_policy::NONE;
+    bool encoded_ = true;
+    size_t capacity_ = 0;
+    gauge<size_t> used_;
+    hash_index<key, item*, hasher> lookup_;
+    slab_allocator slab_;
+    std::vector<lru_list> lru_;
 
-		cache(const cache&) = delete;
-		cache& operator=(cache&) = delete;
+    lru_list& lru(int cls, int seg) {
+      return lru_[cls * SEGMENTS + seg];
+    }
+
+    const lru_list& lru(int cls, int seg) const {
+      return lru_[cls * SEGMENTS + seg];
+    }
 
     /*!
-     * \brief Reclaim size worth of entires using LRU.
-     * @param size
+     * \brief CLOCK hand of each class, as the index of the next chunk to
+     * look at across the class pages.
      */
-    void reclaim(size_t size);
+    std::vector<size_t> clock_hand_;
 
-    std::shared_ptr<value> get_inl(const key& k) {
-      auto it = lookup_.find(k);
-      if (it == lookup_.end())
-        return std::shared_ptr<value>();
+    /*!
+     * \brief Access frequencies, for TinyLFU admission.
+     */
+    std::unique_ptr<frequency_sketch> sketch_;
 
-      assert(!lru_.empty());
+    /*!
+     * \brief Readers of the items, and the unlinked items they may still
+     * read, oldest first.
+     */
+    epoch_domain epoch_;
+    lru_list retired_items_;
+
+    /*!
+     * \brief Unlinked items waiting to be unpinned.
+     */
+    lru_list pinned_items_;
+
+    /*!
+     * \brief Expiry timers of the items with an expiration time.
+     */
+    timer_wheel wheel_;
+    cache_stats stats_;
+
+    /*!
+     * \brief Background reclaim state.
+     */
+    size_t low_watermark_ = 0;
+    size_t high_watermark_ = 0;
+    std::vector<bool> reclaim_;
+    std::atomic<bool> reclaim_wanted_{false};
+    std::function<void()> notify_;
+
+    cache(const cache&) = delete;
+    cache& operator=(cache&) = delete;
 
-      // Reset LRU.
-      if (it->second->lru_ref_ != --lru_.end()) {
-        lru_.splice(lru_.end(), lru_, it->second->lru_ref_);
+    /*!
+     * \brief Take the cache lock. Not taken if the cache is owned by a single thread.
+     */
+    std::unique_lock<std::shared_timed_mutex> lock() {
+      if (!locked_) {
+        return std::unique_lock<std::shared_timed_mutex>(mutex_, std::defer_lock);
       }
 
-      return it->second;
+      return std::unique_lock<std::shared_timed_mutex>(mutex_);
     }
 
-    void set_inl(value v) {
-      key k = v.get_key();
+    /*!
+     * \brief Take the cache lock shared, for gets with CLOCK eviction, and stats.
+     */
+    std::shared_lock<std::shared_timed_mutex> shared_lock() const {
+      if (!locked_) {
+        return std::shared_lock<std::shared_timed_mutex>(mutex_, std::defer_lock);
+      }
+
+      return std::shared_lock<std::shared_timed_mutex>(mutex_);
+    }
 
-      auto it = lookup_.find(k);
-      if (it != lookup_.end()) {
-        bool ret = delete_inl(k);
-        assert(ret);
+    /*!
+     * \brief Allocate a chunk for an item of the given size, evicting if needed.
+     * @return Item, or nullptr.
+     */
+    item* alloc_inl(size_t size);
+
+    /*!
+     * \brief Evict to free a chunk of the class.
+     * @return True if a chunk was freed.
+     */
+    bool evict_inl(int cls);
+
+    /*!
+     * \brief Evict an item of the class which is not referenced: the least
+     * recently used one, or the next one the CLOCK hand finds unreferenced.
+     * @param admission_only With TinyLFU, only evict through the admission
+     * contest, so the background reclaimer doesn't evict popular items once
+     * the window is empty.
+     * @return True if an item was evicted.
+     */
+    bool evict_item_inl(int cls, bool admission_only = false);
+
+    /*!
+     * \brief Evict from the tail of an LRU list, skipping referenced items.
+     * @return True if an item was evicted.
+     */
+    bool evict_tail_inl(lru_list& l);
+
+    /*!
+     * \brief TinyLFU eviction: evict either the window tail or the victim of
+     * the main lists, whichever was accessed less. The window tail moves on
+     * to the main lists if it wins, and the window is full.
+     * @return True if an item was evicted.
+     */
+    bool evict_admission_inl(int cls);
+
+    /*!
+     * \brief Number of items in the TinyLFU window of the class.
+     */
+    size_t window_limit(int cls) const {
+      size_t n = slab_.pages(cls) * slab_.chunks_per_page(cls) * TINYLFU_WINDOW_PERCENT / 100;
+      return n ? n : 1;
+    }
+
+    /*!
+     * \brief Move the items over the window limit to the main lists.
+     */
+    void balance_window_inl(int cls);
+
+    /*!
+     * \brief (Re)create the frequency sketch, sized for the capacity.
+     */
+    void reset_sketch_inl();
+
+    size_t sketch_memory() const {
+      return sketch_ ? sketch_->memory() : 0;
+    }
+
+    /*!
+     * \brief Least recently used item of the class: the tail of cold, warm
+     * or hot, in that order, for the segmented LRU.
+     */
+    const item* lru_tail(int cls) const;
+
+    /*!
+     * \brief Sweep the CLOCK hand of the class until it finds an item to evict.
+     * @return True if an item was evicted.
+     */
+    bool evict_clock_inl(int cls);
+
+    /*!
+     * \brief Item in the i-th chunk of the class, across its pages.
+     */
+    item* class_chunk(int cls, size_t i) const {
+      size_t n = slab_.chunks_per_page(cls);
+      char *mem = slab_.page_memory(slab_.class_page(cls, i / n));
+      return reinterpret_cast<item*>(mem + (i % n) * slab_.chunk_size(cls));
+    }
+
+    /*!
+     * \brief Whether the free chunks of the class are under the watermark
+     * (rounded down to whole chunks), with no more pages to add to the class.
+     * @param percent Watermark.
+     */
+    bool under_watermark_inl(int cls, size_t percent) const;
+
+    /*!
+     * \brief Ask for background reclaim if the class dropped under the low watermark.
+     */
+    void check_watermark_inl(int cls);
+
+    /*!
+     * \brief Pick a slab page to take away from its class: the page holding
+     * the least recently used item of the class with the most pages, or the
+     * page under the CLOCK hand.
+     * @param exclude Class to leave alone, or -1.
+     * @return Page index, or -1.
+     */
+    long victim_page_inl(int exclude) const;
+
+    /*!
+     * \brief Evict all the items in a slab page.
+     * @return False if some of the items are still referenced by the
+     * calling thread or pinned, in which case the page is not free.
+     */
+    bool evict_page_inl(size_t page);
+
+    /*!
+     * \brief Release slab pages until the memory is under capacity.
+     */
+    void shrink_inl();
+
+    /*!
+     * \brief Number of slab pages that fit in the capacity, next to the index.
+     */
+    size_t max_pages() const {
+      size_t index = lookup_.memory() + sketch_memory();
+      return capacity_ > index ? (capacity_ - index) / slab_.page_size() : 0;
+    }
+
+    void link_inl(item* it, uint32_t hash);
+    void unlink_inl(item* it, uint32_t hash);
+
+    void unlink_inl(item* it) {
+      unlink_inl(it, hash(it->get_key()));
+    }
+
+    /*!
+     * \brief Retire an unlinked item, to be freed once no thread reads it.
+     */
+    void retire_inl(item* it);
+
+    /*!
+     * \brief Free the retired items no thread reads anymore, and the
+     * unlinked items which are no longer pinned.
+     * @param wait Wait for the other threads reading retired items to be done.
+     */
+    void collect_inl(bool wait);
+
+    /*!
+     * \brief Free the unlinked items which are no longer pinned.
+     */
+    void collect_pinned_inl();
+
+    /*!
+     * \brief Free an unlinked item which no thread reads, unless pinned.
+     */
+    void release_inl(item* it);
+
+    void free_inl(item* it);
+    void clear_inl();
+
+    void lru_push(item* it) {
+      lru_list& l = lru(it->class_, it->segment_);
+      ++l.size_;
+      it->prev_ = nullptr;
+      it->next_ = l.head_;
+      if (l.head_) {
+        l.head_->prev_ = it;
+      } else {
+        l.tail_ = it;
+      }
+      l.head_ = it;
+    }
+
+    void lru_remove(item* it) {
+      lru_list& l = lru(it->class_, it->segment_);
+      --l.size_;
+      if (it->prev_) {
+        it->prev_->next_ = it->next_;
+      } else {
+        l.head_ = it->next_;
+      }
+
+      if (it->next_) {
+        it->next_->prev_ = it->prev_;
+      } else {
+        l.tail_ = it->prev_;
+      }
+    }
+
+    item* get_inl(const key& k, uint32_t hash) {
+      item** v = lookup_.find(k, hash);
+      if (!v)
+        return nullptr;
+
+      item* it = *v;
+      if (it->expired(coarse_clock::now())) {
+        return nullptr;
+      }
+
+      touch_inl(it);
+      return it;
+    }
+
+    /*!
+     * \brief Hit. Reset the LRU position, or mark as referenced.
+     */
+    void touch_inl(item* it) {
+      if (policy_ == eviction_policy::CLOCK) {
+        if (!it->ref_.load(std::memory_order_relaxed)) {
+          it->ref_.store(1, std::memory_order_relaxed);
+        }
+      } else if (policy_ == eviction_policy::SEGMENTED) {
+        hit_segmented_inl(it);
+      } else if (lru(it->class_, it->segment_).head_ != it) {
+        lru_remove(it);
+        lru_push(it);
+      }
+    }
+
+    /*!
+     * \brief Move an item to the head of a segment.
+     */
+    void lru_move(item* it, segment seg) {
+      lru_remove(it);
+      it->segment_ = (uint8_t) seg;
+      it->ref_.store(0, std::memory_order_relaxed);
+      lru_push(it);
+    }
+
+    /*!
+     * \brief Segmented LRU hit. Promotes cold items on their second hit.
+     */
+    void hit_segmented_inl(item* it) {
+      uint8_t hits = it->ref_.load(std::memory_order_relaxed);
+      if (it->segment_ == COLD && hits) {
+        lru_move(it, WARM);
+        stats_.promotions_.add();
+      } else if (hits < 2) {
+        it->ref_.store(hits + 1, std::memory_order_relaxed);
       }
+    }
+
+    /*!
+     * \brief Move items down from the tails of the hot and warm segments of
+     * the class, until they are back under their limits.
+     */
+    void balance_inl(int cls);
+
+    void get_many_inl(const key* keys, const uint32_t* hashes, const uint32_t* idx, size_t n,
+                      item_ptr* out);
 
-      size_t mem = v.data_str_.length();
+    /*!
+     * \brief Make room for a number of new items in a slab class: add pages
+     * while there are pages left, then evict what is still missing.
+     */
+    void make_room_inl(int cls, size_t items);
 
-      if (mem + size_ > capacity_) {
-        // Free 5x the new item size.
-        // XXX TODO Make this a pluggable policy.
-        reclaim(5 * mem);
+    /*!
+     * \brief Get, taking a reference on the item.
+     */
+    item_ptr get_ref_inl(const key& k, uint32_t hash) {
+      // Misses count too, so that keys are admitted once they are popular.
+      if (sketch_) {
+        sketch_->increment(hash);
       }
 
-      auto it2 = lru_.insert(lru_.end(), k);
-      v.set_lru(it2);
+      item* it = get_inl(k, hash);
+      if (!it) {
+        return item_ptr();
+      }
 
-      lookup_.emplace(std::make_pair(k, std::make_shared<value>(std::move(v))));
-      size_ += mem;
+      // Only one thread uses an unlocked cache, which frees items right away.
+      return item_ptr(it, locked_ ? epoch_.enter() : nullptr);
     }
 
-    bool delete_inl(key k) {
-      auto it = lookup_.find(k);
-      if (it == lookup_.end()) {
+    bool set_inl(value v, uint32_t hash) {
+      item* it = alloc_item_inl(v.header_, v.data_.data() + sizeof(v.header_), hash);
+      if (!it) {
         return false;
       }
 
-      //remove from LRU
-      lru_.erase(it->second->lru_ref_);
-      lookup_.erase(it);
-      size_ -= k.value_size_;
+      memcpy(value_inl(it), v.get_value(), it->value_len_);
+      set_item_inl(it, hash);
       return true;
     }
-	};
 
-}
\ No newline at end of file
+    /*!
+     * \brief Allocate the item of a set, with the fields and key of the request.
+     * @param h Set request header, in host byte order.
+     * @param body The extras and key of the request.
+     * @return Item, with the value left to write, or nullptr.
+     */
+    item* alloc_item_inl(const protocol_binary_request_header& h, const char* body, uint32_t hash) {
+      if (sketch_) {
+        sketch_->increment(hash);
+      }
+
+      size_t keylen = h.request.keylen;
+      size_t value_len = h.request.bodylen - h.request.extlen - keylen;
+      size_t prefix = encoded_ ? item::RESPONSE_PREFIX_SIZE : 0;
+      item* it = alloc_inl(sizeof(item) + keylen + prefix + value_len);
+      if (!it) {
+        return nullptr;
+      }
+
+      // Extras are the flags, then the expiration.
+      uint32_t exptime;
+      memcpy(&it->client_flags_, body, sizeof(uint32_t));
+      memcpy(&exptime, body + sizeof(uint32_t), sizeof(exptime));
+
+      it->timer_.expires_ = coarse_clock::expiry(ntohl(exptime));
+      it->cas_ = h.request.cas;
+      it->value_len_ = (uint32_t) value_len;
+      it->keylen_ = (uint16_t) keylen;
+      memcpy(it->data_, body + h.request.extlen, keylen);
+      return it;
+    }
+
+    /*!
+     * \brief Where the value of an item being set goes, after the room for
+     * the pre-encoded response.
+     */
+    char* value_inl(item* it) const {
+      return it->data_ + it->keylen_ + (encoded_ ? item::RESPONSE_PREFIX_SIZE : 0);
+    }
+
+    /*!
+     * \brief Link an item whose value is written, replacing the existing item.
+     */
+    void set_item_inl(item* it, uint32_t hash) {
+      if (encoded_) {
+        it->encode_response();
+      }
+
+      // Replace the existing item. Looked up after the allocation, which may
+      // have evicted it.
+      delete_inl(it->get_key(), hash);
+
+      link_inl(it, hash);
+    }
+
+    /*!
+     * \brief Link the item of a reservation, see reserved_item::commit.
+     */
+    bool commit(item* it, uint64_t cas, uint32_t hash);
+
+    /*!
+     * \brief Free the item of a reservation which was not committed.
+     */
+    void cancel(item* it) {
+      auto l = lock();
+      free_inl(it);
+    }
+
+    bool delete_inl(const key& k, uint32_t hash) {
+      item** v = lookup_.find(k, hash);
+      if (!v) {
+        return false;
+      }
+
+      // Expired items are gone already, as far as clients can tell.
+      bool expired = (*v)->expired(coarse_clock::now());
+      unlink_inl(*v, hash);
+      return !expired;
+    }
+  };
+
+  inline void cache::item_ptr::reset() {
+    if (slot_) {
+      epoch_domain::leave(slot_);
+      slot_ = nullptr;
+    }
+    it_ = nullptr;
+  }
+
+  inline void cache::reserved_item::reset() {
+    if (it_) {
+      c_->cancel(it_);
+      it_ = nullptr;
+    }
+  }
+
+  inline bool cache::reserved_item::commit(uint64_t cas) {
+    assert(it_);
+    item* it = it_;
+    it_ = nullptr;
+    return c_->commit(it, cas, hash_);
+  }
+}
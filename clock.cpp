@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <chrono>
+#include <time.h>
+
+#include "clock.h"
+#include "limits.h"
+
+namespace memcache {
+
+std::atomic<uint32_t> coarse_clock::now_(1);
+const int64_t coarse_clock::started_ = (int64_t) ::time(nullptr) - 1;
+
+coarse_clock::~coarse_clock() {
+  {
+    std::unique_lock<std::mutex> lock(m_);
+    stop_ = true;
+  }
+  con_.notify_one();
+
+  if (processor_.get())
+    processor_->join();
+}
+
+uint32_t coarse_clock::expiry(uint32_t exptime) {
+  if (exptime == 0) {
+    return 0;
+  }
+
+  // Already expired.
+  if ((int32_t) exptime < 0) {
+    return 1;
+  }
+
+  if (exptime <= MAX_RELATIVE_EXPTIME) {
+    return now() + exptime;
+  }
+
+  // Absolute unix time.
+  int64_t t = (int64_t) exptime - started_;
+  return t > 1 ? (uint32_t) t : 1;
+}
+
+void coarse_clock::start(std::function<void(uint32_t)> tick) {
+  assert(!processor_);
+  tick_ = std::move(tick);
+  processor_.reset(new std::thread(std::bind(&coarse_clock::process, this)));
+}
+
+void coarse_clock::process() {
+  std::unique_lock<std::mutex> lock(m_);
+  while (!stop_) {
+    con_.wait_for(lock, std::chrono::seconds(1), [this] { return stop_; });
+    if (stop_) {
+      break;
+    }
+
+    // Only ever moves forward.
+    int64_t t = (int64_t) ::time(nullptr) - started_;
+    if (t > now()) {
+      now_.store((uint32_t) t, std::memory_order_relaxed);
+    }
+
+    if (tick_) {
+      lock.unlock();
+      tick_(now());
+      lock.lock();
+    }
+  }
+}
+}
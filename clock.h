@@ -0,0 +1,73 @@
+//
+// Coarse clock.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+
+namespace memcache {
+
+/*!
+ * \brief Coarse clock, in seconds since the process started.
+ *
+ * Read on every lookup, to check item expiry, so it is a relaxed atomic
+ * updated once a second by the clock thread rather than a time() call.
+ * Starts at 1, so that 0 can stand for "never".
+ */
+class coarse_clock {
+public:
+  coarse_clock() {}
+  ~coarse_clock();
+
+  static uint32_t now() {
+    return now_.load(std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Convert a protocol expiration to clock time.
+   * @param exptime 0 for never, seconds from now up to 30 days, and unix
+   * time beyond. Negative values are already expired.
+   * @return Clock time, or 0 for never.
+   */
+  static uint32_t expiry(uint32_t exptime);
+
+  /*!
+   * \brief Move the clock forward. Used for testing.
+   */
+  static void advance(uint32_t seconds) {
+    now_.fetch_add(seconds, std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Start the clock thread.
+   * @param tick Called from the clock thread after every update, with the new time.
+   */
+  void start(std::function<void(uint32_t)> tick = nullptr);
+
+private:
+  static std::atomic<uint32_t> now_;
+
+  /*!
+   * \brief Unix time at which the clock read 0.
+   */
+  static const int64_t started_;
+
+  std::function<void(uint32_t)> tick_;
+  std::mutex m_;
+  std::condition_variable con_;
+  bool stop_ = false;
+  std::unique_ptr<std::thread> processor_;
+
+  void process();
+
+  coarse_clock(const coarse_clock &) = delete;
+  coarse_clock &operator=(const coarse_clock &) = delete;
+};
+}
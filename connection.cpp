@@ -1,4 +1,5 @@
 #include "connection.h"
+#include "executor.h"
 #include "util.h"
 #include "protocol_binary.h"
 
@@ -11,91 +12,395 @@
 
 namespace memcache {
 
-bool connection::buffer_packet(buffer b) {
-  if (b.empty())
-    return true;
+output_stats connection::stats_;
+
+connection::~connection() {
+  // Drop the output nobody is going to read. The socket is left to close.
+  ep_ = nullptr;
+  update_queued(0, queued_);
+  ::close(fd_);
+}
+
+bool connection::read() {
+  while (!shutdown_ && !throttled()) {
+    char *dst;
+    size_t room;
+
+    if (set_item_) {
+      // Value of a large set, straight into the item.
+      dst = set_item_.value() + set_read_;
+      room = set_item_.value_len() - set_read_;
+    } else {
+      size_t have = recv_.size();
+
+      // Large packet, read its body straight into a block of its own size.
+      size_t want = RECV_BUFFER_SIZE;
+      if (header_.request.magic) {
+        want = std::max(want, sizeof(header_) + header_.request.bodylen);
+      }
+
+      // Start over in the block once the packets read into it are done with.
+      // Otherwise, when short of room, move the partial packet to a new block.
+      if (!have) {
+        recv_.reset();
+      }
+
+      room = want > RECV_BUFFER_SIZE ? want - have : RECV_BUFFER_SIZE / 4;
+      if (recv_.tailroom() < room) {
+        iobuf b = iobuf::create(want);
+        b.append(recv_);
+        recv_ = std::move(b);
+      }
+
+      // Read no further than the end of a large packet, so it has its block to itself.
+      dst = recv_.tail();
+      room = want > RECV_BUFFER_SIZE ? want - have : recv_.tailroom();
+    }
+
+    ssize_t count = ::read(fd_, dst, room);
+
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      } else if (errno == EINTR) {
+        continue;
+      }
+
+      std::cerr << "read error: " << fd_ << " err no:" << errno << std::endl;
+      return false;
+    }
+
+    // Closed by the peer.
+    if (!count) {
+      return false;
+    }
+
+    load_.add_bytes(count);
+
+    if (set_item_) {
+      set_read_ += count;
+      if (set_read_ == set_item_.value_len() && !commit_set()) {
+        return false;
+      }
+      continue;
+    }
 
-  // Check magic for new request.
-  if (request_.empty()) {
-    if (b[0] != PROTOCOL_BINARY_REQ) {
+    // A single write for the responses to all the packets received.
+    recv_.commit(count);
+    corked_ = true;
+    bool ok = parse();
+    corked_ = false;
+    if ((!quiet_ && !uncork()) || !ok) {
       return false;
     }
   }
 
-  size_t prev_size = request_.size();
+  return true;
+}
 
-  // Buffer request.
-  request_.insert(request_.end(), b.begin(), b.end());
+bool connection::parse() {
+  while (recv_.size() >= sizeof(header_)) {
+    assert(recv_.contiguous());
+    const char *p = recv_.data();
 
-  // Wait to receive header.
-  if (request_.size() < sizeof(protocol_binary_request_header))
-    return true;
+    // Validate header, once it has been received.
+    if (!header_.request.magic) {
+      // Check magic for new request.
+      if ((uint8_t) p[0] != PROTOCOL_BINARY_REQ) {
+        return false;
+      }
 
-  // Validate header.
-  assert (prev_size < sizeof(header_));
-  protocol_binary_request_header *h =
-      (protocol_binary_request_header *) (&request_[0]);
-  memcpy(&header_, h, sizeof(header_));
+      memcpy(&header_, p, sizeof(header_));
+      header_.request.keylen = ntohs(header_.request.keylen);
+      header_.request.bodylen = ntohl(header_.request.bodylen);
+      header_.request.cas = ntohll(header_.request.cas);
+
+      protocol_binary_response_status status = util::validate_header(header_);
+      if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        // Drop what was received.
+        if (!process_runs()) {
+          return false;
+        }
+        write_error(status);
+        recv_.clear();
+        return true;
+      }
+    }
+
+    // Wait to receive complete packet.
+    size_t size = sizeof(header_) + header_.request.bodylen;
+    if (recv_.size() < size) {
+      // Sets too large for the receive buffer go straight into the cache.
+      // The partitions of the CPU executors are only touched on their threads.
+      if (!cpu_pool_ && util::is_set(header_.request.opcode) && size > RECV_BUFFER_SIZE &&
+          recv_.size() >= sizeof(header_) + header_.request.extlen + header_.request.keylen) {
+        reserve_set();
+      }
+      break;
+    }
 
-  header_.request.keylen = ntohs(h->request.keylen);
-  header_.request.bodylen = ntohl(h->request.bodylen);
-  header_.request.cas = ntohll(h->request.cas);
+    // The packet shares the block it was read into. Gets, and sets, are
+    // done together once the run of them is over. A get ends a run of sets,
+    // which it may read.
+    if (!cpu_pool_ && util::is_get(header_.request.opcode)) {
+      if (!process_sets()) {
+        return false;
+      }
+      gets_.emplace_back(recv_.split(size), header_);
+      reset();
+    } else if (!cpu_pool_ && util::is_set(header_.request.opcode)) {
+      if (!process_gets()) {
+        return false;
+      }
+      sets_.emplace_back(recv_.split(size), header_);
+      reset();
+    } else if (!process_runs() || !process_packet(recv_.split(size))) {
+      return false;
+    }
 
-  protocol_binary_response_status status = util::validate_header(header_);
-  if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
-    write_error(status);
+    // Let go of the block of a large packet.
+    if (size > RECV_BUFFER_SIZE && recv_.empty()) {
+      recv_.clear();
+    }
   }
 
-  // Wait to receive complete packet.
-  if (request_.size() < header_.request.bodylen + sizeof(header_)) {
+  return process_runs();
+}
+
+bool connection::process_gets() {
+  if (gets_.size() < 2) {
+    for (auto &req : gets_) {
+      response resp;
+      execute(c_, req.header_, std::move(req.data_), resp);
+      if (!write_response(std::move(resp))) {
+        return false;
+      }
+    }
+    gets_.clear();
     return true;
-  } else if (request_.size() > header_.request.bodylen + sizeof(header_)) {
-    // Received packet too big. Return error.
-    write_error(PROTOCOL_BINARY_RESPONSE_EINVAL);
-    return false;
   }
 
-  return process_packet();
-}
+  std::vector<cache::key> keys;
+  keys.reserve(gets_.size());
+  for (auto &req : gets_) {
+    keys.push_back(req.get_key());
+  }
 
-bool connection::handle_delete() {
-  cache::value val(std::move(request_), header_);
+  std::vector<response> resps(gets_.size());
+  c_.get_many(keys.data(), keys.size(), [&](size_t i, cache::item_ptr it) {
+    resps[i].quiet_ = util::is_quiet(gets_[i].header_.request.opcode);
+    build_get(gets_[i].header_, keys[i], std::move(it), resps[i]);
+  });
+
+  bool ret = true;
+  for (auto &resp : resps) {
+    if (!write_response(std::move(resp))) {
+      ret = false;
+      break;
+    }
+  }
 
-  if (!c_.remove(val, header_.request.cas)) {
-    write_error(PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+  gets_.clear();
+  return ret;
+}
+
+bool connection::process_sets() {
+  if (sets_.size() < 2) {
+    for (auto &req : sets_) {
+      response resp;
+      execute(c_, req.header_, std::move(req.data_), resp);
+      if (!write_response(std::move(resp))) {
+        return false;
+      }
+    }
+    sets_.clear();
     return true;
   }
 
-  //generate response
-  buffer resp = util::build_response_hdr(header_, 0, 0);
-  if (!write_response(resp.data(), resp.size())) {
+  std::unique_ptr<bool[]> done(new bool[sets_.size()]);
+  c_.set_many(sets_.data(), sets_.size(), done.get());
+
+  bool ret = true;
+  for (size_t i = 0; i < sets_.size(); ++i) {
+    const protocol_binary_request_header &h = sets_[i].header_;
+    response resp;
+    resp.quiet_ = util::is_quiet(h.request.opcode);
+    if (!done[i]) {
+      build_error(h, h.request.cas ? PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS
+                                   : PROTOCOL_BINARY_RESPONSE_ENOMEM, resp.buf_);
+    } else if (!resp.quiet_) {
+      resp.buf_ = util::build_response_hdr(h, 0, 0);
+    }
+
+    if (!write_response(std::move(resp))) {
+      ret = false;
+      break;
+    }
+  }
+
+  sets_.clear();
+  return ret;
+}
+
+bool connection::reserve_set() {
+  const char *p = recv_.data();
+  set_item_ = c_.reserve(header_, p + sizeof(header_));
+  if (!set_item_) {
     return false;
   }
 
+  // The rest of what was received is the start of the value.
+  size_t prefix = sizeof(header_) + header_.request.extlen + header_.request.keylen;
+  set_read_ = recv_.size() - prefix;
+  memcpy(set_item_.value(), p + prefix, set_read_);
+  recv_.clear();
   return true;
 }
 
-bool connection::process_packet() {
-  bool ret = true;
-  switch (header_.request.opcode) {
+bool connection::commit_set() {
+  response resp;
+  resp.quiet_ = util::is_quiet(header_.request.opcode);
+  if (!set_item_.commit(header_.request.cas)) {
+    build_error(header_, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, resp.buf_);
+  } else if (!resp.quiet_) {
+    resp.buf_ = util::build_response_hdr(header_, 0, 0);
+  }
+
+  set_read_ = 0;
+  reset();
+  return write_response(std::move(resp));
+}
+
+void connection::handle_delete(sharded_cache& c, const protocol_binary_request_header& h,
+                               iobuf&& packet, response& out) {
+  cache::value val(std::move(packet), h);
+
+  if (!c.remove(val, h.request.cas)) {
+    build_error(h, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, out.buf_);
+    return;
+  }
+
+  //generate response, unless quiet
+  if (h.request.opcode != PROTOCOL_BINARY_CMD_DELETEQ) {
+    out.buf_ = util::build_response_hdr(h, 0, 0);
+  }
+}
+
+void connection::handle_stat(sharded_cache& c, const protocol_binary_request_header& h,
+                             iobuf&& packet, response& out) {
+  stats_list stats;
+  c.get_stats(stats);
+  stats.emplace_back("output_queued_bytes", std::to_string(stats_.queued_bytes_.load()));
+  stats.emplace_back("throttled_connections", std::to_string(stats_.throttled_.load()));
+  stats.emplace_back("throttles", std::to_string(stats_.throttles_.load()));
+
+  // A response per stat, with the name as the key, ending with an empty one.
+  for (auto &s : stats) {
+    buffer r = util::build_response_hdr(h, s.first.size(), s.first.size() + s.second.size());
+    out.buf_.insert(out.buf_.end(), r.begin(), r.end());
+    out.buf_.insert(out.buf_.end(), s.first.begin(), s.first.end());
+    out.buf_.insert(out.buf_.end(), s.second.begin(), s.second.end());
+  }
+
+  buffer r = util::build_response_hdr(h, 0, 0);
+  out.buf_.insert(out.buf_.end(), r.begin(), r.end());
+}
+
+void connection::execute(sharded_cache& c, const protocol_binary_request_header& h,
+                         iobuf&& packet, response& out) {
+  out.quiet_ = util::is_quiet(h.request.opcode);
+
+  switch (h.request.opcode) {
     case PROTOCOL_BINARY_CMD_SET:
-      ret = handle_set();
+    case PROTOCOL_BINARY_CMD_SETQ:
+      handle_set(c, h, std::move(packet), out);
       break;
     case PROTOCOL_BINARY_CMD_GET:
-      ret = handle_get();
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+      handle_get(c, h, std::move(packet), out);
       break;
     case PROTOCOL_BINARY_CMD_DELETE:
-      ret = handle_delete();
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+      handle_delete(c, h, std::move(packet), out);
+      break;
+    case PROTOCOL_BINARY_CMD_STAT:
+      handle_stat(c, h, std::move(packet), out);
+      break;
+    case PROTOCOL_BINARY_CMD_NOOP:
+      // Only there to get the held back responses out.
+      out.buf_ = util::build_response_hdr(h, 0, 0);
       break;
     default:
-      write_error(PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND);
+      build_error(h, PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, out.buf_);
       break;
   }
+}
+
+bool connection::process_packet(iobuf&& packet) {
+  if (cpu_pool_) {
+    dispatch_packet(std::move(packet));
+    reset();
+    return true;
+  }
+
+  response resp;
+  execute(c_, header_, std::move(packet), resp);
   reset();
+
+  return write_response(std::move(resp));
+}
+
+void connection::dispatch_packet(iobuf&& packet) {
+  cache::value req(std::move(packet), header_);
+  uint32_t hash = cache::hash(req.get_key());
+
+  task t(task::CACHE, this, std::move(req.data_), header_);
+  t.seq_ = next_seq_++;
+  ++inflight_;
+
+  cpu_pool_->add(std::move(t), c_.shard_index(hash));
+}
+
+bool connection::put_response(uint64_t seq, response resp) {
+  assert(inflight_);
+  --inflight_;
+
+  return queue_response(seq, std::move(resp));
+}
+
+bool connection::queue_response(uint64_t seq, response resp) {
+  assert(seq >= write_seq_);
+
+  // Fast path, nothing to reorder.
+  if (seq == write_seq_ && pending_.empty()) {
+    ++write_seq_;
+    return closing_ || write_response(std::move(resp));
+  }
+
+  pending_.emplace(seq, std::move(resp));
+
+  bool ret = true;
+  for (auto it = pending_.begin(); it != pending_.end() && it->first == write_seq_;) {
+    if (ret && !closing_) {
+      ret = write_response(std::move(it->second));
+    }
+
+    ++write_seq_;
+    it = pending_.erase(it);
+  }
+
   return ret;
 }
 
-void connection::write_error(protocol_binary_response_status err) {
+bool connection::close() {
+  closing_ = true;
+  return inflight_ == 0;
+}
+
+void connection::build_error(const protocol_binary_request_header& h,
+                             protocol_binary_response_status err, buffer& out) {
   const char *errstr = nullptr;
 
   switch (err) {
@@ -114,6 +419,9 @@ void connection::write_error(protocol_binary_response_status err) {
     case PROTOCOL_BINARY_RESPONSE_E2BIG:
       errstr = "Too large";
       break;
+    case PROTOCOL_BINARY_RESPONSE_ENOMEM:
+      errstr = "Out of memory";
+      break;
     default:
       assert(false);
       break;
@@ -123,78 +431,277 @@ void connection::write_error(protocol_binary_response_status err) {
   if (errstr) {
     len = strlen(errstr);
   }
-  buffer buf = util::build_response_hdr(header_, 0, len, err);
+  out = util::build_response_hdr(h, 0, len, err);
   if (len)
-    buf.insert(buf.end(), errstr, errstr + len);
+    out.insert(out.end(), errstr, errstr + len);
+}
+
+void connection::write_error(protocol_binary_response_status err) {
+  response resp;
+  build_error(header_, err, resp.buf_);
+  resp.quiet_ = util::is_quiet(header_.request.opcode);
 
-  write_response(&buf[0], buf.size());
+  // Keep the error in order with the requests in flight.
+  if (cpu_pool_) {
+    queue_response(next_seq_++, std::move(resp));
+  } else {
+    write_response(std::move(resp));
+  }
 
   reset();
 }
 
-bool connection::write_response(const unsigned char *buf, size_t len) {
-  while (len) {
-    ssize_t cnt = ::write(fd_, buf, len);
-    if (cnt == -1) {
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+bool connection::write_response(response resp) {
+  if (shutdown_) {
+    return true;
+  }
+
+  // Batched with the other responses to the packets of the read, or held
+  // back after a quiet command.
+  if (corked_ || quiet_ || resp.quiet_) {
+    quiet_ = resp.quiet_;
+    batch_response(std::move(resp));
+
+    // Not held back any longer past MAX_QUEUED_OUTPUT, as it is not accounted for.
+    if (batched_ >= MAX_QUEUED_OUTPUT) {
+      quiet_ = false;
+    }
+    return corked_ || quiet_ || uncork();
+  }
+
+  // Stay behind the queued responses, the socket is full.
+  if (out_.empty()) {
+    struct iovec iov[response::MAX_IOVECS];
+    while (!resp.done()) {
+      ssize_t cnt = ::writev(fd_, iov, resp.iov(iov));
+      if (cnt == -1) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+
         std::cerr << "write error: fd=" << fd_ << " errno =" << errno << std::endl;
         return false;
       }
-    } else {
-      assert(cnt <= len);
-      len -= cnt;
+
+      assert(resp.written_ + cnt <= resp.size());
+      ++writes_;
+      resp.written_ += cnt;
+    }
+
+    if (resp.done()) {
+      return true;
     }
   }
+
+  size_t left = resp.size() - resp.written_;
+  out_.push_back(std::move(resp));
+  update_queued(left, 0);
   return true;
 }
 
-bool connection::handle_set() {
-  cache::value val(std::move(request_), header_);
+bool connection::flush() {
+  if (shutdown_) {
+    return true;
+  }
 
-  if (header_.request.cas) {
-    if (!c_.cas(std::move(val), header_.request.cas)) {
-      write_error(PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
-      return true;
+  size_t written = 0;
+  bool ret = write_queued(written);
+  update_queued(0, written);
+  return ret;
+}
+
+void connection::batch_response(response resp) {
+  size_t size = resp.size();
+  if (!size) {
+    return;
+  }
+
+  // The last response has no header of its own without a value.
+  if (!batch_.empty() && resp.hdr_len_ + resp.buf_.size() <= MAX_COALESCED_RESPONSE &&
+      !batch_.back().value_len_) {
+    response &last = batch_.back();
+    const unsigned char *hdr = (const unsigned char *) &resp.hdr_;
+    last.buf_.insert(last.buf_.end(), hdr, hdr + resp.hdr_len_);
+    last.buf_.insert(last.buf_.end(), resp.buf_.begin(), resp.buf_.end());
+    if (resp.value_len_) {
+      last.set_value(std::move(resp.item_), resp.value_, resp.value_len_);
     }
   } else {
-    c_.set(std::move(val));
+    batch_.push_back(std::move(resp));
   }
+  batched_ += size;
+}
 
-  //generate response
-  buffer resp = util::build_response_hdr(header_, 0, 0);
-  if (!write_response(resp.data(), resp.size())) {
-    return false;
+bool connection::uncork() {
+  if (batch_.empty()) {
+    return true;
+  }
+
+  // Accounted for once written, so the socket is only watched for
+  // writability if the batch didn't all go out.
+  size_t added = batched_;
+  size_t written = 0;
+  batched_ = 0;
+  for (auto &r : batch_) {
+    out_.push_back(std::move(r));
+  }
+  batch_.clear();
+
+  bool ret = shutdown_ || write_queued(written);
+  update_queued(added, written);
+  return ret;
+}
+
+bool connection::write_queued(size_t& written) {
+  struct iovec iov[MAX_WRITE_IOVECS];
+
+  while (!out_.empty()) {
+    int n = 0;
+    for (auto it = out_.begin(); it != out_.end() && n + response::MAX_IOVECS <= (int) MAX_WRITE_IOVECS; ++it) {
+      n += it->iov(iov + n);
+    }
+
+    ssize_t cnt = ::writev(fd_, iov, n);
+    if (cnt == -1) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        std::cerr << "write error: fd=" << fd_ << " errno =" << errno << std::endl;
+        return false;
+      }
+      break;
+    }
+
+    // Drop the responses written out, unpinning their items.
+    ++writes_;
+    written += cnt;
+    while (cnt) {
+      response &r = out_.front();
+      size_t left = r.size() - r.written_;
+      if ((size_t) cnt < left) {
+        r.written_ += cnt;
+        break;
+      }
+
+      cnt -= left;
+      out_.pop_front();
+    }
   }
 
   return true;
 }
 
-bool connection::handle_get() {
-  typedef uint32_t flag_t;
+void connection::update_queued(size_t added, size_t written) {
+  assert(queued_ + added >= written);
+  queued_ = queued_ + added - written;
+  stats_.queued_bytes_.fetch_add((int64_t) added - (int64_t) written, std::memory_order_relaxed);
 
-  cache::value req(std::move(request_), header_);
-  std::shared_ptr<cache::value> value = c_.get(req.get_key());
+  uint32_t events = 0;
+  if (queued_ < MAX_QUEUED_OUTPUT) {
+    events |= EPOLLIN;
+  }
+  if (queued_) {
+    events |= EPOLLOUT;
+  }
 
-  if (!value) {
-    write_error(PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
-    return true;
+  if (events == events_) {
+    return;
   }
 
-  // Construct response.
-  flag_t f = 0;
-  buffer hdr = util::build_response_hdr(header_, 0, value->packet_value_len() + sizeof(f),
-                                        0, sizeof(f));
-  hdr.insert(hdr.end(), (unsigned char *) &f, (unsigned char *) &f + sizeof(f));
-  size_t size = value->packet_value_len();
+  if ((events ^ events_) & EPOLLIN) {
+    if (events & EPOLLIN) {
+      stats_.throttled_.fetch_sub(1, std::memory_order_relaxed);
+    } else {
+      stats_.throttled_.fetch_add(1, std::memory_order_relaxed);
+      stats_.throttles_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
 
-  const char *buf = value->packet_user_data() + value->header_.request.keylen;
-  hdr.insert(hdr.end(), buf, buf + size);
+  events_ = events;
+  if (ep_) {
+    ep_->modify_descriptor(fd_, this, events);
+  }
+}
 
-  // Write response.
-  std::string res;
-  res.assign((const char *) buf, value->packet_value_len());
-  write_response(&hdr[0], hdr.size());
+void connection::handle_set(sharded_cache& c, const protocol_binary_request_header& h,
+                            iobuf&& packet, response& out) {
+  cache::value val(std::move(packet), h);
 
-  return true;
+  if (h.request.cas) {
+    if (!c.cas(std::move(val), h.request.cas)) {
+      build_error(h, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, out.buf_);
+      return;
+    }
+  } else if (!c.set(std::move(val))) {
+    build_error(h, PROTOCOL_BINARY_RESPONSE_ENOMEM, out.buf_);
+    return;
+  }
+
+  //generate response, unless quiet
+  if (h.request.opcode != PROTOCOL_BINARY_CMD_SETQ) {
+    out.buf_ = util::build_response_hdr(h, 0, 0);
+  }
+}
+
+void connection::handle_get(sharded_cache& c, const protocol_binary_request_header& h,
+                            iobuf&& packet, response& out) {
+  cache::value req(std::move(packet), h);
+  build_get(h, req.get_key(), c.get(req.get_key()), out);
+}
+
+void connection::build_get(const protocol_binary_request_header& h, const cache::key& k,
+                           cache::item_ptr value, response& out) {
+  typedef uint32_t flag_t;
+
+  // Quiet gets only answer hits.
+  if (!value) {
+    if (!out.quiet_) {
+      build_error(h, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, out.buf_);
+    }
+    return;
+  }
+
+  // Large values are sent from the cache memory, the rest is copied, unless
+  // the response is pre-encoded.
+  size_t size = value->value_len();
+  bool zero_copy = size >= ZERO_COPY_MIN_VALUE;
+  const char *buf = value->get_value();
+
+  // GETK and GETKQ send the key back, between the flags and the value.
+  size_t keylen = h.request.opcode == PROTOCOL_BINARY_CMD_GETK ||
+                  h.request.opcode == PROTOCOL_BINARY_CMD_GETKQ ? k.length_ : 0;
+
+  if (value->encoded() && !keylen) {
+    // Pre-encoded response, only the request opcode and opaque are left to
+    // fill in, in a copy of the header. The rest is sent from the item,
+    // whatever the size of the value.
+    const char *r = value->response();
+    protocol_binary_response_header rh;
+    memcpy(&rh, r, sizeof(rh));
+    rh.response.opcode = h.request.opcode;
+    rh.response.opaque = h.request.opaque;
+    out.set_header(rh);
+
+    // Read before pinning, which empties value.
+    size_t len = value->response_len() - sizeof(rh);
+    out.set_value(value.pin(), r + sizeof(rh), len);
+    return;
+  }
+
+  // Construct response.
+  flag_t f = value->client_flags();
+  out.buf_ = util::build_response_hdr(h, keylen, keylen + size + sizeof(f), 0, sizeof(f));
+  reinterpret_cast<protocol_binary_response_header *>(out.buf_.data())->response.cas =
+      htonll(value->cas());
+  out.buf_.insert(out.buf_.end(), (unsigned char *) &f, (unsigned char *) &f + sizeof(f));
+  out.buf_.insert(out.buf_.end(), k.key_ptr_, k.key_ptr_ + keylen);
+
+  if (zero_copy) {
+    out.set_value(value.pin(), buf, size);
+  } else {
+    out.buf_.insert(out.buf_.end(), buf, buf + size);
+  }
 }
 }
@@ -4,29 +4,95 @@
 
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <vector>
+#include <map>
+#include <memory>
 #include <stdint.h>
 #include <unistd.h>
 
 #include "protocol_binary.h"
-#include "cache.h"
+#include "sharded_cache.h"
+#include "response.h"
+#include "network.h"
 
 namespace memcache {
+
+class CPUPoolExecutor;
+struct task;
+template<typename T> class mpsc_queue;
+
+/*!
+ * \brief Output queued on all the connections, reported by STAT.
+ */
+struct output_stats {
+  /*!
+   * \brief Bytes queued, waiting for the sockets to be writable.
+   */
+  std::atomic<int64_t> queued_bytes_{0};
+
+  /*!
+   * \brief Connections not read from, for having too much output queued.
+   */
+  std::atomic<int64_t> throttled_{0};
+
+  /*!
+   * \brief Times connections were throttled.
+   */
+  std::atomic<uint64_t> throttles_{0};
+};
+
+/*!
+ * \brief Load of a connection, for rebalancing the connections between the
+ * IO executors (see IOPoolExecutor::init with balance).
+ */
+struct connection_load {
+  /*!
+   * \brief Time the IO executors spent running the connection's tasks, in
+   * nanoseconds, and bytes received. Written by the executor running the
+   * connection, one at a time.
+   */
+  std::atomic<uint64_t> busy_ns_{0};
+  std::atomic<uint64_t> bytes_{0};
+
+  /* Rebalancer only */
+  uint64_t last_busy_ns_ = 0;
+  uint64_t last_bytes_ = 0;
+
+  /*!
+   * \brief Moving averages of the busy time and bytes per rebalance interval.
+   */
+  uint64_t avg_busy_ns_ = 0;
+  uint64_t avg_bytes_ = 0;
+
+  void add_busy(uint64_t ns) {
+    busy_ns_.store(busy_ns_.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+  }
+
+  void add_bytes(uint64_t n) {
+    bytes_.store(bytes_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+};
+
 /*!
  * \brief Conenction state.
  * Stores the communicating socket (used to write responses),
  * the cache object for performing cache operations, and the
  * index of IO executor on which to process the operations.
+ *
+ * Responses the socket doesn't take right away are queued, and written out
+ * once epoll reports the socket writable, so the IO executor moves on to
+ * other connections instead of waiting on a slow reader.
  */
 struct connection {
-  explicit connection(int fd, cache& c, int executor_index = -1) :
-      fd_(fd), c_(c), executor_index_(executor_index) {
+  explicit connection(int fd, sharded_cache& c, int executor_index = -1,
+                      CPUPoolExecutor *cpu_pool = nullptr, EpollHelper *ep = nullptr) :
+      fd_(fd), c_(c), executor_index_(executor_index), cpu_pool_(cpu_pool), ep_(ep) {
     assert(fd_ != -1);
   }
 
-  ~connection() {
-    ::close(fd_);
-  }
+  ~connection();
 
   /*!
    * Connecting socket.
@@ -37,52 +103,382 @@ struct connection {
   /*!
    * Cache reference.
    */
-  cache& c_;
+  sharded_cache& c_;
+
+  /*!
+   * Index of the assigned executor. Only changes when the connection is
+   * moved to another executor, by the rebalancer (see steal_group).
+   */
+  std::atomic<int> executor_index_{-1};
+
+  /*!
+   * \brief Tasks of the connection, when the IO executors steal work from
+   * each other (see steal_group). Created with the NEW task.
+   */
+  std::unique_ptr<mpsc_queue<task>> tasks_;
+
+  /*!
+   * \brief Tasks queued and not run yet. The connection is scheduled on an
+   * IO executor while there are any, and run by one executor at a time.
+   */
+  std::atomic<size_t> tasks_pending_{0};
+
+  /*!
+   * \brief References to the connection, when in a steal_group: one until
+   * it is closed with no responses in flight, and one by each thread
+   * queuing a task on it, until it is out of mpsc_queue::push. The last
+   * one deletes it.
+   */
+  std::atomic<size_t> refs_{1};
+
+  connection_load load_;
+
+  /*!
+   * \brief Read what the socket has into the receive buffer, and process
+   * the packets received in full. Reads until the socket is drained, or
+   * the connection is throttled.
+   * @return False if the connection should be closed: closed by the peer,
+   * a read error, or an invalid packet.
+   */
+  bool read();
+
+  /*!
+   * \brief Write back the response of a request processed on a CPU executor.
+   * Responses are written in the order the requests were received.
+   * @param seq Sequence number of the request.
+   * @param resp Response.
+   * @return False if the write failed.
+   */
+  bool put_response(uint64_t seq, response resp);
+
+  /*!
+   * \brief Write out the queued responses, once the socket is writable.
+   * @return False if the write failed.
+   */
+  bool flush();
+
+  /*!
+   * \brief Bytes of the responses queued, waiting for the socket to be writable.
+   */
+  size_t queued() const {
+    return queued_;
+  }
+
+  /*!
+   * \brief True if the connection is not read from, until its queued output
+   * goes under MAX_QUEUED_OUTPUT.
+   */
+  bool throttled() const {
+    return !(events_ & EPOLLIN);
+  }
 
   /*!
-   * Index of the assigned executor.
+   * \brief Number of writes to the socket.
    */
-  int executor_index_ = -1;
+  uint64_t writes() const {
+    return writes_;
+  }
 
   /*!
-   * \brief Buffer and validate the header.
-   * @param b Incoming data buffer.
-   * @return Return true if the packed was successfully buffered
-   * and/or processed. False if the header was invalid,
-   * which should be taken as an indication to close the session.
+   * \brief Output stats of all the connections.
    */
-  bool buffer_packet(buffer b);
+  static output_stats stats_;
+
+  /*!
+   * \brief Mark the connection as closed.
+   * @return True if the connection can be deleted right away. False if
+   * there are requests in flight on the CPU executors, in which case the
+   * connection is deleted once the last response comes back.
+   */
+  bool close();
+
+  /*!
+   * \brief True if the connection was closed while requests were in flight.
+   */
+  bool closing() const {
+    return closing_;
+  }
+
+  /*!
+   * \brief Shut the socket down after an error. Nothing more is read or
+   * written, and the connection is closed once the main thread sees the
+   * socket hang up, so it is only ever closed by the main thread.
+   */
+  void shutdown() {
+    if (!shutdown_) {
+      shutdown_ = true;
+      ::shutdown(fd_, SHUT_RDWR);
+    }
+  }
+
+  /*!
+   * \brief True if the socket was shut down after an error.
+   */
+  bool is_shutdown() const {
+    return shutdown_;
+  }
+
+  /*!
+   * \brief Number of requests in flight on the CPU executors.
+   */
+  size_t inflight() const {
+    return inflight_;
+  }
+
+  /*!
+   * \brief Perform a cache operation and build its response.
+   * Used on the CPU executors, which own the cache partitions.
+   * @param c Cache.
+   * @param h Request header, in host byte order.
+   * @param packet The entire request packet.
+   * @param out Response.
+   */
+  static void execute(sharded_cache& c, const protocol_binary_request_header& h,
+                      iobuf&& packet, response& out);
 
 private:
   /*!
-   * \brief String for buffering incoming request.
+   * \brief Data received and not processed yet, always contiguous. Read
+   * into a block of RECV_BUFFER_SIZE bytes, or of the size of a packet too
+   * large for it. Packets are split off it, sharing the block, which is
+   * reused once they are all done with.
+   */
+  iobuf recv_;
+
+  /*!
+   * \brief Header of the packet being received, in host byte order, once
+   * validated. Zeroed (no magic) until then.
+   */
+  protocol_binary_request_header header_ = {};
+
+  /*!
+   * \brief Run of gets received, looked up together (see
+   * sharded_cache::get_many) once a request that isn't a get comes, or
+   * the read is parsed. Not used with the CPU executors, which own the keys
+   * of a run between them.
+   */
+  std::vector<cache::value> gets_;
+
+  /*!
+   * \brief Run of sets received, done together (see sharded_cache::set_many)
+   * once a request that isn't a set comes, or the read is parsed. Not used
+   * with the CPU executors, as gets_.
+   */
+  std::vector<cache::value> sets_;
+
+  /*!
+   * \brief Item of the large set being received, when the cache is locked.
+   * The rest of the value is read from the socket straight into the item,
+   * rather than into a block of its own and then copied.
+   */
+  cache::reserved_item set_item_;
+
+  /*!
+   * \brief Bytes of the value of the reserved item received so far.
    */
-  std::string request_;
+  size_t set_read_ = 0;
 
   /*!
-   * \brief Header for the buffered request.
+   * \brief CPU executor pool owning the cache partitions.
+   * Requests are processed inline when not set.
    */
-  protocol_binary_request_header header_;
+  CPUPoolExecutor *cpu_pool_ = nullptr;
+
+  /*!
+   * \brief Sequence number for the next request handed to the CPU executors.
+   */
+  uint64_t next_seq_ = 0;
+
+  /*!
+   * \brief Sequence number of the next response to be written.
+   */
+  uint64_t write_seq_ = 0;
+
+  /*!
+   * \brief Responses which came back before the ones preceding them.
+   */
+  std::map<uint64_t, response> pending_;
+
+  size_t inflight_ = 0;
+  bool closing_ = false;
+  bool shutdown_ = false;
+
+  /*!
+   * \brief Epoll instance watching the socket, to watch for writability while
+   * output is queued. Not set in tests, which flush by hand.
+   */
+  EpollHelper *ep_ = nullptr;
+
+  /*!
+   * \brief Responses waiting for the socket to be writable, in order.
+   * The front one may be partly written.
+   */
+  std::deque<response> out_;
+
+  /*!
+   * \brief Bytes left to write of the queued responses.
+   */
+  size_t queued_ = 0;
+
+  /*!
+   * \brief Epoll events watched for the socket.
+   */
+  uint32_t events_ = EPOLLIN;
+
+  /*!
+   * \brief True while the packets of a read are processed. Their responses
+   * are batched, and written out together once they are all processed.
+   */
+  bool corked_ = false;
+
+  /*!
+   * \brief True after the response to a quiet command, which is held back
+   * in the batch with the ones after it, until the response to a command
+   * which isn't quiet.
+   */
+  bool quiet_ = false;
+
+  /*!
+   * \brief Responses batched to be written out together, and their bytes,
+   * not accounted in queued_ until then.
+   */
+  std::deque<response> batch_;
+  size_t batched_ = 0;
+
+  uint64_t writes_ = 0;
 
   /* Cache operations */
-  bool handle_set();
-  bool handle_get();
-  bool handle_delete();
+  static void handle_set(sharded_cache& c, const protocol_binary_request_header& h,
+                         iobuf&& packet, response& out);
+  static void handle_get(sharded_cache& c, const protocol_binary_request_header& h,
+                         iobuf&& packet, response& out);
+  static void handle_delete(sharded_cache& c, const protocol_binary_request_header& h,
+                            iobuf&& packet, response& out);
+  /*!
+   * \brief Build the response to a get.
+   * @param h Request header.
+   * @param k Key.
+   * @param value Item, empty on a miss.
+   * @param out Response, with quiet_ set for quiet gets.
+   */
+  static void build_get(const protocol_binary_request_header& h, const cache::key& k,
+                        cache::item_ptr value, response& out);
+  static void handle_stat(sharded_cache& c, const protocol_binary_request_header& h,
+                          iobuf&& packet, response& out);
+
+  /*!
+   * \brief Build an error response.
+   * @param h Request header.
+   * @param err error code.
+   * @param out Response.
+   */
+  static void build_error(const protocol_binary_request_header& h,
+                          protocol_binary_response_status err, buffer& out);
+
+  /*!
+   * \brief Validate and process the packets received in full, keeping the
+   * partial one at the end.
+   * @return False if a packet was invalid.
+   */
+  bool parse();
+
+  /*!
+   * \brief Reserve the item of the large set being received, once its extras
+   * and key are in, and move the start of the value into it.
+   * @return False if there was no memory for the item, in which case the
+   * packet is received in full first, as any other.
+   */
+  bool reserve_set();
+
+  /*!
+   * \brief Look up the run of gets, and write back their responses in order.
+   * @return False if a write failed.
+   */
+  bool process_gets();
+
+  /*!
+   * \brief Do the run of sets, and write back their responses in order.
+   * @return False if a write failed.
+   */
+  bool process_sets();
+
+  /*!
+   * \brief Process the run of gets or sets, only one of which is queued at
+   * a time.
+   * @return False if a write failed.
+   */
+  bool process_runs() {
+    return process_gets() && process_sets();
+  }
+
+  /*!
+   * \brief Link the reserved item, once its value is received, and write
+   * back the response.
+   * @return False if the write failed.
+   */
+  bool commit_set();
 
   /*!
    * \brief Process the packet.
+   * @param packet The entire request packet.
    * @return True if packet was processed and request completed.
    * False if there was an error.
    */
-  bool process_packet();
+  bool process_packet(iobuf&& packet);
+
+  /*!
+   * \brief Hand the packet off to the CPU executor owning the key.
+   * @param packet The entire request packet.
+   */
+  void dispatch_packet(iobuf&& packet);
+
+  /*!
+   * \brief Write back the response with the given sequence number, once all
+   * the responses preceding it have been written.
+   * @param seq Sequence number.
+   * @param resp Response.
+   * @return False if a write failed.
+   */
+  bool queue_response(uint64_t seq, response resp);
+
+  /*!
+   * \brief Write back response, with a single writev when the socket takes it all.
+   * What the socket doesn't take is queued, as is the whole response when
+   * there already are responses queued.
+   * @param resp Response.
+   * @return False if a write failed.
+   */
+  bool write_response(response resp);
+
+  /*!
+   * \brief Account for the change in queued output, and watch the socket for
+   * what the connection is waiting on: writability while output is queued,
+   * and incoming data while under MAX_QUEUED_OUTPUT.
+   * @param added Bytes queued.
+   * @param written Bytes written out of the queue.
+   */
+  void update_queued(size_t added, size_t written);
+
+  /*!
+   * \brief Add a response to the batch. Small responses are copied into the
+   * previous one, so a batch of them takes a single iovec.
+   */
+  void batch_response(response resp);
+
+  /*!
+   * \brief Write out the batched responses, behind the queued ones, with as
+   * few writes as the socket allows, and queue what it doesn't take.
+   * @return False if the write failed.
+   */
+  bool uncork();
 
   /*!
-   * \brief Write back response.
-   * @param buf
-   * @param len
-   * @return
+   * \brief Write out the queued responses, MAX_WRITE_IOVECS iovecs at a time,
+   * until the socket is full.
+   * @param written Incremented by the bytes written.
+   * @return False if the write failed.
    */
-  bool write_response(const unsigned char *buf, size_t len);
+  bool write_queued(size_t& written);
 
   /*!
    * \brief Write back error.
@@ -91,10 +487,9 @@ private:
   void write_error(protocol_binary_response_status err);
 
 
-  // Clear the buffered request.
+  // Done with the header of the request.
   void reset() {
     memset(&header_, 0, sizeof(header_));
-    request_.clear();
   }
 
   connection(const connection&) = delete;
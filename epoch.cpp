@@ -0,0 +1,84 @@
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "epoch.h"
+
+namespace memcache {
+
+namespace {
+
+std::mutex index_mutex;
+std::vector<size_t> free_indexes;
+std::atomic<size_t> used_indexes(0);
+
+/*!
+ * \brief Slot index of a thread, returned for reuse when the thread exits.
+ */
+struct thread_slot {
+  thread_slot() {
+    std::lock_guard<std::mutex> l(index_mutex);
+    if (!free_indexes.empty()) {
+      index_ = free_indexes.back();
+      free_indexes.pop_back();
+    } else {
+      index_ = used_indexes.load(std::memory_order_relaxed);
+
+      // Past the slots of the epoch domains, which can't grow under readers.
+      if (index_ >= MAX_EPOCH_THREADS) {
+        std::cerr << "More than " << MAX_EPOCH_THREADS << " threads reading the cache" << std::endl;
+        std::abort();
+      }
+      used_indexes.store(index_ + 1, std::memory_order_release);
+    }
+  }
+
+  ~thread_slot() {
+    std::lock_guard<std::mutex> l(index_mutex);
+    free_indexes.push_back(index_);
+  }
+
+  size_t index_ = 0;
+};
+}
+
+size_t epoch_domain::thread_index() {
+  static thread_local thread_slot s;
+  return s.index_;
+}
+
+size_t epoch_domain::threads() {
+  return used_indexes.load(std::memory_order_acquire);
+}
+
+uint64_t epoch_domain::safe_epoch() const {
+  uint64_t safe = epoch_.load(std::memory_order_relaxed);
+  for (size_t i = 0, n = threads(); i < n; ++i) {
+    uint64_t e = slots_[i].epoch_.load(std::memory_order_acquire);
+    if (e && e < safe) {
+      safe = e;
+    }
+  }
+  return safe;
+}
+
+void epoch_domain::synchronize(uint64_t epoch) const {
+  size_t self = thread_index();
+  for (size_t i = 0, n = threads(); i < n; ++i) {
+    if (i == self) {
+      continue;
+    }
+
+    // Readers don't wait on anything while reading, so this is short.
+    while (true) {
+      uint64_t e = slots_[i].epoch_.load(std::memory_order_acquire);
+      if (!e || e > epoch) {
+        break;
+      }
+      std::this_thread::yield();
+    }
+  }
+}
+}
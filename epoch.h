@@ -0,0 +1,116 @@
+//
+// Epoch-based reclamation.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+#include "limits.h"
+
+namespace memcache {
+
+/*!
+ * \brief Epoch-based reclamation domain, keeping the memory of the objects
+ * of an owner (e.g. a cache shard) from being reused while other threads
+ * still read them.
+ *
+ * Readers announce the current epoch in a slot of their own for as long as
+ * they hold pointers to objects. Objects unlinked by writers are retired
+ * with the current epoch, which moves the epoch forward, and can be reused
+ * once no reader announces their retire epoch or an older one.
+ *
+ * Reading only writes to the slot of the reading thread, which is on its
+ * own cache line, so threads reading the same objects don't share written
+ * cache lines, unlike with reference counts.
+ *
+ * Readers are expected to enter, and writers to retire, under the lock of
+ * the owner, which orders the announcements with the retires. Readers leave
+ * without it.
+ */
+class epoch_domain {
+public:
+  /*!
+   * \brief Reader slot of a thread.
+   */
+  struct slot {
+    /*!
+     * \brief Epoch announced by the thread, 0 when not reading.
+     */
+    std::atomic<uint64_t> epoch_{0};
+
+    /*!
+     * \brief Nested reads by the thread. Only used by the thread.
+     */
+    uint32_t depth_ = 0;
+
+    char pad_[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>) - sizeof(uint32_t)];
+  };
+
+  epoch_domain() : slots_(new slot[MAX_EPOCH_THREADS]) {}
+
+  /*!
+   * \brief Start reading, announcing the current epoch. Reads can be nested.
+   * @return Slot of the calling thread, to pass to leave.
+   */
+  slot* enter() {
+    slot* s = &slots_[thread_index()];
+    if (!s->depth_++) {
+      s->epoch_.store(epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    return s;
+  }
+
+  /*!
+   * \brief Stop reading.
+   */
+  static void leave(slot* s) {
+    assert(s->depth_);
+    if (!--s->depth_) {
+      s->epoch_.store(0, std::memory_order_release);
+    }
+  }
+
+  /*!
+   * \brief Retire an object unlinked by the caller.
+   * @return Epoch to retire the object with.
+   */
+  uint64_t retire() {
+    return epoch_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Objects retired with an epoch older than the returned one can be reused.
+   */
+  uint64_t safe_epoch() const;
+
+  /*!
+   * \brief Wait for the other threads reading at the given epoch, or an
+   * older one, to leave. The calling thread's own reads are not waited for.
+   */
+  void synchronize(uint64_t epoch) const;
+
+private:
+  /*!
+   * \brief Current epoch. Starts at 1, as 0 is for slots not reading.
+   */
+  std::atomic<uint64_t> epoch_{1};
+  std::unique_ptr<slot[]> slots_;
+
+  /*!
+   * \brief Index of the calling thread's slot. Indexes are reused once threads exit.
+   */
+  static size_t thread_index();
+
+  /*!
+   * \brief Number of slots handed out to threads so far.
+   */
+  static size_t threads();
+
+  epoch_domain(const epoch_domain &) = delete;
+  epoch_domain &operator=(const epoch_domain &) = delete;
+};
+}
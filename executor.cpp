@@ -1,49 +1,222 @@
+#include <algorithm>
 #include <iostream>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "executor.h"
 
 namespace memcache {
 
 executor::~executor() {
-  add(task(task::SHUTDOWN, nullptr));
+  if (group_) {
+    group_->stop();
+  } else {
+    add(task(task::SHUTDOWN, nullptr));
+  }
+
   if (processor_.get())
     processor_->join();
+
+  if (wake_fd_ != -1) {
+    ::close(wake_fd_);
+  }
+}
+
+bool executor::listen(const std::string &ip, int port) {
+  assert(c_);
+  listener_.reset(new socket());
+  ep_.reset(new EpollHelper(MAX_EPOLL_EVENTS));
+  if (!listener_->bind(ip, port, true) || !ep_->open() || !ep_->listen_socket(*listener_)) {
+    std::cerr << "Executor " << index_ << " couldn't listen" << std::endl;
+    return false;
+  }
+
+  wake_fd_ = ::eventfd(0, EFD_NONBLOCK);
+  if (wake_fd_ == -1 || !ep_->add_descriptor(wake_fd_, &wake_fd_)) {
+    std::cerr << "Executor " << index_ << " eventfd error: " << errno << std::endl;
+    return false;
+  }
+
+  processor_.reset(new std::thread(std::bind(&executor::loop, this)));
+  return true;
+}
+
+void executor::wake() {
+  uint64_t v = 1;
+  ssize_t n = ::write(wake_fd_, &v, sizeof(v));
+  assert(n == sizeof(v));
+}
+
+void executor::loop() {
+  while (true) {
+    int n = ep_->wait();
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      epoll_event &e = ep_->events_[i];
+      if (e.data.ptr == listener_.get()) {
+        accept_connections();
+      } else if (e.data.ptr == &wake_fd_) {
+        if (!process_queued()) {
+          cleanup();
+          return;
+        }
+      } else {
+        handle_events(static_cast<connection *>(e.data.ptr), e.events);
+      }
+    }
+  }
+
+  cleanup();
+}
+
+bool executor::process_queued() {
+  uint64_t v;
+  while (::read(wake_fd_, &v, sizeof(v)) == sizeof(v)) {
+  }
+
+  // Tasks queued once the queue is parked wake the loop up again.
+  do {
+    mpsc_queue<task>::queue tasks;
+    q_.pop_all(tasks);
+    for (auto &t : tasks) {
+      if (!process_inl(t)) {
+        return false;
+      }
+    }
+  } while (!q_.park());
+  return true;
+}
+
+void executor::accept_connections() {
+  connection_data info;
+  while (listener_->connect(&info)) {
+    connection *s = new connection(info.fd_, *c_, index_, cpu_pool_, ep_.get());
+    if (!ep_->add_descriptor(info.fd_, s)) {
+      std::cerr << "Executor " << index_ << " could not add descriptor" << std::endl;
+      delete s;
+      continue;
+    }
+
+    add_connection(s);
+  }
+}
+
+void executor::handle_events(connection *s, uint32_t events) {
+  assert(group_ || active_connections_.find(s) != active_connections_.end());
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    hangup(s);
+    return;
+  }
+
+  // Socket writable again, only watched while responses are queued.
+  if (events & EPOLLOUT) {
+    flush(s);
+  }
+
+  // Not watched while the connection has too much output queued.
+  if (!(events & EPOLLIN)) {
+    return;
+  }
+
+  if (!s->read()) {
+    hangup(s);
+  }
+}
+
+void executor::hangup(connection *s) {
+  ep_->remove_descriptor(s->fd_);
+  close_connection(s);
 }
 
 void executor::add_connection(connection *s) {
+  if (group_) {
+    std::unique_lock<std::mutex> l(group_->mutex_);
+    group_->connections_.insert(s);
+    return;
+  }
+
   assert(active_connections_.find(s) == active_connections_.end());
   active_connections_.insert(s);
 }
 
 void executor::close_connection(connection *s) {
+  // Deleted by run, once the tasks run with it are done.
+  if (group_) {
+    s->close();
+    return;
+  }
+
   auto it = active_connections_.find(s);
   assert(it != active_connections_.end());
 
+  // Wait for the requests in flight on the CPU executors.
+  if (!s->close()) {
+    return;
+  }
+
   delete *it;
   active_connections_.erase(it);
 }
 
-void executor::put_new_data(connection *s, buffer b) {
-  assert(active_connections_.find(s) != active_connections_.end());
+void executor::read(connection *s) {
+  assert(group_ || active_connections_.find(s) != active_connections_.end());
+
+  if (s->closing() || s->is_shutdown()) {
+    return;
+  }
 
-  if (!s->buffer_packet(std::move(b))) {
+  if (!s->read()) {
+    s->shutdown();
+  }
+}
+
+void executor::put_response(connection *s, uint64_t seq, response r) {
+  assert(group_ || active_connections_.find(s) != active_connections_.end());
+
+  bool ret = s->put_response(seq, std::move(r));
+  if (s->closing() && !s->inflight()) {
     close_connection(s);
+  } else if (!ret) {
+    s->shutdown();
+  }
+}
+
+void executor::flush(connection *s) {
+  assert(group_ || active_connections_.find(s) != active_connections_.end());
+
+  if (s->closing()) {
+    return;
+  }
+
+  if (!s->flush()) {
+    s->shutdown();
   }
 }
 
-bool executor::process_inl(const task &t) {
+bool executor::process_inl(task &t) {
   switch (t.type_) {
     case task::NEW:
-      assert(t.packet_.empty());
       add_connection(t.s_);
       break;
     case task::READ:
-      put_new_data(t.s_, std::move(t.packet_));
+      read(t.s_);
       break;
     case task::CLOSE:
-      assert(t.packet_.empty());
       close_connection(t.s_);
       break;
+    case task::WRITE:
+      put_response(t.s_, t.seq_, std::move(t.response_));
+      break;
+    case task::FLUSH:
+      flush(t.s_);
+      break;
     case task::SHUTDOWN:
       // XXX TODO do graceful shutdown.
       return false;
@@ -62,4 +235,321 @@ void executor::cleanup() {
 
   active_connections_.clear();
 }
-}
\ No newline at end of file
+
+void executor::schedule(connection *s) {
+  {
+    std::unique_lock<std::mutex> l(runnable_mutex_);
+    runnable_.push_back(s);
+  }
+
+  group_->runnable_.fetch_add(1);
+  if (group_->steal_) {
+    group_->notify();
+  } else {
+    runnable_con_.notify_one();
+  }
+}
+
+connection *executor::pop_runnable() {
+  std::unique_lock<std::mutex> l(runnable_mutex_);
+  if (runnable_.empty()) {
+    return nullptr;
+  }
+
+  connection *s = runnable_.front();
+  runnable_.pop_front();
+  group_->runnable_.fetch_sub(1);
+  return s;
+}
+
+connection *executor::next_runnable() {
+  if (!group_->steal_) {
+    std::unique_lock<std::mutex> l(runnable_mutex_);
+    while (!group_->stop_ && runnable_.empty()) {
+      runnable_con_.wait(l);
+    }
+    if (group_->stop_) {
+      return nullptr;
+    }
+
+    connection *s = runnable_.front();
+    runnable_.pop_front();
+    group_->runnable_.fetch_sub(1);
+    return s;
+  }
+
+  size_t n = group_->executors_.size();
+  while (true) {
+    connection *s = pop_runnable();
+    if (s) {
+      return s;
+    }
+
+    for (size_t i = 1; i < n; ++i) {
+      s = group_->executors_[(index_ + i) % n]->pop_runnable();
+      if (s) {
+        steals_.fetch_add(1, std::memory_order_relaxed);
+        return s;
+      }
+    }
+
+    // Counted as sleeping before checking for connections, so the executor
+    // scheduling one next sees it and wakes it up.
+    std::unique_lock<std::mutex> l(group_->mutex_);
+    group_->sleepers_.fetch_add(1);
+    while (!group_->stop_ && !group_->runnable_.load()) {
+      group_->con_.wait(l);
+    }
+    group_->sleepers_.fetch_sub(1);
+
+    if (group_->stop_) {
+      return nullptr;
+    }
+  }
+}
+
+void executor::run(connection *s) {
+  auto start = std::chrono::steady_clock::now();
+
+  mpsc_queue<task>::queue tasks;
+  s->tasks_->pop_all(tasks);
+  for (auto &t : tasks) {
+    process_inl(t);
+  }
+
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  busy_ns_.fetch_add(ns, std::memory_order_relaxed);
+  s->load_.add_busy(ns);
+
+  // Closed, with the responses of the CPU executors all in. Nothing else
+  // is queued on it, but the thread which queued the last task may not be
+  // out of push yet, so the last reference deletes it.
+  if (s->closing() && !s->inflight()) {
+    {
+      std::unique_lock<std::mutex> l(group_->mutex_);
+      group_->connections_.erase(s);
+      group_->executors_[s->executor_index_]->connections_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    steal_group::release(s);
+    return;
+  }
+
+  // Tasks queued in the meantime, behind the other connections of the
+  // executor it is assigned to, which the rebalancer may have changed.
+  if (s->tasks_pending_.fetch_sub(tasks.size()) != tasks.size()) {
+    group_->executors_[s->executor_index_]->schedule(s);
+  }
+}
+
+void executor::steal_loop() {
+  while (connection *s = next_runnable()) {
+    run(s);
+  }
+}
+
+steal_group::~steal_group() {
+  for (auto *s : connections_) {
+    delete s;
+  }
+}
+
+void steal_group::release(connection *s) {
+  if (s->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete s;
+  }
+}
+
+void steal_group::start_balancer() {
+  assert(!balancer_);
+  balancer_.reset(new std::thread(std::bind(&steal_group::balance_loop, this)));
+}
+
+void steal_group::stop() {
+  // Called by each executor on destruction, the first one stopping them all.
+  {
+    std::unique_lock<std::mutex> l(mutex_);
+    if (stop_) {
+      return;
+    }
+    stop_ = true;
+  }
+  con_.notify_all();
+  balance_con_.notify_all();
+  for (auto *e : executors_) {
+    {
+      std::unique_lock<std::mutex> l(e->runnable_mutex_);
+    }
+    e->runnable_con_.notify_all();
+  }
+
+  if (balancer_) {
+    balancer_->join();
+    balancer_.reset();
+  }
+
+  // All joined before the first executor is deleted, as the others steal
+  // from its deque.
+  for (auto *e : executors_) {
+    if (e->processor_) {
+      e->processor_->join();
+      e->processor_.reset();
+    }
+  }
+}
+
+void steal_group::balance_loop() {
+  std::unique_lock<std::mutex> l(mutex_);
+  while (!balance_con_.wait_for(l, std::chrono::milliseconds(REBALANCE_INTERVAL_MS),
+                                [this] { return stop_.load(); })) {
+    l.unlock();
+    rebalance();
+    l.lock();
+  }
+}
+
+/*!
+ * \brief Moving average, mostly over the last few samples.
+ */
+static uint64_t average(uint64_t avg, uint64_t sample) {
+  return (avg + sample) / 2;
+}
+
+int steal_group::place() const {
+  uint64_t busy = 0;
+  size_t conns = 0;
+  for (auto *e : executors_) {
+    busy += e->avg_busy_ns_.load(std::memory_order_relaxed);
+    conns += e->connection_count();
+  }
+  uint64_t per_connection = conns ? busy / conns : 0;
+
+  int best = 0;
+  uint64_t best_load = UINT64_MAX;
+  for (size_t i = 0; i < executors_.size(); ++i) {
+    executor *e = executors_[i];
+    uint64_t load = e->avg_busy_ns_.load(std::memory_order_relaxed) + e->connection_count() * per_connection;
+    if (load < best_load || (load == best_load && e->connection_count() < executors_[best]->connection_count())) {
+      best = (int) i;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+void steal_group::rebalance() {
+  size_t n = executors_.size();
+  std::vector<uint64_t> load(n);
+  for (size_t i = 0; i < n; ++i) {
+    executor *e = executors_[i];
+    uint64_t busy = e->busy_ns();
+    e->avg_busy_ns_.store(average(e->avg_busy_ns_.load(std::memory_order_relaxed), busy - e->last_busy_ns_),
+                          std::memory_order_relaxed);
+    e->last_busy_ns_ = busy;
+    load[i] = e->avg_busy_ns_.load(std::memory_order_relaxed);
+
+    size_t depth;
+    {
+      std::unique_lock<std::mutex> l(e->runnable_mutex_);
+      depth = e->runnable_.size();
+    }
+    e->avg_depth_ = average(e->avg_depth_, depth);
+  }
+
+  std::unique_lock<std::mutex> l(mutex_);
+  std::vector<std::vector<connection *>> assigned(n);
+  for (auto *s : connections_) {
+    connection_load &c = s->load_;
+    uint64_t busy = c.busy_ns_.load(std::memory_order_relaxed);
+    uint64_t bytes = c.bytes_.load(std::memory_order_relaxed);
+    c.avg_busy_ns_ = average(c.avg_busy_ns_, busy - c.last_busy_ns_);
+    c.avg_bytes_ = average(c.avg_bytes_, bytes - c.last_bytes_);
+    c.last_busy_ns_ = busy;
+    c.last_bytes_ = bytes;
+    assigned[s->executor_index_].push_back(s);
+  }
+
+  const uint64_t threshold = REBALANCE_INTERVAL_MS * 1000000 / 100 * REBALANCE_IMBALANCE_PERCENT;
+  for (size_t moves = 0; moves < n; ++moves) {
+    // Executors with queued connections first, at the same busy time.
+    size_t hi = 0, lo = 0;
+    for (size_t i = 1; i < n; ++i) {
+      if (load[i] > load[hi] || (load[i] == load[hi] &&
+                                 executors_[i]->avg_depth_ > executors_[hi]->avg_depth_)) {
+        hi = i;
+      }
+      if (load[i] < load[lo]) {
+        lo = i;
+      }
+    }
+
+    uint64_t gap = load[hi] - load[lo];
+    if (gap < threshold) {
+      break;
+    }
+
+    // Closest to half the gap, the busiest in bytes among equals. Moving
+    // a connection narrows the gap by twice its load if lighter than the
+    // gap, and light connections aren't worth moving.
+    connection *best = nullptr;
+    uint64_t best_distance = UINT64_MAX;
+    for (auto *s : assigned[hi]) {
+      uint64_t busy = s->load_.avg_busy_ns_;
+      if (2 * busy < threshold || busy >= gap) {
+        continue;
+      }
+
+      uint64_t distance = busy > gap / 2 ? busy - gap / 2 : gap / 2 - busy;
+      if (distance < best_distance ||
+          (distance == best_distance && s->load_.avg_bytes_ > best->load_.avg_bytes_)) {
+        best = s;
+        best_distance = distance;
+      }
+    }
+
+    if (!best) {
+      break;
+    }
+
+    uint64_t busy = best->load_.avg_busy_ns_;
+    best->executor_index_ = (int) lo;
+    executors_[hi]->connections_.fetch_sub(1, std::memory_order_relaxed);
+    executors_[lo]->connections_.fetch_add(1, std::memory_order_relaxed);
+    assigned[hi].erase(std::find(assigned[hi].begin(), assigned[hi].end(), best));
+    assigned[lo].push_back(best);
+    load[hi] -= busy;
+    load[lo] += busy;
+    migrations_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+cpu_executor::~cpu_executor() {
+  q_.push(task(task::SHUTDOWN, nullptr));
+  if (processor_.get())
+    processor_->join();
+}
+
+void cpu_executor::pin() {
+  unsigned int cores = std::thread::hardware_concurrency();
+  if (!cores)
+    return;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(index_ % cores, &set);
+
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err) {
+    std::cerr << "Unable to pin cpu executor " << index_ << " err: " << err << std::endl;
+  }
+}
+
+void cpu_executor::execute(task &t) {
+  response resp;
+  connection::execute(c_, t.header_, std::move(t.request_), resp);
+
+  task w(task::WRITE, t.s_, std::move(resp));
+  w.seq_ = t.seq_;
+  io_.add(std::move(w), t.s_->executor_index_);
+}
+}
@@ -9,74 +9,19 @@
 #include <map>
 #include <ctime>
 #include <assert.h>
-#include <deque>
+#include <unordered_set>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
-#include <unordered_set>
+#include <deque>
 
 #include "limits.h"
 #include "connection.h"
+#include "mpsc_queue.h"
 #include "murmur3_hash.h"
 
 namespace memcache {
 
-/*!
- * \brief A synchronized FIFO queue.
- * Currently the queue as no size limits.
- * @tparam Item type.
- */
-template<typename T>
-struct sync_queue {
-  typedef std::deque<T> queue;
-
-  explicit sync_queue() {}
-
-  /*!
-   * \brief Push an item. Not expected to block.
-   * @param v
-   */
-  void push(T v) {
-    std::unique_lock<std::mutex> lock(m_);
-    q_.push_back(std::move(v));
-    if (q_.size() == 1)
-      con_.notify_one();
-  }
-
-  /*!
-   * Pops an item from the queue. Blocks if empty.
-   * @return
-   */
-  T pop() {
-    std::unique_lock<std::mutex> lock(m_);
-    while (q_.empty()) {
-      con_.wait(lock);
-    }
-    return next();
-  }
-
-  bool size() {
-    std::unique_lock<std::mutex> lock(m_);
-    return q_.size();
-  }
-
-  bool empty() {
-    std::unique_lock<std::mutex> lock(m_);
-    return q_.empty();
-  }
-
-private:
-  std::mutex m_;
-  std::condition_variable con_;
-  queue q_;
-
-  T next() {
-    assert(!q_.empty());
-    T v(std::move(q_.front()));
-    q_.pop_front();
-    return v;
-  }
-};
-
 /*!
  * \brief Executor task struct.
  */
@@ -92,7 +37,7 @@ struct task {
      */
     NEW,
     /*!
-     * Read.
+     * Socket readable, read and process the incoming data.
      */
     READ,
     /*!
@@ -103,20 +48,41 @@ struct task {
      * Shutdown.
      */
     SHUTDOWN,
+    /*!
+     * Cache operation, processed on the CPU executor owning the key.
+     */
+    CACHE,
+    /*!
+     * Response of a cache operation, written back on the IO executor.
+     */
+    WRITE,
+    /*!
+     * Free the expired items of the CPU executor's partition.
+     */
+    EXPIRE,
+    /*!
+     * Socket writable, write out the queued responses.
+     */
+    FLUSH,
   };
 
   explicit task(type t, connection *s)
       : type_(t), s_(s) {}
 
-  explicit task(type t, connection *s, buffer b)
-      : type_(t), s_(s), packet_(std::move(b)) {}
+  explicit task(type t, connection *s, response r)
+      : type_(t), s_(s), response_(std::move(r)) {}
+
+  explicit task(type t, connection *s, iobuf&& r,
+                const protocol_binary_request_header& h)
+      : type_(t), s_(s), request_(std::move(r)), header_(h) {}
 
   /*!
    * \brief Move constructor.
    * @param t
    */
   task(task &&t)
-      : type_(t.type_), s_(t.s_), packet_(std::move(t.packet_)) {}
+      : type_(t.type_), s_(t.s_), response_(std::move(t.response_)),
+        request_(std::move(t.request_)), header_(t.header_), seq_(t.seq_) {}
 
   type type_ = NOOP;
 
@@ -126,35 +92,238 @@ struct task {
   connection *s_ = nullptr;
 
   /*!
-   * \brief Incoming packet (that may be a part of the whole packet).
+   * \brief Response for WRITE tasks.
+   */
+  response response_;
+
+  /*!
+   * \brief Complete request packet for CACHE tasks.
+   */
+  iobuf request_;
+
+  /*!
+   * \brief Request header for CACHE tasks, in host byte order.
    */
-  buffer packet_;
+  protocol_binary_request_header header_ = {};
+
+  /*!
+   * \brief Request sequence number on the connection, for CACHE and WRITE tasks.
+   */
+  uint64_t seq_ = 0;
 
 private:
   task(const task &) = delete;
   task &operator=(const task &) = delete;
 };
 
+struct executor;
+
+/*!
+ * \brief IO executors stealing work from each other, or rebalancing their
+ * connections, or both (see IOPoolExecutor::init).
+ *
+ * The tasks of a connection go in a queue of its own, and a connection
+ * with tasks is scheduled on the deque of the executor it is assigned to.
+ * Executors run the connections of their deque, and idle executors steal
+ * connections from the deques of the others, so a few busy connections
+ * don't saturate one executor while the others idle. A connection is only
+ * on one deque at a time, and is run by one executor at a time, so its
+ * tasks are still processed in order.
+ *
+ * The same makes it safe to move a connection to another executor at any
+ * time: only where it is scheduled next changes. The rebalancer thread
+ * keeps moving averages of the busy time of the executors and of their
+ * connections, and of the depth of their deques, every
+ * REBALANCE_INTERVAL_MS. When the busy times of the most and least loaded
+ * executors are REBALANCE_IMBALANCE_PERCENT of the interval apart, it
+ * moves connections between them, picking the connections whose load is
+ * closest to half the difference, so the moves don't just swap the two,
+ * and leaving the light ones where they are.
+ */
+struct steal_group {
+  ~steal_group();
+
+  std::vector<executor *> executors_;
+
+  /*!
+   * \brief Steal connections from the other executors when idle.
+   */
+  bool steal_ = false;
+
+  /*!
+   * \brief Connections scheduled on the deques of all the executors.
+   */
+  std::atomic<size_t> runnable_{0};
+
+  /*!
+   * \brief Executors sleeping, waiting for connections to run.
+   */
+  std::atomic<size_t> sleepers_{0};
+
+  /*!
+   * \brief Protects the connections, and the sleeping executors.
+   */
+  std::mutex mutex_;
+  std::condition_variable con_;
+  std::atomic<bool> stop_{false};
+
+  /*!
+   * \brief Connections not closed yet, deleted on shutdown.
+   */
+  std::unordered_set<connection *> connections_;
+
+  /*!
+   * \brief Rebalancer thread, if rebalancing, sleeping on balance_con_
+   * between rounds.
+   */
+  std::unique_ptr<std::thread> balancer_;
+  std::condition_variable balance_con_;
+
+  /*!
+   * \brief Connections moved between executors.
+   */
+  std::atomic<uint64_t> migrations_{0};
+
+  /*!
+   * \brief Wake up a sleeping executor, if any, to run a connection just scheduled.
+   */
+  void notify() {
+    if (sleepers_.load()) {
+      std::unique_lock<std::mutex> l(mutex_);
+      con_.notify_one();
+    }
+  }
+
+  /*!
+   * \brief Drop a reference to the connection, deleting it if the last.
+   */
+  static void release(connection *s);
+
+  /*!
+   * \brief Start the rebalancer thread.
+   */
+  void start_balancer();
+
+  /*!
+   * \brief Stop the executors and the rebalancer, and wait for their threads.
+   */
+  void stop();
+
+  /*!
+   * \brief Pick the executor of a new connection: the least loaded,
+   * counting the average load of a connection for each connection it
+   * has, so that connections accepted together are spread.
+   */
+  int place() const;
+
+  /*!
+   * \brief Update the moving averages, and move connections from the most
+   * to the least loaded executors.
+   */
+  void rebalance();
+
+private:
+  /*!
+   * \brief Rebalancer thread loop.
+   */
+  void balance_loop();
+};
+
 /*!
  * \brief Executor class.
- * Backed by a sync_queue and processing thread.
+ * Backed by an mpsc_queue and processing thread.
  * Processes tasks in FIFO order.
+ *
+ * An executor can instead run an epoll loop of its own (see listen): it
+ * accepts connections on its own listening socket, and reads, processes
+ * and writes back the requests of its connections on its thread, with no
+ * handoff between threads. Tasks, e.g. responses from the CPU executors,
+ * are then queued, and the loop woken up with an eventfd if it parked
+ * the queue (see mpsc_queue::park).
+ *
+ * Or an executor can be one of a steal_group, running the connections
+ * scheduled on it, or on the others when idle.
  */
 struct executor {
   explicit executor() {
     processor_.reset(new std::thread(std::bind(&executor::process, this)));
   }
+
+  /*!
+   * \brief Executor running an epoll loop, started with listen.
+   * @param index Index of the executor in its pool.
+   * @param c Cache.
+   * @param cpu_pool CPU executor pool owning the cache partitions, if any.
+   */
+  explicit executor(int index, sharded_cache &c, CPUPoolExecutor *cpu_pool)
+      : index_(index), c_(&c), cpu_pool_(cpu_pool) {}
+
+  /*!
+   * \brief Executor of a steal_group, started with start.
+   * @param index Index of the executor in the group.
+   * @param group
+   */
+  explicit executor(int index, steal_group &group)
+      : index_(index), group_(&group) {}
+
   ~executor();
 
   /*!
    * \brief backing queue.
    */
-  sync_queue<task> q_;
+  mpsc_queue<task> q_;
 
   void add(task &&d) {
-    q_.push(std::move(d));
+    if (q_.push(std::move(d)) && wake_fd_ != -1) {
+      wake();
+    }
+  }
+
+  /*!
+   * \brief Schedule a connection with tasks on the executor, for a steal_group.
+   * @param s
+   */
+  void schedule(connection *s);
+
+  /*!
+   * \brief Start running the connections, for a steal_group.
+   */
+  void start() {
+    assert(group_);
+    processor_.reset(new std::thread(std::bind(&executor::steal_loop, this)));
+  }
+
+  /*!
+   * \brief Time spent processing tasks, in nanoseconds.
+   */
+  uint64_t busy_ns() const {
+    return busy_ns_.load(std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Connections stolen from other executors.
+   */
+  uint64_t steals() const {
+    return steals_.load(std::memory_order_relaxed);
   }
 
+  /*!
+   * \brief Connections assigned to the executor, in a steal_group.
+   */
+  size_t connection_count() const {
+    return connections_.load(std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Listen on a socket of the executor's own, bound to the address
+   * with SO_REUSEPORT so the kernel spreads the connections over the
+   * executors, and start the epoll loop.
+   * @param ip
+   * @param port
+   * @return True if successful.
+   */
+  bool listen(const std::string &ip, int port);
+
 private:
   // Disable copy.
   executor(const executor &) = delete;
@@ -165,12 +334,115 @@ private:
 
   std::unique_ptr<std::thread> processor_;
 
+  /* Epoll loop state */
+  int index_ = -1;
+  sharded_cache *c_ = nullptr;
+  CPUPoolExecutor *cpu_pool_ = nullptr;
+  std::unique_ptr<socket> listener_;
+  std::unique_ptr<EpollHelper> ep_;
+
+  /*!
+   * \brief Eventfd the epoll loop is woken up with, when tasks are queued.
+   */
+  int wake_fd_ = -1;
+
+  /* Work stealing state */
+  steal_group *group_ = nullptr;
+
+  /*!
+   * \brief Connections scheduled on the executor, run from the front by
+   * the executor and stolen from the front by the others.
+   */
+  std::mutex runnable_mutex_;
+  std::deque<connection *> runnable_;
+
+  /*!
+   * \brief Signaled when a connection is scheduled, if not stealing: the
+   * executor then only sleeps until it has connections of its own.
+   */
+  std::condition_variable runnable_con_;
+
+  std::atomic<uint64_t> busy_ns_{0};
+  std::atomic<uint64_t> steals_{0};
+
+  /* Load, for placing and rebalancing connections (see steal_group) */
+  friend struct steal_group;
+  friend class IOPoolExecutor;
+  std::atomic<size_t> connections_{0};
+
+  /*!
+   * \brief Moving averages of the busy time per rebalance interval, read
+   * when placing new connections, and of the depth of the deque.
+   */
+  std::atomic<uint64_t> avg_busy_ns_{0};
+  uint64_t avg_depth_ = 0;
+  uint64_t last_busy_ns_ = 0;
+
+  /*!
+   * \brief Take the next connection scheduled on the executor, if any.
+   */
+  connection *pop_runnable();
+
+  /*!
+   * \brief Next connection to run: scheduled on the executor, or stolen
+   * from another one. Sleeps while there are none.
+   * @return nullptr once the group stops.
+   */
+  connection *next_runnable();
+
+  /*!
+   * \brief Process the tasks queued on a connection, and schedule it again
+   * on the executor if more came in the meantime.
+   * @param s
+   */
+  void run(connection *s);
+
+  /*!
+   * \brief Work stealing loop.
+   */
+  void steal_loop();
+
+  /*!
+   * \brief Wake the epoll loop up.
+   */
+  void wake();
+
+  /*!
+   * \brief Epoll loop.
+   */
+  void loop();
+
+  /*!
+   * \brief Process the queued tasks, on the epoll loop.
+   * @return False on shutdown.
+   */
+  bool process_queued();
+
+  /*!
+   * \brief Accept the incoming connections, on the epoll loop.
+   */
+  void accept_connections();
+
+  /*!
+   * \brief Handle the epoll events of a connection: flush the queued
+   * responses, and read and process the incoming data.
+   * @param s connection
+   * @param events epoll events.
+   */
+  void handle_events(connection *s, uint32_t events);
+
+  /*!
+   * \brief Stop watching the socket of a connection and close it, on the epoll loop.
+   * @param s connection
+   */
+  void hangup(connection *s);
+
   /*!
    * \brief Process task based on its type.
    * @param t task
    * @return True if successfully processed. False otherwise (means connection should be closed.)
    */
-  bool process_inl(const task &t);
+  bool process_inl(task &t);
 
   /*!
    * \brief Add a new connection.
@@ -185,17 +457,35 @@ private:
   void close_connection(connection *s);
 
   /*!
-   * \brief Add and buffer read data to the connection info object.
+   * \brief Read and process the data received on a connection.
    * @param s connection
-   * @param b data.
    */
-  void put_new_data(connection *s, buffer b);
+  void read(connection *s);
+
+  /*!
+   * \brief Write back a response which came back from a CPU executor.
+   * @param s connection
+   * @param seq request sequence number.
+   * @param r response.
+   */
+  void put_response(connection *s, uint64_t seq, response r);
+
+  /*!
+   * \brief Write out the responses queued on a connection.
+   * @param s connection
+   */
+  void flush(connection *s);
 
   /*!
    * \brief Cleanup all state.
    */
   void cleanup();
 
+  void add_busy(std::chrono::steady_clock::time_point start) {
+    busy_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+  }
+
   /*!
    * \brief Executor thread process loop.
    */
@@ -205,7 +495,11 @@ private:
       if (v.type_ != task::SHUTDOWN) {
         assert(v.s_);
       }
-      if (!process_inl(v))
+
+      auto start = std::chrono::steady_clock::now();
+      bool ok = process_inl(v);
+      add_busy(start);
+      if (!ok)
         break;
     }
 
@@ -223,12 +517,58 @@ public:
   }
   ~IOPoolExecutor() {}
 
-  void init(int size) {
+  /*!
+   * \brief Create the executors.
+   * @param size Number of executors.
+   * @param steal Have the executors steal connections from each other
+   * (see steal_group), rather than only process the connections assigned
+   * to them.
+   * @param balance Place new connections on the least loaded executor, and
+   * move connections between executors as their load changes.
+   */
+  void init(int size, bool steal = false, bool balance = false) {
+    if (steal || balance) {
+      group_.reset(new steal_group());
+      group_->steal_ = steal;
+      for (int i = 0; i < size; ++i) {
+        executors_.push_back(std::unique_ptr<executor>(new executor(i, *group_)));
+        group_->executors_.push_back(executors_.back().get());
+      }
+      for (auto &e : executors_) {
+        e->start();
+      }
+      if (balance) {
+        group_->start_balancer();
+      }
+      return;
+    }
+
     for (int i = 0;i < size;++i) {
       executors_.push_back(std::move(std::unique_ptr<executor>(new executor())));
     }
   }
 
+  /*!
+   * \brief Create executors running their own epoll loop, each listening on
+   * the address with a socket of its own.
+   * @param size Number of executors.
+   * @param ip
+   * @param port
+   * @param c Cache.
+   * @param cpu_pool CPU executor pool owning the cache partitions, if any.
+   * @return True if all the executors are listening.
+   */
+  bool listen(int size, const std::string &ip, int port, sharded_cache &c,
+              CPUPoolExecutor *cpu_pool = nullptr) {
+    for (int i = 0; i < size; ++i) {
+      executors_.push_back(std::unique_ptr<executor>(new executor(i, c, cpu_pool)));
+      if (!executors_.back()->listen(ip, port)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   /*!
    * \brief Add task to the specified executor.
    * Pick the next round-robin executor if index is -1.
@@ -242,6 +582,11 @@ public:
       index = pick();
     }
 
+    if (group_) {
+      steal(std::move(t), index);
+      return;
+    }
+
     executors_[index]->add(std::move(t));
   }
 
@@ -255,12 +600,202 @@ public:
     return picked;
   }
 
+  /*!
+   * \brief Pick the executor of a new connection: the least loaded one
+   * when rebalancing, else the next round-robin.
+   * @return Picked executor index.
+   */
+  int place() {
+    if (group_ && group_->balancer_) {
+      return group_->place();
+    }
+    return pick();
+  }
+
+  /*!
+   * \brief True if the executors steal work from each other.
+   */
+  bool stealing() const {
+    return group_ && group_->steal_;
+  }
+
+  /*!
+   * \brief Connections moved between executors by the rebalancer.
+   */
+  uint64_t migrations() const {
+    return group_ ? group_->migrations_.load(std::memory_order_relaxed) : 0;
+  }
+
+  /*!
+   * \brief Outlives the executors.
+   */
+  std::unique_ptr<steal_group> group_;
+
   std::vector<std::unique_ptr<executor>> executors_;
 private:
 
   uint64_t next_ = 0;
 
+  /*!
+   * \brief Queue a task on its connection, and schedule the connection on
+   * the executor if it wasn't already.
+   * @param t Task
+   * @param index executor index.
+   */
+  void steal(task&& t, int index) {
+    connection *s = t.s_;
+    if (t.type_ == task::NEW) {
+      s->tasks_.reset(new mpsc_queue<task>(CONNECTION_QUEUE_SIZE));
+      executors_[index]->connections_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Counted before it is queued, so the executor running the connection
+    // never pops more tasks than are counted. Referenced until out of push,
+    // which still touches the queue after the task can be run: the task
+    // closing the connection could otherwise delete it, queue and all.
+    s->refs_.fetch_add(1, std::memory_order_relaxed);
+    bool idle = !s->tasks_pending_.fetch_add(1);
+    s->tasks_->push(std::move(t));
+    if (idle) {
+      executors_[index]->schedule(s);
+    }
+    steal_group::release(s);
+  }
+
   IOPoolExecutor(const IOPoolExecutor &) = delete;
   IOPoolExecutor &operator=(const IOPoolExecutor &) = delete;
 };
-}
\ No newline at end of file
+
+/*!
+ * \brief CPU executor.
+ * Exclusively owns one partition of the cache and performs the cache
+ * operations for the keys hashing to it, so no locking is needed.
+ * Responses are handed back to the IO executor of the connection.
+ * Background reclaim of the partition is done between tasks, when the
+ * executor is idle. Expired items are freed on EXPIRE tasks, a batch per
+ * task, so requests queued behind are not held up.
+ */
+struct cpu_executor {
+  explicit cpu_executor(int index, sharded_cache &c, IOPoolExecutor &io)
+      : index_(index), c_(c), io_(io) {
+    processor_.reset(new std::thread(std::bind(&cpu_executor::process, this)));
+  }
+  ~cpu_executor();
+
+  /*!
+   * \brief backing queue.
+   */
+  mpsc_queue<task> q_;
+
+  void add(task &&d) {
+    q_.push(std::move(d));
+  }
+
+private:
+  // Disable copy.
+  cpu_executor(const cpu_executor &) = delete;
+  cpu_executor &operator=(const cpu_executor &) = delete;
+
+  /*!
+   * \brief Index of the executor, and of the owned cache partition.
+   */
+  int index_ = 0;
+
+  sharded_cache &c_;
+  IOPoolExecutor &io_;
+
+  std::unique_ptr<std::thread> processor_;
+
+  /*!
+   * \brief Pin the executor thread to a core.
+   */
+  void pin();
+
+  /*!
+   * \brief Perform the cache operation and hand the response back.
+   * @param t task
+   */
+  void execute(task &t);
+
+  /*!
+   * \brief Executor thread process loop.
+   */
+  void process() {
+    pin();
+
+    cache &s = c_.shard_at(index_);
+    while (true) {
+      // Reclaim memory of the partition while idle.
+      while (s.reclaim_wanted() && q_.empty() && s.reclaim(RECLAIM_BATCH_SIZE)) {
+      }
+
+      auto v = q_.pop();
+      if (v.type_ == task::SHUTDOWN)
+        break;
+
+      if (v.type_ == task::EXPIRE) {
+        // More to do, queue up behind the pending requests.
+        if (s.expire(EXPIRE_BATCH_SIZE) == EXPIRE_BATCH_SIZE) {
+          add(task(task::EXPIRE, nullptr));
+        }
+        continue;
+      }
+
+      assert(v.type_ == task::CACHE);
+      execute(v);
+    }
+  }
+};
+
+/*!
+ * \brief CPU thread pool executor.
+ * Each executor owns the cache partition with the same index, and
+ * requests are routed to the executor owning the key.
+ */
+class CPUPoolExecutor {
+public:
+  explicit CPUPoolExecutor() {}
+  ~CPUPoolExecutor() {}
+
+  /*!
+   * \brief Create an executor per cache partition.
+   * @param c Cache. Expected to be created unlocked, with a shard per executor.
+   * @param io IO pool executor to hand responses back to.
+   */
+  void init(sharded_cache &c, IOPoolExecutor &io) {
+    for (size_t i = 0; i < c.shards(); ++i) {
+      executors_.push_back(std::unique_ptr<cpu_executor>(new cpu_executor(i, c, io)));
+    }
+  }
+
+  /*!
+   * \brief Add task to the executor owning the partition.
+   * @param t Task
+   * @param index partition index.
+   */
+  void add(task &&t, int index) {
+    assert(t.s_);
+    assert(t.type_ == task::CACHE);
+    executors_[index]->add(std::move(t));
+  }
+
+  /*!
+   * \brief Have every executor free the expired items of its partition.
+   */
+  void expire() {
+    for (auto &e : executors_) {
+      e->add(task(task::EXPIRE, nullptr));
+    }
+  }
+
+  size_t size() const {
+    return executors_.size();
+  }
+
+private:
+  std::vector<std::unique_ptr<cpu_executor>> executors_;
+
+  CPUPoolExecutor(const CPUPoolExecutor &) = delete;
+  CPUPoolExecutor &operator=(const CPUPoolExecutor &) = delete;
+};
+}
@@ -0,0 +1,125 @@
+//
+// Frequency sketch.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace memcache {
+
+/*!
+ * \brief Count-min sketch of key access frequencies, for TinyLFU admission.
+ *
+ * Counters are 4 bits, packed 16 to a word, and each key hash maps to a
+ * counter in each of 4 rows spread over the table. The estimate of a key is
+ * the smallest of its counters, and increments only bump the counters equal
+ * to that smallest one (conservative update), which keeps over-estimates
+ * from collisions down.
+ *
+ * Once the number of accesses reaches 10 times the number of counters,
+ * all counters are halved, so that the estimates follow recent popularity
+ * rather than all time popularity.
+ *
+ * Hashes are computed by the caller (see cache::hasher).
+ */
+class frequency_sketch {
+public:
+  static const uint8_t MAX_COUNT = 15;
+
+  /*!
+   * \brief Create the sketch.
+   * @param counters Number of counters, rounded up to a power of 2.
+   */
+  explicit frequency_sketch(size_t counters) {
+    size_t n = 16;
+    while (n < counters) {
+      n <<= 1;
+    }
+
+    table_.resize(n / 16);
+    mask_ = n - 1;
+    sample_size_ = 10 * n;
+  }
+
+  /*!
+   * \brief Record an access to the key.
+   */
+  void increment(uint32_t hash) {
+    size_t idx[ROWS];
+    uint8_t min = estimate(hash, idx);
+    if (min < MAX_COUNT) {
+      for (size_t i = 0; i < ROWS; ++i) {
+        if (get(idx[i]) == min) {
+          table_[idx[i] >> 4] += (uint64_t) 1 << ((idx[i] & 15) << 2);
+        }
+      }
+    }
+
+    // Every access counts towards aging, so a saturated sketch ages too.
+    if (++additions_ >= sample_size_) {
+      age();
+    }
+  }
+
+  /*!
+   * \brief Estimated number of recent accesses to the key, up to MAX_COUNT.
+   */
+  uint8_t estimate(uint32_t hash) const {
+    size_t idx[ROWS];
+    return estimate(hash, idx);
+  }
+
+  /*!
+   * \brief Memory used by the counters, in bytes.
+   */
+  size_t memory() const {
+    return table_.size() * sizeof(uint64_t);
+  }
+
+private:
+  static const size_t ROWS = 4;
+
+  std::vector<uint64_t> table_;
+  size_t mask_ = 0;
+  size_t sample_size_ = 0;
+  size_t additions_ = 0;
+
+  uint8_t get(size_t i) const {
+    return (uint8_t) ((table_[i >> 4] >> ((i & 15) << 2)) & 0xf);
+  }
+
+  /*!
+   * \brief Counter index in each row, and the smallest of the counters.
+   */
+  uint8_t estimate(uint32_t hash, size_t *idx) const {
+    static const uint64_t seeds[ROWS] = {
+        0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+        0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL};
+
+    uint8_t min = MAX_COUNT;
+    for (size_t i = 0; i < ROWS; ++i) {
+      uint64_t h = (hash + seeds[i]) * seeds[i];
+      idx[i] = (size_t) (h >> 32) & mask_;
+      uint8_t c = get(idx[i]);
+      if (c < min) {
+        min = c;
+      }
+    }
+    return min;
+  }
+
+  /*!
+   * \brief Halve all the counters.
+   */
+  void age() {
+    for (auto &w : table_) {
+      w = (w >> 1) & 0x7777777777777777ULL;
+    }
+    additions_ /= 2;
+  }
+};
+}
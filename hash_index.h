@@ -0,0 +1,398 @@
+//
+// Open addressing hash index.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "stats.h"
+
+namespace memcache {
+
+/*!
+ * \brief Open addressing hash index, in the style of the Swiss table.
+ *
+ * Each slot has a control byte, holding either a 7 bit fingerprint of the
+ * key hash (H2), or a marker for an empty or deleted slot. Lookups start at
+ * the position picked by the rest of the hash (H1) and scan the control
+ * bytes 16 at a time (with SSE2 where available), comparing keys only for
+ * the slots whose fingerprint matches. Keys and values are stored inline in
+ * the slot array, so a typical hit costs one control group probe and one
+ * key compare, and inserts do not allocate.
+ *
+ * Hashes are computed by the caller and passed in, so that they are only
+ * computed once per operation. The hasher is only used when growing.
+ * @tparam K Key type, compared using operator==.
+ * @tparam V Value type.
+ * @tparam Hash Key hasher.
+ */
+template<typename K, typename V, typename Hash>
+class hash_index {
+public:
+  /*!
+   * \brief Index entry.
+   */
+  struct slot {
+    slot(const K& k, V&& v) : key_(k), value_(std::move(v)) {}
+
+    K key_;
+    V value_;
+  };
+
+  static const size_t GROUP_SIZE = 16;
+
+  explicit hash_index(size_t items = 0) {
+    if (items) {
+      reserve(items);
+    }
+  }
+
+  ~hash_index() {
+    destroy();
+  }
+
+  /*!
+   * \brief Find the value for a key.
+   * @param k Key.
+   * @param hash Key hash.
+   * @return Pointer to the value, or nullptr if not found.
+   */
+  V* find(const K& k, uint32_t hash) {
+    size_t i = find_index(k, hash);
+    return i == npos ? nullptr : &slots_[i].value_;
+  }
+
+  /*!
+   * \brief Prefetch the first control group of the probe sequence of a
+   * hash, so that lookups of a batch of keys overlap their cache misses.
+   * @param hash Key hash.
+   */
+  void prefetch(uint32_t hash) const {
+    if (capacity_) {
+      __builtin_prefetch(ctrl_ + (h1(hash) & mask_));
+    }
+  }
+
+  /*!
+   * \brief Value of the first slot of the first group whose fingerprint
+   * matches, without comparing the key. Usually the value find returns, for
+   * prefetching what it points to.
+   * @param hash Key hash.
+   * @return Pointer to the value, or nullptr if no fingerprint matches.
+   */
+  const V* probe(uint32_t hash) const {
+    if (!capacity_) {
+      return nullptr;
+    }
+
+    size_t pos = h1(hash) & mask_;
+    uint32_t m = group(ctrl_ + pos).match(h2(hash));
+    return m ? &slots_[(pos + __builtin_ctz(m)) & mask_].value_ : nullptr;
+  }
+
+  /*!
+   * \brief Insert a key, if not already present.
+   * @param k Key.
+   * @param v Value.
+   * @param hash Key hash.
+   * @return The value for the key, and true if it was inserted.
+   */
+  std::pair<V*, bool> insert(const K& k, V v, uint32_t hash) {
+    size_t i = find_index(k, hash);
+    if (i != npos) {
+      return std::make_pair(&slots_[i].value_, false);
+    }
+
+    if (!growth_left_) {
+      grow();
+    }
+
+    i = find_free(hash);
+    if (ctrl_[i] == EMPTY) {
+      --growth_left_;
+    }
+
+    new (&slots_[i]) slot(k, std::move(v));
+    set_ctrl(i, h2(hash));
+    ++size_;
+
+    return std::make_pair(&slots_[i].value_, true);
+  }
+
+  /*!
+   * \brief Erase a key.
+   * @param k Key.
+   * @param hash Key hash.
+   * @return True if the key was found and erased.
+   */
+  bool erase(const K& k, uint32_t hash) {
+    size_t i = find_index(k, hash);
+    if (i == npos) {
+      return false;
+    }
+
+    slots_[i].~slot();
+    set_ctrl(i, DELETED);
+    --size_;
+    return true;
+  }
+
+  /*!
+   * \brief Make room for the given number of items without growing.
+   * @param items
+   */
+  void reserve(size_t items) {
+    size_t capacity = GROUP_SIZE;
+    while (max_load(capacity) < items) {
+      capacity *= 2;
+    }
+
+    if (capacity > capacity_) {
+      resize(capacity);
+    }
+  }
+
+  void clear() {
+    destroy();
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  /*!
+   * \brief Memory used by the index, in bytes.
+   */
+  size_t memory() const {
+    return capacity_ ? capacity_ * sizeof(slot) + capacity_ + GROUP_SIZE : 0;
+  }
+
+private:
+  typedef int8_t ctrl_t;
+
+  // Fingerprints have the top bit clear, markers have it set.
+  static const ctrl_t EMPTY = -128;
+  static const ctrl_t DELETED = -2;
+
+  static const size_t npos = (size_t) -1;
+
+#ifdef __SSE2__
+  /*!
+   * \brief A group of control bytes, matched using SSE2.
+   */
+  struct group {
+    explicit group(const ctrl_t *p) : ctrl_(_mm_loadu_si128((const __m128i *) p)) {}
+
+    /*!
+     * \brief Bitmask of the slots with the given control byte.
+     */
+    uint32_t match(ctrl_t c) const {
+      return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c), ctrl_));
+    }
+
+    /*!
+     * \brief Bitmask of the empty or deleted slots.
+     */
+    uint32_t match_free() const {
+      return (uint32_t) _mm_movemask_epi8(ctrl_);
+    }
+
+    __m128i ctrl_;
+  };
+#else
+  /*!
+   * \brief A group of control bytes, matched a byte at a time.
+   */
+  struct group {
+    explicit group(const ctrl_t *p) : ctrl_(p) {}
+
+    uint32_t match(ctrl_t c) const {
+      uint32_t m = 0;
+      for (size_t i = 0; i < GROUP_SIZE; ++i) {
+        m |= (uint32_t) (ctrl_[i] == c) << i;
+      }
+      return m;
+    }
+
+    uint32_t match_free() const {
+      uint32_t m = 0;
+      for (size_t i = 0; i < GROUP_SIZE; ++i) {
+        m |= (uint32_t) (ctrl_[i] < 0) << i;
+      }
+      return m;
+    }
+
+    const ctrl_t *ctrl_;
+  };
+#endif
+
+  /*!
+   * \brief Control bytes. The first GROUP_SIZE bytes are mirrored after the
+   * end, so a group can be loaded at any position without wrapping.
+   */
+  ctrl_t *ctrl_ = nullptr;
+  slot *slots_ = nullptr;
+
+  /*!
+   * \brief Read by any thread for the stats, see memory and size.
+   */
+  gauge<size_t> capacity_;
+  size_t mask_ = 0;
+  gauge<size_t> size_;
+
+  /*!
+   * \brief Inserts left before growing, not counting reuse of deleted slots.
+   */
+  size_t growth_left_ = 0;
+
+  hash_index(const hash_index&) = delete;
+  hash_index& operator=(const hash_index&) = delete;
+
+  /*!
+   * \brief Max items for a capacity, at a load factor of 7/8.
+   */
+  static size_t max_load(size_t capacity) {
+    return capacity - capacity / 8;
+  }
+
+  /*!
+   * \brief Start position of the probe sequence.
+   * The hash is remixed, since its high bits also pick the cache shard.
+   */
+  static size_t h1(uint32_t hash) {
+    return (size_t) (((uint64_t) hash * 0x9E3779B97F4A7C15ULL) >> 32);
+  }
+
+  /*!
+   * \brief Fingerprint stored in the control byte.
+   */
+  static ctrl_t h2(uint32_t hash) {
+    return (ctrl_t) (hash & 0x7F);
+  }
+
+  void set_ctrl(size_t i, ctrl_t c) {
+    ctrl_[i] = c;
+    if (i < GROUP_SIZE) {
+      ctrl_[capacity_ + i] = c;
+    }
+  }
+
+  size_t find_index(const K& k, uint32_t hash) const {
+    if (!capacity_) {
+      return npos;
+    }
+
+    ctrl_t fp = h2(hash);
+    size_t pos = h1(hash) & mask_;
+
+    // Triangular probing over groups visits every group once.
+    for (size_t step = GROUP_SIZE;; step += GROUP_SIZE) {
+      group g(ctrl_ + pos);
+      for (uint32_t m = g.match(fp); m; m &= m - 1) {
+        size_t i = (pos + __builtin_ctz(m)) & mask_;
+        if (slots_[i].key_ == k) {
+          return i;
+        }
+      }
+
+      if (g.match(EMPTY)) {
+        return npos;
+      }
+
+      assert(step <= capacity_);
+      pos = (pos + step) & mask_;
+    }
+  }
+
+  /*!
+   * \brief First empty or deleted slot in the probe sequence.
+   */
+  size_t find_free(uint32_t hash) const {
+    size_t pos = h1(hash) & mask_;
+    for (size_t step = GROUP_SIZE;; step += GROUP_SIZE) {
+      uint32_t m = group(ctrl_ + pos).match_free();
+      if (m) {
+        return (pos + __builtin_ctz(m)) & mask_;
+      }
+
+      assert(step <= capacity_);
+      pos = (pos + step) & mask_;
+    }
+  }
+
+  /*!
+   * \brief Grow, or only drop the deleted slots if they make for most of the load.
+   */
+  void grow() {
+    if (!capacity_) {
+      resize(GROUP_SIZE);
+    } else if (size_ <= max_load(capacity_) / 2) {
+      resize(capacity_);
+    } else {
+      resize(capacity_ * 2);
+    }
+  }
+
+  void resize(size_t capacity) {
+    assert(capacity >= GROUP_SIZE);
+    assert((capacity & (capacity - 1)) == 0);
+    assert(max_load(capacity) >= size_);
+
+    ctrl_t *old_ctrl = ctrl_;
+    slot *old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    ctrl_ = new ctrl_t[capacity + GROUP_SIZE];
+    memset(ctrl_, EMPTY, capacity + GROUP_SIZE);
+    slots_ = static_cast<slot *>(::operator new(capacity * sizeof(slot)));
+    capacity_ = capacity;
+    mask_ = capacity - 1;
+    growth_left_ = max_load(capacity) - size_;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] >= 0) {
+        uint32_t hash = (uint32_t) Hash()(old_slots[i].key_);
+        size_t j = find_free(hash);
+        new (&slots_[j]) slot(std::move(old_slots[i]));
+        set_ctrl(j, h2(hash));
+        old_slots[i].~slot();
+      }
+    }
+
+    delete[] old_ctrl;
+    ::operator delete(old_slots);
+  }
+
+  void destroy() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0) {
+        slots_[i].~slot();
+      }
+    }
+
+    delete[] ctrl_;
+    ::operator delete(slots_);
+
+    ctrl_ = nullptr;
+    slots_ = nullptr;
+    capacity_ = mask_ = size_ = growth_left_ = 0;
+  }
+};
+}
@@ -0,0 +1,164 @@
+#include <string.h>
+#include <algorithm>
+
+#include "iobuf.h"
+
+namespace memcache {
+
+iobuf::iobuf(std::string &&s) {
+  if (s.empty()) {
+    return;
+  }
+
+  block *b = new block();
+  b->str_ = std::move(s);
+  b->data_ = &b->str_[0];
+  b->capacity_ = b->used_ = b->str_.size();
+
+  head_.b_ = b;
+  head_.len_ = b->capacity_;
+}
+
+iobuf iobuf::create(size_t capacity) {
+  block *b = new block();
+  b->memory_.reset(new char[capacity]);
+  b->data_ = b->memory_.get();
+  b->capacity_ = capacity;
+
+  iobuf ret;
+  ret.head_.b_ = b;
+  return ret;
+}
+
+const char *iobuf::coalesce() {
+  if (contiguous()) {
+    return data();
+  }
+
+  iobuf b = create(size());
+  b.append(*this);
+  *this = std::move(b);
+  return data();
+}
+
+iobuf iobuf::split(size_t n) {
+  assert(n <= size());
+  iobuf ret;
+
+  while (n) {
+    slice &s = head_;
+    if (n < s.len_) {
+      // Share the block.
+      s.b_->refs_.fetch_add(1, std::memory_order_relaxed);
+      ret.push(slice{s.b_, s.off_, n});
+      s.off_ += n;
+      s.len_ -= n;
+      break;
+    }
+
+    // Hand the whole slice over.
+    n -= s.len_;
+    ret.push(s);
+    if (rest_.empty()) {
+      // Keep the block, to write after the bytes split off.
+      s.b_->refs_.fetch_add(1, std::memory_order_relaxed);
+      s.off_ += s.len_;
+      s.len_ = 0;
+      break;
+    }
+
+    head_ = rest_.front();
+    rest_.erase(rest_.begin());
+  }
+
+  return ret;
+}
+
+void iobuf::append(iobuf &&b) {
+  if (b.head_.b_) {
+    push(b.head_);
+  }
+  for (auto &s : b.rest_) {
+    push(s);
+  }
+
+  b.head_ = slice();
+  b.rest_.clear();
+}
+
+void iobuf::append(const char *p, size_t n) {
+  size_t room = std::min(n, tailroom());
+  if (room) {
+    memcpy(tail(), p, room);
+    commit(room);
+    p += room;
+    n -= room;
+  }
+
+  if (n) {
+    iobuf b = create(n);
+    memcpy(b.tail(), p, n);
+    b.commit(n);
+    append(std::move(b));
+  }
+}
+
+void iobuf::append(const iobuf &b) {
+  if (b.head_.len_) {
+    append(b.head_.b_->data_ + b.head_.off_, b.head_.len_);
+  }
+  for (auto &s : b.rest_) {
+    append(s.b_->data_ + s.off_, s.len_);
+  }
+}
+
+int iobuf::iov(struct iovec *v, int max) const {
+  int n = 0;
+  if (head_.len_ && n < max) {
+    v[n].iov_base = head_.b_->data_ + head_.off_;
+    v[n].iov_len = head_.len_;
+    ++n;
+  }
+
+  for (auto it = rest_.begin(); it != rest_.end() && n < max; ++it) {
+    v[n].iov_base = it->b_->data_ + it->off_;
+    v[n].iov_len = it->len_;
+    ++n;
+  }
+  return n;
+}
+
+void iobuf::clear() {
+  release(head_.b_);
+  for (auto &s : rest_) {
+    release(s.b_);
+  }
+
+  head_ = slice();
+  rest_.clear();
+}
+
+void iobuf::push(const slice &s) {
+  if (!head_.b_) {
+    head_ = s;
+    return;
+  }
+
+  // An empty head only holds a block, to write to.
+  if (!head_.len_ && rest_.empty()) {
+    release(head_.b_);
+    head_ = s;
+    return;
+  }
+
+  // Merge with the slice it continues.
+  slice &l = last();
+  if (l.b_ == s.b_ && l.off_ + l.len_ == s.off_) {
+    l.len_ += s.len_;
+    release(s.b_);
+    return;
+  }
+
+  rest_.push_back(s);
+}
+}
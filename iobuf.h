@@ -0,0 +1,235 @@
+//
+// Chained, reference counted buffers.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+namespace memcache {
+
+/*!
+ * \brief Chain of slices of reference counted blocks of memory.
+ *
+ * Splitting off the front of a buffer, or appending a buffer to another,
+ * only moves slices around: the bytes stay where they were written, and
+ * the blocks are freed with the last slice of them. A request can then be
+ * read into a connection's receive buffer, split off it and handed to the
+ * CPU executors and the cache without being copied.
+ *
+ * Bytes are written at the tail of the last slice of a buffer, when it
+ * ends at the last byte written to its block. Slices split off the front
+ * end before that, so they are never written to.
+ *
+ * A buffer is used by one thread at a time, blocks can be shared across
+ * threads.
+ */
+class iobuf {
+public:
+  iobuf() {}
+
+  /*!
+   * \brief Buffer of the bytes of a string, taking over its memory.
+   */
+  explicit iobuf(std::string &&s);
+
+  iobuf(iobuf &&b) : head_(b.head_), rest_(std::move(b.rest_)) {
+    b.head_ = slice();
+    b.rest_.clear();
+  }
+
+  iobuf &operator=(iobuf &&b) {
+    if (this != &b) {
+      clear();
+      head_ = b.head_;
+      rest_ = std::move(b.rest_);
+      b.head_ = slice();
+      b.rest_.clear();
+    }
+    return *this;
+  }
+
+  ~iobuf() {
+    clear();
+  }
+
+  /*!
+   * \brief Empty buffer, with room for the given number of bytes.
+   */
+  static iobuf create(size_t capacity);
+
+  /*!
+   * \brief Number of bytes.
+   */
+  size_t size() const {
+    size_t n = head_.len_;
+    for (auto &s : rest_) {
+      n += s.len_;
+    }
+    return n;
+  }
+
+  bool empty() const {
+    return !size();
+  }
+
+  /*!
+   * \brief True if the bytes are in a single slice.
+   */
+  bool contiguous() const {
+    return rest_.empty();
+  }
+
+  /*!
+   * \brief The bytes, expected to be contiguous.
+   */
+  const char *data() const {
+    assert(contiguous());
+    return head_.b_ ? head_.b_->data_ + head_.off_ : nullptr;
+  }
+
+  /*!
+   * \brief Make the bytes contiguous, copying them into a block of their
+   * own if they are not already.
+   * @return The bytes.
+   */
+  const char *coalesce();
+
+  /*!
+   * \brief Room to write at the end of the buffer, without a new block.
+   */
+  size_t tailroom() const {
+    const slice &s = last();
+    if (!s.b_ || s.off_ + s.len_ != s.b_->used_) {
+      return 0;
+    }
+    return s.b_->capacity_ - s.b_->used_;
+  }
+
+  /*!
+   * \brief Where to write at the end of the buffer, tailroom() bytes.
+   */
+  char *tail() {
+    slice &s = last();
+    assert(s.b_);
+    return s.b_->data_ + s.off_ + s.len_;
+  }
+
+  /*!
+   * \brief Add the bytes written at the tail to the buffer.
+   */
+  void commit(size_t n) {
+    assert(n <= tailroom());
+    slice &s = last();
+    s.len_ += n;
+    s.b_->used_ += n;
+  }
+
+  /*!
+   * \brief Reuse the block from the start, if the buffer is empty and the
+   * only one left holding the block.
+   * @return True if the whole block is free to write to again.
+   */
+  bool reset() {
+    if (!contiguous() || head_.len_ || !head_.b_ ||
+        head_.b_->refs_.load(std::memory_order_acquire) != 1) {
+      return false;
+    }
+    head_.off_ = 0;
+    head_.b_->used_ = 0;
+    return true;
+  }
+
+  /*!
+   * \brief Split the first bytes off the buffer.
+   * @param n Number of bytes, at most size().
+   * @return The bytes split off, sharing the blocks of the buffer.
+   */
+  iobuf split(size_t n);
+
+  /*!
+   * \brief Append the slices of another buffer, without copying the bytes.
+   */
+  void append(iobuf &&b);
+
+  /*!
+   * \brief Copy bytes to the end of the buffer, into the tailroom or a new block.
+   */
+  void append(const char *p, size_t n);
+
+  /*!
+   * \brief Copy the bytes of another buffer to the end of the buffer.
+   */
+  void append(const iobuf &b);
+
+  /*!
+   * \brief Fill in the iovecs of the bytes.
+   * @return Number of iovecs filled in, at most max.
+   */
+  int iov(struct iovec *v, int max) const;
+
+  /*!
+   * \brief Drop the bytes, releasing the blocks.
+   */
+  void clear();
+
+private:
+  /*!
+   * \brief Block of memory, freed with the last slice of it.
+   */
+  struct block {
+    std::atomic<uint32_t> refs_{1};
+    char *data_ = nullptr;
+    size_t capacity_ = 0;
+
+    /*!
+     * \brief Bytes written so far, from the start of the block.
+     */
+    size_t used_ = 0;
+
+    std::unique_ptr<char[]> memory_;
+    std::string str_;
+  };
+
+  /*!
+   * \brief Range of a block.
+   */
+  struct slice {
+    block *b_ = nullptr;
+    size_t off_ = 0;
+    size_t len_ = 0;
+  };
+
+  /*!
+   * \brief First slice, kept inline as most buffers have a single one.
+   */
+  slice head_;
+  std::vector<slice> rest_;
+
+  slice &last() {
+    return rest_.empty() ? head_ : rest_.back();
+  }
+
+  const slice &last() const {
+    return rest_.empty() ? head_ : rest_.back();
+  }
+
+  void push(const slice &s);
+
+  static void release(block *b) {
+    if (b && b->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete b;
+    }
+  }
+
+  iobuf(const iobuf &) = delete;
+  iobuf &operator=(const iobuf &) = delete;
+};
+}
@@ -3,6 +3,7 @@
 //
 
 #include <assert.h>
+#include <stdint.h>
 #include <vector>
 #include <unistd.h>
 
@@ -22,5 +23,90 @@ static const size_t DEFAULT_CACHE_CAPACITY = 64 * MB;
 
 static const size_t PACKET_EXTRAS_SIZE = 8;
 
-static const size_t DATA_READ_CHUNK_SIZE = 128;
-}
\ No newline at end of file
+// Receive buffer of a connection. Larger packets are read into a buffer
+// of their own size.
+static const size_t RECV_BUFFER_SIZE = 16 * KB;
+
+// Values from this size on are sent straight from the cache memory, with
+// the item pinned, rather than copied into the response.
+static const size_t ZERO_COPY_MIN_VALUE = 16 * KB;
+
+// Output queued on a connection while its socket is full. Past this size,
+// the connection is not read from until its output is flushed. Most
+// iovecs per writev when flushing, a hit sent from a pre-encoded response
+// taking two (below IOV_MAX).
+static const size_t MAX_QUEUED_OUTPUT = 4 * MB;
+static const size_t MAX_WRITE_IOVECS = 256;
+
+// Responses to the packets of a read are written together. The bytes built
+// for responses up to this size are copied into the previous response, so
+// small responses don't take an iovec each.
+static const size_t MAX_COALESCED_RESPONSE = KB;
+
+// Keys looked up together by a batched get, with their cache misses overlapped.
+static const size_t GET_MANY_PREFETCH = 16;
+
+// Slab allocator. A page fits the largest item.
+static const size_t SLAB_PAGE_SIZE = MB + 4 * KB;
+static const size_t SLAB_MIN_CHUNK_SIZE = 96;
+static const double SLAB_GROWTH_FACTOR = 1.25;
+
+// Smallest capacity slice per cache shard, so each shard has pages to
+// spread over its slab classes.
+static const size_t MIN_SHARD_CAPACITY = 4 * SLAB_PAGE_SIZE;
+
+// Items evicted for a set, when the evicted items are pinned and can't
+// give their chunk back right away.
+static const size_t MAX_EVICTION_TRIES = 5;
+
+// Background reclaim watermarks, in percent of the memory of a slab class.
+static const size_t DEFAULT_LOW_WATERMARK = 5;
+static const size_t DEFAULT_HIGH_WATERMARK = 10;
+
+// Items evicted by the reclaimer per cache lock hold.
+static const size_t RECLAIM_BATCH_SIZE = 32;
+
+// Longest the reclaimer sleeps without being woken, in milliseconds.
+static const size_t RECLAIM_INTERVAL_MS = 100;
+
+// Segmented LRU. Most items in the hot and warm segments, in percent of
+// the chunks of a slab class. The rest are cold.
+static const size_t SLRU_HOT_PERCENT = 20;
+static const size_t SLRU_WARM_PERCENT = 40;
+
+// TinyLFU admission. Window LRU size, in percent of the chunks of a slab
+// class, and cache capacity per frequency sketch counter.
+static const size_t TINYLFU_WINDOW_PERCENT = 1;
+static const size_t TINYLFU_BYTES_PER_COUNTER = 256;
+
+// Item expiration. Larger expiration times are absolute unix times.
+static const uint32_t MAX_RELATIVE_EXPTIME = 60 * 60 * 24 * 30;
+
+// Expired items freed per cache lock hold.
+static const size_t EXPIRE_BATCH_SIZE = 64;
+
+static const size_t CACHE_LINE_SIZE = 64;
+
+// Tasks queued to an executor without taking a lock. More overflow into a
+// locked list.
+static const size_t EXECUTOR_QUEUE_SIZE = 1024;
+
+// Tasks queued on a connection without taking a lock, when the IO
+// executors steal connections from each other.
+static const size_t CONNECTION_QUEUE_SIZE = 64;
+
+// Rebalancing of the connections between the IO executors: interval, and
+// difference of the busy time of the most and least loaded executors, in
+// percent of the interval, from which connections are moved.
+static const size_t REBALANCE_INTERVAL_MS = 500;
+static const size_t REBALANCE_IMBALANCE_PERCENT = 20;
+
+// Epoch-based reclamation. Most threads reading the cache at once, and
+// items retired by a cache shard before trying to free them.
+static const size_t MAX_EPOCH_THREADS = 256;
+static const size_t RETIRE_BATCH_SIZE = 32;
+
+// Most IO and CPU threads together, leaving epoch slots for the main,
+// clock, reclaimer and rebalancer threads.
+static const size_t MAX_WORKER_THREADS = MAX_EPOCH_THREADS - 8;
+}
@@ -4,11 +4,14 @@
 #include <unistd.h>
 #include <signal.h>
 #include <fstream>
+#include <algorithm>
 
 #include "limits.h"
 #include "network.h"
 #include "executor.h"
-#include "cache.h"
+#include "sharded_cache.h"
+#include "reclaimer.h"
+#include "clock.h"
 #include "limits.h"
 #include "util.h"
 
@@ -17,10 +20,27 @@
  */
 memcache::IOPoolExecutor io_pool;
 
+/*!
+ * Global CPU thread pool executor. Only used when the cache is partitioned
+ * across CPU executors.
+ */
+memcache::CPUPoolExecutor cpu_pool;
+
 /*!
  * Global cache.
  */
-std::unique_ptr<memcache::cache> cache;
+std::unique_ptr<memcache::sharded_cache> cache;
+
+/*!
+ * Global background reclaimer. Not used when the cache is partitioned
+ * across CPU executors, which reclaim their own partitions.
+ */
+std::unique_ptr<memcache::reclaimer> reclaim;
+
+/*!
+ * Global clock, used for item expiry. Frees the expired items every tick.
+ */
+memcache::coarse_clock cache_clock;
 
 /*!
  * Check epoll event error.
@@ -31,6 +51,18 @@ static bool is_event_error(const epoll_event& e) {
   return ((e.events & EPOLLERR) || (e.events & EPOLLHUP)) ? true : false;
 }
 
+/*!
+ * Stop watching a connection and have its IO executor close it.
+ * Only done here, once per connection, so no events come up for a
+ * connection after it is deleted.
+ * @param ep
+ * @param conn
+ */
+static void close(memcache::EpollHelper &ep, memcache::connection *conn) {
+  ep.remove_descriptor(conn->fd_);
+  io_pool.add(memcache::task(memcache::task::CLOSE, conn), conn->executor_index_);
+}
+
 /*!
  *
  * @param s
@@ -43,10 +75,11 @@ static bool accept(memcache::socket &s, memcache::EpollHelper &ep,
   memcache::connection_data info;
   while (s.connect(&info)) {
     // Pick an executor.
-    int executor_index = io_pool.pick();
+    int executor_index = io_pool.place();
 
     // Create session and assign executor.
-    memcache::connection* ses = new memcache::connection(info.fd_, *cache, executor_index);
+    memcache::connection* ses = new memcache::connection(info.fd_, *cache, executor_index,
+                                                          cpu_pool.size() ? &cpu_pool : nullptr, &ep);
 
     if (!ep.add_descriptor(info.fd_, ses)) {
       std::cerr << "Count not add descriptor!";
@@ -70,19 +103,22 @@ int default_threads() {
 }
 
 /*!
- * Listen for connections and push the incoming data chunks to mc::server for processing.
+ * Listen for connections and hand the events of the connections to their IO executors.
  * @param s
  * @param maxevents
  * @param threads
  * @param max_connections
+ * @param steal Have the IO executors steal connections from each other.
+ * @param balance Place and rebalance connections by the load of the IO executors.
  */
 static void listen_loop(memcache::socket &s, unsigned int maxevents,
-                        unsigned int threads, unsigned int max_connections) {
+                        unsigned int threads, unsigned int max_connections, bool steal,
+                        bool balance) {
   assert(maxevents);
   assert(threads);
 
   // create server pool
-  io_pool.init(threads);
+  io_pool.init(threads, steal, balance);
 
   // Init epoll and listen.
   memcache::EpollHelper ep(maxevents);
@@ -111,7 +147,7 @@ static void listen_loop(memcache::socket &s, unsigned int maxevents,
             std::cerr << "Error for connection with fd: " << conn->fd_ << std::endl;
 
             // Close connection.
-            io_pool.add(memcache::task(memcache::task::CLOSE, conn), conn->executor_index_);
+            close(ep, conn);
           }
         } else {
           std::cerr << "Epoll event error for socket: " << s.fd() << std::endl;
@@ -132,51 +168,63 @@ static void listen_loop(memcache::socket &s, unsigned int maxevents,
         memcache::connection* conn = static_cast<memcache::connection* >(e.data.ptr);
         assert(conn);
 
-        // Read data in chunks
-        while(true) {
-          memcache::buffer buf;
-          buf.resize(memcache::DATA_READ_CHUNK_SIZE);
-
-          // Read data on the connection fd.
-          ssize_t count = ::read(conn->fd_, &buf[0], buf.size());
-
-          // Read error.
-          if (count == -1) {
-            if (errno != EAGAIN) {
-              std::cerr << "read error: " << conn->fd_ << " err no:" << errno << std::endl;
-              count = 0;
-            } else {
-              break;
-            }
-          }
-
-          assert(count <= buf.size());
-
-          // Successful read. Add to IO executor for processing.
-          if (count > 0) {
-            // Resize buf to have the correct size.
-            buf.erase(buf.begin() + count, buf.end());
+        // Socket writable again, only watched while responses are queued.
+        if (e.events & EPOLLOUT) {
+          io_pool.add(memcache::task(memcache::task::FLUSH, conn), conn->executor_index_);
+        }
 
-            io_pool.add(memcache::task(memcache::task::READ,
-                                        conn, std::move(buf)), conn->executor_index_);
-          } else {
-            // We didn't read anything. Close the connection.
-            assert(!count);
-            io_pool.add(memcache::task(memcache::task::CLOSE, conn), conn->executor_index_);
-            break;
-          }
+        // Not watched while the connection has too much output queued.
+        // The IO executor reads into the connection's receive buffer, until drained.
+        if (e.events & EPOLLIN) {
+          io_pool.add(memcache::task(memcache::task::READ, conn), conn->executor_index_);
         }
       }
     }
   }
 }
 
+/*!
+ * Have each IO executor listen on a socket of its own, with SO_REUSEPORT,
+ * and run the epoll loop of the connections it accepts.
+ * @param o
+ */
+static void listen_threads(const memcache::options &o) {
+  if (!io_pool.listen(o.threads, o.ip, o.port, *cache, cpu_pool.size() ? &cpu_pool : nullptr)) {
+    std::clog << "socket creation failed" << std::endl;
+    return;
+  }
+  std::clog << "sockets created..." << std::endl;
+
+  // The IO executors do all the work.
+  while (true) {
+    ::pause();
+  }
+}
+
 static void usage_help() {
   std::cerr << "memcache usage: " << std::endl
             << "  -i IP address of the listening socket. Defaults to 127.0.0.1" << std::endl
             << "  -p Port. Defaults to 11211" << std::endl
             << "  -t Processing threads (cache lookups). Defaults to number of cores and then to 8." << std::endl
-            << "  -m Max cache memory in MB. Defaults to 64" << std::endl;
+            << "     At most " << memcache::MAX_WORKER_THREADS << " with the CPU threads (-c)." << std::endl
+            << "  -m Max cache memory in MB. Defaults to 64" << std::endl
+            << "  -s Cache shards. Defaults to the number of threads." << std::endl
+            << "  -c CPU executors, each owning a cache partition. Overrides -s. Disabled by default." << std::endl
+            << "  -w Low watermark of free memory, in percent, under which items are evicted in" << std::endl
+            << "     the background. 0 disables background eviction. Defaults to 5" << std::endl
+            << "  -W High watermark of free memory, in percent, at which background eviction stops. Defaults to 10" << std::endl
+            << "  -e Eviction policy: lru, clock or slru (segmented, scan resistant LRU)." << std::endl
+            << "     With clock, gets share the cache lock. Defaults to lru" << std::endl
+            << "  -a Admission policy: none or tinylfu (not with clock). Defaults to none" << std::endl
+            << "  -r Store a pre-encoded GET response with each item, for 28 more bytes per item." << std::endl
+            << "     0 disables it. Defaults to 1" << std::endl
+            << "  -l Each IO thread listens on its own SO_REUSEPORT socket, and accepts, reads, processes" << std::endl
+            << "     and writes back for its own connections, instead of the main thread reading for all." << std::endl
+            << "     Defaults to 0" << std::endl
+            << "  -S Idle IO threads steal busy connections from the others, rather than each thread" << std::endl
+            << "     serving its connections for life. Not with -l. Defaults to 0" << std::endl
+            << "  -B Place new connections on the least loaded IO thread, and move busy connections" << std::endl
+            << "     off IO threads loaded well above the others. Not with -l. Defaults to 0" << std::endl;
 }
 
 void set_logfile() {
@@ -187,24 +235,74 @@ void set_logfile() {
 int main(int argc, char* argv[]) {
   //set_logfile();
 
+  // Writes to connections closed by the peer fail with EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
+
   // Parse args.
   memcache::options o;
   if (!memcache::util::parse(argc, argv, o)) {
     usage_help();
+    return 1;
   }
 
-  // Initialize threads.
+  // Initialize threads, within the epoch slots.
   if (!o.threads) {
-    o.threads = default_threads();
+    o.threads = std::min((size_t) default_threads(), memcache::MAX_WORKER_THREADS - o.cpu_threads);
     assert(o.threads);
   }
 
+  // Initialize shards. Each CPU executor owns a shard.
+  if (o.cpu_threads) {
+    o.shards = o.cpu_threads;
+  } else if (!o.shards) {
+    o.shards = o.threads;
+  }
+
+  if (o.cachemem / o.shards < memcache::MIN_SHARD_CAPACITY) {
+    o.shards = std::max((size_t) 1, o.cachemem / memcache::MIN_SHARD_CAPACITY);
+    if (o.cpu_threads) {
+      o.cpu_threads = o.shards;
+    }
+    std::clog << "Not enough memory for the shards, using " << o.shards << " shards" << std::endl;
+  }
+
   std::clog << "Listening on: " << o.ip << ":" << o.port
             << " threads:" << o.threads << " memory limit:" << o.cachemem / memcache::MB
-            << "MB" << " max connections:" << o.max_connections << std::endl;
+            << "MB" << " shards:" << o.shards << " cpu threads:" << o.cpu_threads
+            << " eviction:" << (o.policy == memcache::eviction_policy::CLOCK ? "clock" :
+                                o.policy == memcache::eviction_policy::SEGMENTED ? "slru" : "lru")
+            << " admission:" << (o.admission == memcache::admission_policy::TINYLFU ? "tinylfu" : "none")
+            << " encoded responses:" << o.encoded_responses
+            << " listener per thread:" << o.reuse_port
+            << " work stealing:" << o.steal
+            << " rebalancing:" << o.balance
+            << " watermarks:" << o.low_watermark << "%-" << o.high_watermark << "%"
+            << " max connections:" << o.max_connections << std::endl;
 
   //allocate cache
-  cache.reset(new memcache::cache(o.cachemem));
+  cache.reset(new memcache::sharded_cache(o.cachemem, o.shards, !o.cpu_threads, o.policy,
+                                          o.admission, o.encoded_responses));
+
+  // Start the CPU executors owning the cache partitions, or the background
+  // reclaimer for the locked shards.
+  if (o.cpu_threads) {
+    cache->set_watermarks(o.low_watermark, o.high_watermark);
+    cpu_pool.init(*cache, io_pool);
+  } else if (o.low_watermark) {
+    reclaim.reset(new memcache::reclaimer(*cache));
+    reclaim->start(o.low_watermark, o.high_watermark);
+  }
+
+  if (o.cpu_threads) {
+    cache_clock.start([](uint32_t) { cpu_pool.expire(); });
+  } else {
+    cache_clock.start([](uint32_t) { cache->expire(); });
+  }
+
+  if (o.reuse_port) {
+    listen_threads(o);
+    return 1;
+  }
 
   // Setup a TCP socket and listen.
   memcache::socket s;
@@ -212,7 +310,7 @@ int main(int argc, char* argv[]) {
     std::clog << "socket created..." << std::endl;
 
     // run it
-    listen_loop(s, memcache::MAX_EPOLL_EVENTS, o.threads, o.max_connections);
+    listen_loop(s, memcache::MAX_EPOLL_EVENTS, o.threads, o.max_connections, o.steal, o.balance);
   } else {
     std::clog << "socket creation failed" << std::endl;
   }
@@ -0,0 +1,324 @@
+//
+// Lock-free multi-producer, single-consumer queue.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "limits.h"
+
+namespace memcache {
+
+/*!
+ * \brief Bounded FIFO queue, pushed to by any thread and popped by one.
+ *
+ * Items go in a ring of cells, each with a sequence number telling whose
+ * turn it is: producers claim a cell by moving the tail forward with a CAS,
+ * and publish the item by bumping the cell's sequence, which the consumer
+ * waits for. Pushing takes no lock, and producers only share the tail cache
+ * line. The consumer drains all the items available at once.
+ *
+ * Pushes never block: when the ring is full, items overflow into a list
+ * under a mutex, and go there until the consumer drains the list, so the
+ * items of a producer stay in order. Two executors pushing to each other's
+ * full queues can't deadlock.
+ *
+ * The consumer parks when the queue is empty, either sleeping on a futex
+ * in pop, or with park, waiting for the producer which sees it parked to
+ * wake it up some other way (e.g. with an eventfd). Producers only make a
+ * system call to wake up a parked consumer.
+ *
+ * @tparam T Item type, movable.
+ */
+template<typename T>
+class mpsc_queue {
+public:
+  typedef std::deque<T> queue;
+
+  /*!
+   * \brief Create the queue.
+   * @param capacity Items in the ring, rounded up to a power of 2.
+   */
+  explicit mpsc_queue(size_t capacity = EXECUTOR_QUEUE_SIZE) {
+    size_t n = 2;
+    while (n < capacity) {
+      n *= 2;
+    }
+
+    mask_ = n - 1;
+    cells_.reset(new cell[n]);
+    for (size_t i = 0; i < n; ++i) {
+      cells_[i].seq_.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~mpsc_queue() {
+    queue q;
+    pop_all(q);
+  }
+
+  /*!
+   * \brief Push an item. Never blocks. Wakes up the consumer if it sleeps in pop.
+   * @param v
+   * @return True if the consumer parked with park, and has to be woken up.
+   */
+  bool push(T v) {
+    if (!(overflowed_.load(std::memory_order_acquire) && push_overflow(v, false)) &&
+        !push_ring(v)) {
+      push_overflow(v, true);
+    }
+
+    // Ordered with the consumer parking, after checking the queue was empty.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked_.load(std::memory_order_relaxed) == RUNNING) {
+      return false;
+    }
+
+    uint32_t state = parked_.exchange(RUNNING, std::memory_order_relaxed);
+    if (state == SLEEPING) {
+      futex(FUTEX_WAKE_PRIVATE, 1);
+    }
+    return state == PARKED;
+  }
+
+  /*!
+   * \brief Pop an item. Blocks if empty. Consumer only.
+   */
+  T pop() {
+    while (batch_.empty()) {
+      wait();
+      drain(batch_);
+    }
+
+    T v(std::move(batch_.front()));
+    batch_.pop_front();
+    return v;
+  }
+
+  /*!
+   * \brief Pop all the items available, if any. Doesn't block. Consumer only.
+   * @param out Popped items, appended in order.
+   */
+  void pop_all(queue &out) {
+    while (!batch_.empty()) {
+      out.push_back(std::move(batch_.front()));
+      batch_.pop_front();
+    }
+
+    drain(out);
+  }
+
+  /*!
+   * \brief Park the consumer, to be woken up by the producer of the next
+   * item, see push. Consumer only.
+   * @return False if the queue is not empty, in which case the consumer
+   * is not parked.
+   */
+  bool park() {
+    parked_.store(PARKED, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (empty()) {
+      return true;
+    }
+
+    parked_.store(RUNNING, std::memory_order_relaxed);
+    return false;
+  }
+
+  /*!
+   * \brief Consumer only.
+   */
+  bool empty() const {
+    return batch_.empty() && !published(head_) && !overflowed_.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+
+private:
+  enum : uint32_t {
+    RUNNING = 0,
+    /*!
+     * Parked with park, woken up by the caller of push.
+     */
+    PARKED,
+    /*!
+     * Sleeping on the futex, in pop.
+     */
+    SLEEPING,
+  };
+
+  struct cell {
+    /*!
+     * \brief Position the cell is free for, or one past the position of
+     * the item it holds.
+     */
+    std::atomic<size_t> seq_;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type item_;
+
+    T *get() {
+      return reinterpret_cast<T *>(&item_);
+    }
+  };
+
+  std::unique_ptr<cell[]> cells_;
+  size_t mask_ = 0;
+
+  char pad0_[CACHE_LINE_SIZE];
+
+  /*!
+   * \brief Position of the next cell to claim. Producers only.
+   */
+  std::atomic<size_t> tail_{0};
+
+  char pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+
+  /*!
+   * \brief Position of the next item to pop. Consumer only.
+   */
+  size_t head_ = 0;
+
+  /*!
+   * \brief Items popped but not handed out yet by pop. Consumer only.
+   */
+  queue batch_;
+
+  /*!
+   * \brief Parked at first, so the first item wakes up an epoll loop.
+   */
+  std::atomic<uint32_t> parked_{PARKED};
+
+  char pad2_[CACHE_LINE_SIZE];
+
+  /*!
+   * \brief Items pushed while the ring was full, and after them until the
+   * consumer drains them.
+   */
+  std::mutex overflow_mutex_;
+  queue overflow_;
+  std::atomic<bool> overflowed_{false};
+
+  bool push_ring(T &v) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    cell *c;
+    while (true) {
+      c = &cells_[pos & mask_];
+      intptr_t diff = (intptr_t) c->seq_.load(std::memory_order_acquire) - (intptr_t) pos;
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // The consumer hasn't popped the item from the previous turn.
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+
+    new(c->get()) T(std::move(v));
+    c->seq_.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /*!
+   * \brief Push to the overflow list.
+   * @param full True if the ring is full, false to only push if items
+   * already overflowed.
+   * @return False if not pushed.
+   */
+  bool push_overflow(T &v, bool full) {
+    std::lock_guard<std::mutex> l(overflow_mutex_);
+    if (!full && !overflowed_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    overflow_.push_back(std::move(v));
+    overflowed_.store(true, std::memory_order_release);
+    return true;
+  }
+
+  /*!
+   * \brief Pop the items available.
+   */
+  void drain(queue &out) {
+    while (published(head_)) {
+      out.push_back(take());
+    }
+
+    if (!overflowed_.load(std::memory_order_acquire)) {
+      return;
+    }
+
+    // The items pushed to the ring before the overflowed ones come first.
+    // Cells claimed but not published yet are only being written to.
+    std::lock_guard<std::mutex> l(overflow_mutex_);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    while (head_ != tail) {
+      while (!published(head_)) {
+        std::this_thread::yield();
+      }
+      out.push_back(take());
+    }
+
+    while (!overflow_.empty()) {
+      out.push_back(std::move(overflow_.front()));
+      overflow_.pop_front();
+    }
+    overflowed_.store(false, std::memory_order_release);
+  }
+
+  bool published(size_t pos) const {
+    return cells_[pos & mask_].seq_.load(std::memory_order_acquire) == pos + 1;
+  }
+
+  T take() {
+    cell &c = cells_[head_ & mask_];
+    T v(std::move(*c.get()));
+    c.get()->~T();
+
+    // Free for the next turn around the ring.
+    c.seq_.store(head_ + mask_ + 1, std::memory_order_release);
+    ++head_;
+    return v;
+  }
+
+  /*!
+   * \brief Sleep until there are items.
+   */
+  void wait() {
+    while (empty()) {
+      parked_.store(SLEEPING, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!empty()) {
+        break;
+      }
+
+      // Returns right away if a producer woke us up already.
+      futex(FUTEX_WAIT_PRIVATE, SLEEPING);
+    }
+
+    parked_.store(RUNNING, std::memory_order_relaxed);
+  }
+
+  long futex(int op, uint32_t val) {
+    return ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&parked_), op, val, nullptr, nullptr, 0);
+  }
+
+  mpsc_queue(const mpsc_queue &) = delete;
+  mpsc_queue &operator=(const mpsc_queue &) = delete;
+};
+}
@@ -16,13 +16,14 @@ bool EpollHelper::listen_socket(memcache::socket& s) {
     return false;
   }
 
-  s.listen();
+  return s.listen();
 }
 
 bool EpollHelper::add_descriptor(int fd, void* user) {
   struct epoll_event event;
   event.data.ptr = user;
-  event.events = EPOLLOUT | EPOLLIN | EPOLLET;
+  // Writability is only watched while a connection has output queued.
+  event.events = EPOLLIN | EPOLLET;
 
   // Add given fd to the watched set.
   int err = epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &event);
@@ -35,6 +36,37 @@ bool EpollHelper::add_descriptor(int fd, void* user) {
   return true;
 }
 
+bool EpollHelper::modify_descriptor(int fd, void* user, uint32_t events) {
+  struct epoll_event event;
+  event.data.ptr = user;
+  event.events = events | EPOLLET;
+
+  int err = epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &event);
+
+  // Already removed, for the connection closing.
+  if (err == -1 && errno == ENOENT) {
+    return false;
+  }
+
+  if (err == -1) {
+    std::cerr << "Error modifying epoll events, fd: " << fd << " errno: " << errno << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool EpollHelper::remove_descriptor(int fd) {
+  int err = epoll_ctl(fd_, EPOLL_CTL_DEL, fd, nullptr);
+
+  if (err == -1) {
+    std::cerr << "Error removing from epoll, fd: " << fd << " errno: " << errno << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
 int EpollHelper::wait() {
   int n = ::epoll_wait(fd_, &events_.at(0), events_.size(), -1);
   if (n == -1) {
@@ -102,9 +102,11 @@ public:
    * brief Bind the socket to the given ip and port.
    * @param ip
    * @param port
+   * @param reuse_port Let other sockets bind to the same port, with
+   * SO_REUSEPORT, and have the kernel spread the connections over them.
    * @return True if bind successful. False otherwise.
    */
-  bool bind(const std::string& ip, int port) {
+  bool bind(const std::string& ip, int port, bool reuse_port = false) {
     struct linger lng = {0, 0};
     int flags = 1;
 
@@ -139,6 +141,16 @@ public:
         std::cerr << "setsockopt error" << std::endl;
       }
 
+      // A listening socket per thread.
+      if (reuse_port) {
+        err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *) &flags, sizeof(flags));
+        if (err != 0) {
+          std::cerr << "setsockopt error" << std::endl;
+          ::close(fd);
+          continue;
+        }
+      }
+
       // Bind.
       err = ::bind(fd, info->ai_addr, info->ai_addrlen);
 
@@ -223,6 +235,7 @@ private:
       std::cerr << "fcntl error, SETFL" << std::endl;
       return false;
     }
+    return true;
   }
 };
 
@@ -267,6 +280,24 @@ public:
    */
   bool add_descriptor(int fd, void* user);
 
+  /*!
+   * brief Change the events watched for a descriptor added with add_descriptor.
+   * Events ready at the time are reported again, as with edge triggering
+   * only changes of readiness are.
+   * @param fd
+   * @param user
+   * @param events Events, EPOLLIN and/or EPOLLOUT.
+   * @return True if successful without errors.
+   */
+  bool modify_descriptor(int fd, void* user, uint32_t events);
+
+  /*!
+   * brief Stop watching the given descriptor.
+   * @param fd
+   * @return True if successful without errors.
+   */
+  bool remove_descriptor(int fd);
+
   /*!
    * \brief Wait for events on the watched sockets.
    * @return Number of file descriptors ready for I/O.
@@ -0,0 +1,57 @@
+#include <chrono>
+
+#include "reclaimer.h"
+
+namespace memcache {
+
+reclaimer::~reclaimer() {
+  {
+    std::unique_lock<std::mutex> lock(m_);
+    stop_ = true;
+  }
+  con_.notify_one();
+
+  if (processor_.get()) {
+    processor_->join();
+    c_.set_watermarks(0, 0);
+  }
+}
+
+void reclaimer::start(size_t low, size_t high) {
+  assert(!processor_);
+  c_.set_watermarks(low, high, std::bind(&reclaimer::wake, this));
+  processor_.reset(new std::thread(std::bind(&reclaimer::process, this)));
+}
+
+void reclaimer::wake() {
+  {
+    std::unique_lock<std::mutex> lock(m_);
+    woken_ = true;
+  }
+  con_.notify_one();
+}
+
+void reclaimer::process() {
+  while (true) {
+    // A batch per shard at a time, so no shard waits on the others.
+    bool busy = false;
+    for (size_t i = 0; i < c_.shards(); ++i) {
+      cache &s = c_.shard_at(i);
+      if (s.reclaim_wanted() && s.reclaim(RECLAIM_BATCH_SIZE)) {
+        busy = true;
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(m_);
+    if (stop_) {
+      break;
+    }
+
+    if (!busy) {
+      con_.wait_for(lock, std::chrono::milliseconds(RECLAIM_INTERVAL_MS),
+                    [this] { return woken_ || stop_; });
+    }
+    woken_ = false;
+  }
+}
+}
@@ -0,0 +1,60 @@
+//
+// Background reclaimer.
+//
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include "sharded_cache.h"
+
+namespace memcache {
+
+/*!
+ * \brief Background reclaimer thread.
+ *
+ * Keeps the free memory of the cache shards between the low and high
+ * watermarks (see cache::set_watermarks), evicting in small batches so
+ * the shard locks are only held briefly. Woken by the shards when they
+ * drop under the low watermark.
+ *
+ * Only used with locked shards. Shards owned by a CPU executor are
+ * reclaimed by the executor when it is idle.
+ */
+class reclaimer {
+public:
+  explicit reclaimer(sharded_cache &c) : c_(c) {}
+  ~reclaimer();
+
+  /*!
+   * \brief Set the shard watermarks and start the reclaimer thread.
+   * @param low Low watermark, in percent.
+   * @param high High watermark, in percent.
+   */
+  void start(size_t low, size_t high);
+
+  /*!
+   * \brief Wake the reclaimer thread.
+   */
+  void wake();
+
+private:
+  sharded_cache &c_;
+  std::mutex m_;
+  std::condition_variable con_;
+  bool woken_ = false;
+  bool stop_ = false;
+  std::unique_ptr<std::thread> processor_;
+
+  /*!
+   * \brief Reclaimer thread loop.
+   */
+  void process();
+
+  reclaimer(const reclaimer &) = delete;
+  reclaimer &operator=(const reclaimer &) = delete;
+};
+}
@@ -0,0 +1,151 @@
+//
+// Response.
+//
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "util.h"
+
+namespace memcache {
+
+/*!
+ * \brief Response to a request, written with writev.
+ * Holds an optional header, then the bytes built for the response, followed
+ * by an optional range of a pinned cache item, which is sent straight from
+ * the cache memory. Keeps track of the bytes written so far, so partial
+ * writes can be resumed.
+ */
+struct response {
+  /*!
+   * \brief Most iovecs filled in by iov.
+   */
+  static const int MAX_IOVECS = 3;
+
+  response() {}
+
+  explicit response(buffer b) : buf_(std::move(b)) {}
+
+  response(response &&r)
+      : hdr_(r.hdr_), hdr_len_(r.hdr_len_), buf_(std::move(r.buf_)), item_(std::move(r.item_)),
+        value_(r.value_), value_len_(r.value_len_), written_(r.written_), quiet_(r.quiet_) {
+    r.hdr_len_ = 0;
+    r.value_ = nullptr;
+    r.value_len_ = 0;
+    r.written_ = 0;
+  }
+
+  response &operator=(response &&r) {
+    if (this != &r) {
+      hdr_ = r.hdr_;
+      hdr_len_ = r.hdr_len_;
+      buf_ = std::move(r.buf_);
+      item_ = std::move(r.item_);
+      value_ = r.value_;
+      value_len_ = r.value_len_;
+      written_ = r.written_;
+      quiet_ = r.quiet_;
+      r.hdr_len_ = 0;
+      r.value_ = nullptr;
+      r.value_len_ = 0;
+      r.written_ = 0;
+    }
+    return *this;
+  }
+
+  /*!
+   * \brief Header sent first, held inline rather than in buf_ so that a
+   * pre-encoded response only needs its header patched, with the rest sent
+   * from the item. hdr_len_ is 0 without it.
+   */
+  protocol_binary_response_header hdr_;
+  size_t hdr_len_ = 0;
+
+  /*!
+   * \brief Bytes built for the response, sent after the header.
+   */
+  buffer buf_;
+
+  /*!
+   * \brief Item the value is sent from, kept pinned until the response is done.
+   */
+  cache::pinned_item item_;
+  const char *value_ = nullptr;
+  size_t value_len_ = 0;
+
+  /*!
+   * \brief Bytes written so far.
+   */
+  size_t written_ = 0;
+
+  /*!
+   * \brief Response to a quiet command, held back until the response to a
+   * command which isn't quiet. Empty if suppressed.
+   */
+  bool quiet_ = false;
+
+  /*!
+   * \brief Send a header before the built bytes.
+   */
+  void set_header(const protocol_binary_response_header &h) {
+    hdr_ = h;
+    hdr_len_ = sizeof(h);
+  }
+
+  /*!
+   * \brief Send a range of the item after the built bytes.
+   */
+  void set_value(cache::pinned_item it, const char *value, size_t len) {
+    item_ = std::move(it);
+    value_ = value;
+    value_len_ = len;
+  }
+
+  size_t size() const {
+    return hdr_len_ + buf_.size() + value_len_;
+  }
+
+  bool done() const {
+    return written_ == size();
+  }
+
+  /*!
+   * \brief Fill in the iovecs of the bytes left to write.
+   * @param v At least MAX_IOVECS iovecs.
+   * @return Number of iovecs filled in.
+   */
+  int iov(struct iovec *v) const {
+    int n = 0;
+    size_t off = written_;
+    n += range(v + n, (const char *) &hdr_, hdr_len_, off);
+    n += range(v + n, (const char *) buf_.data(), buf_.size(), off);
+    n += range(v + n, value_, value_len_, off);
+    return n;
+  }
+
+private:
+  /*!
+   * \brief Fill in the iovec of what is left of a part.
+   * @param off Bytes written, from the start of the part, updated to the
+   * start of the next.
+   * @return 1 if anything is left.
+   */
+  static int range(struct iovec *v, const char *p, size_t len, size_t &off) {
+    if (off >= len) {
+      off -= len;
+      return 0;
+    }
+
+    v->iov_base = (void *) (p + off);
+    v->iov_len = len - off;
+    off = 0;
+    return 1;
+  }
+
+public:
+  response(const response &) = delete;
+  response &operator=(const response &) = delete;
+};
+}
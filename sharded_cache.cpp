@@ -0,0 +1,142 @@
+#include "sharded_cache.h"
+
+namespace memcache {
+
+sharded_cache::sharded_cache(size_t capacity, size_t shards, bool locked,
+                             eviction_policy policy, admission_policy admission, bool encoded) {
+  if (capacity == 0) {
+    capacity = DEFAULT_CACHE_CAPACITY;
+  }
+
+  assert(shards);
+
+  for (size_t i = 0; i < shards; ++i) {
+    shards_.push_back(std::unique_ptr<cache>(new cache(capacity / shards, locked, policy, admission, encoded)));
+  }
+}
+
+void sharded_cache::set_many(value *v, size_t n, bool *out) {
+  std::vector<uint32_t> hashes(n);
+  std::vector<uint32_t> order(n);
+  for (size_t i = 0; i < n; ++i) {
+    hashes[i] = cache::hash(v[i].get_key());
+    order[i] = (uint32_t) i;
+  }
+
+  // Stable, so sets of the same key are done in order.
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return shard_index(hashes[a]) < shard_index(hashes[b]);
+  });
+
+  for (size_t i = 0; i < n;) {
+    size_t s = shard_index(hashes[order[i]]);
+    size_t j = i + 1;
+    while (j < n && shard_index(hashes[order[j]]) == s) {
+      ++j;
+    }
+
+    shards_[s]->set_many(v, hashes.data(), order.data() + i, j - i, out);
+    i = j;
+  }
+}
+
+size_t sharded_cache::count() const {
+  size_t count = 0;
+  for (auto &s : shards_) {
+    count += s->count();
+  }
+
+  return count;
+}
+
+size_t sharded_cache::size() const {
+  size_t size = 0;
+  for (auto &s : shards_) {
+    size += s->size();
+  }
+
+  return size;
+}
+
+void sharded_cache::clear() {
+  for (auto &s : shards_) {
+    s->clear();
+  }
+}
+
+void sharded_cache::rehash(size_t capacity) {
+  assert(capacity >= shards_.size());
+
+  for (auto &s : shards_) {
+    s->rehash(capacity / shards_.size());
+  }
+}
+
+void sharded_cache::set_watermarks(size_t low, size_t high, std::function<void()> notify) {
+  for (auto &s : shards_) {
+    s->set_watermarks(low, high, notify);
+  }
+}
+
+void sharded_cache::expire() {
+  for (auto &s : shards_) {
+    while (s->expire(EXPIRE_BATCH_SIZE) == EXPIRE_BATCH_SIZE) {
+    }
+  }
+}
+
+void sharded_cache::get_stats(stats_list& out) const {
+  size_t count = 0, used = 0, size = 0, capacity = 0;
+  size_t segments[cache::SEGMENTS] = {};
+  uint64_t inline_reclaims = 0, background_reclaims = 0, expired = 0;
+  for (auto &s : shards_) {
+    cache::cache_usage u = s->usage();
+    count += u.count_;
+    used += u.used_;
+    size += u.size_;
+    for (int seg = 0; seg < cache::SEGMENTS; ++seg) {
+      segments[seg] += u.segments_[seg];
+    }
+
+    expired += s->stats().expired_.get();
+    capacity += s->capacity();
+    inline_reclaims += s->stats().inline_reclaims_.get();
+    background_reclaims += s->stats().background_reclaims_.get();
+  }
+
+  out.emplace_back("curr_items", std::to_string(count));
+  out.emplace_back("bytes", std::to_string(used));
+  out.emplace_back("memory", std::to_string(size));
+  out.emplace_back("limit_maxbytes", std::to_string(capacity));
+  out.emplace_back("evictions", std::to_string(inline_reclaims + background_reclaims));
+  out.emplace_back("inline_reclaims", std::to_string(inline_reclaims));
+  out.emplace_back("background_reclaims", std::to_string(background_reclaims));
+  out.emplace_back("expired", std::to_string(expired));
+
+  if (shards_[0]->policy() == eviction_policy::SEGMENTED) {
+    uint64_t promotions = 0, demotions = 0;
+    for (auto &s : shards_) {
+      promotions += s->stats().promotions_.get();
+      demotions += s->stats().demotions_.get();
+    }
+
+    out.emplace_back("hot_items", std::to_string(segments[cache::HOT]));
+    out.emplace_back("warm_items", std::to_string(segments[cache::WARM]));
+    out.emplace_back("cold_items", std::to_string(segments[cache::COLD]));
+    out.emplace_back("promotions", std::to_string(promotions));
+    out.emplace_back("demotions", std::to_string(demotions));
+  }
+
+  if (shards_[0]->admission() == admission_policy::TINYLFU) {
+    uint64_t admitted = 0, rejected = 0;
+    for (auto &s : shards_) {
+      admitted += s->stats().admitted_.get();
+      rejected += s->stats().rejected_.get();
+    }
+
+    out.emplace_back("window_items", std::to_string(segments[cache::WINDOW]));
+    out.emplace_back("admitted", std::to_string(admitted));
+    out.emplace_back("rejected", std::to_string(rejected));
+  }
+}
+}
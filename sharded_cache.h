@@ -0,0 +1,186 @@
+//
+// Sharded cache.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+#include <memory>
+
+#include "cache.h"
+#include "stats.h"
+
+namespace memcache {
+/*!
+ * \brief N-way sharded cache.
+ *
+ * Each shard is an independent cache with its own lookup index, slab
+ * allocator, LRU lists, size accounting and lock, and owns an equal slice
+ * of the total capacity.
+ * The shard for a key is picked from the key hash (cache::hasher), so
+ * operations on different shards never contend on the same lock.
+ */
+struct sharded_cache {
+  typedef cache::key key;
+  typedef cache::value value;
+  typedef cache::item item;
+  typedef cache::item_ptr item_ptr;
+
+  /*!
+   * \brief Create the cache.
+   * @param capacity Total capacity, split evenly across the shards.
+   * @param shards Number of shards.
+   * @param locked False if each shard is only ever accessed by a single
+   * owning thread (see CPUPoolExecutor), in which case shard locks are skipped.
+   * @param policy Eviction policy of the shards.
+   * @param admission Admission policy of the shards.
+   * @param encoded Store pre-encoded GET responses with the items.
+   */
+  explicit sharded_cache(size_t capacity = 0, size_t shards = 1, bool locked = true,
+                         eviction_policy policy = eviction_policy::LRU,
+                         admission_policy admission = admission_policy::NONE,
+                         bool encoded = true);
+
+  ~sharded_cache() {}
+
+  item_ptr get(const key& k) {
+    uint32_t h = cache::hash(k);
+    return shard(h).get(k, h);
+  }
+
+  bool set(value v) {
+    uint32_t h = cache::hash(v.get_key());
+    return shard(h).set(std::move(v), h);
+  }
+
+  bool cas(value v, uint64_t cas) {
+    uint32_t h = cache::hash(v.get_key());
+    return shard(h).cas(std::move(v), cas, h);
+  }
+
+  bool remove(const value& v, uint64_t cas) {
+    uint32_t h = cache::hash(v.get_key());
+    return shard(h).remove(v, cas, h);
+  }
+
+  /*!
+   * \brief Get a batch of keys, grouped by shard: each shard is locked once
+   * for its keys, see cache::get_many.
+   * @param keys Keys.
+   * @param n Number of keys.
+   * @param fn Called as fn(i, item) for each key, in shard order, with the
+   * item empty on a miss. Items are released before the next shard is
+   * locked, as holding on to them could keep a reclaim of their shard
+   * waiting on us, so fn copies or pins what it needs.
+   */
+  template<typename F>
+  void get_many(const key* keys, size_t n, F fn) {
+    std::vector<uint32_t> hashes(n);
+    std::vector<uint32_t> order(n);
+    std::vector<item_ptr> items(n);
+    for (size_t i = 0; i < n; ++i) {
+      hashes[i] = cache::hash(keys[i]);
+      order[i] = (uint32_t) i;
+    }
+
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return shard_index(hashes[a]) < shard_index(hashes[b]);
+    });
+
+    for (size_t i = 0; i < n;) {
+      size_t s = shard_index(hashes[order[i]]);
+      size_t j = i + 1;
+      while (j < n && shard_index(hashes[order[j]]) == s) {
+        ++j;
+      }
+
+      shards_[s]->get_many(keys, hashes.data(), order.data() + i, j - i, items.data());
+      for (; i < j; ++i) {
+        fn(order[i], std::move(items[order[i]]));
+      }
+    }
+  }
+
+  /*!
+   * \brief Set a batch, grouped by shard: each shard is locked, and makes
+   * room for its sets, once, see cache::set_many.
+   * @param v Set requests, with the cas to check, if any, in their header.
+   * @param n Number of requests.
+   * @param out Whether each set was done.
+   */
+  void set_many(value* v, size_t n, bool* out);
+
+  /*!
+   * \brief Reserve the item of a set in the shard of its key, see cache::reserve.
+   * @param h Set request header, in host byte order.
+   * @param body The extras and key of the request.
+   */
+  cache::reserved_item reserve(const protocol_binary_request_header& h, const char* body) {
+    uint32_t hash = cache::hash(key(body + h.request.extlen, h.request.keylen));
+    return shard(hash).reserve(h, body, hash);
+  }
+
+  /*!
+   * \brief Total number of items across all shards.
+   */
+  size_t count() const;
+
+  void clear();
+
+  /*!
+   * \brief Memory used across all shards, in bytes.
+   */
+  size_t size() const;
+
+  /*!
+   * \brief Reset capacity, split evenly across the shards. Used for testing.
+   * @param capacity
+   */
+  void rehash(size_t capacity);
+
+  /*!
+   * \brief Enable background reclaim on all shards, see cache::set_watermarks.
+   */
+  void set_watermarks(size_t low, size_t high, std::function<void()> notify = nullptr);
+
+  /*!
+   * \brief Free the expired items of all shards, a batch at a time, see cache::expire.
+   */
+  void expire();
+
+  /*!
+   * \brief Append the cache stats, summed across the shards.
+   */
+  void get_stats(stats_list& out) const;
+
+  size_t shards() const {
+    return shards_.size();
+  }
+
+  /*!
+   * \brief Index of the shard owning the given key hash.
+   * Uses the high bits of the hash (multiply-shift) so that the shard
+   * choice is independent of the bucket choice inside the shard.
+   * @param hash Key hash, as computed by cache::hasher.
+   */
+  size_t shard_index(uint32_t hash) const {
+    return (size_t) (((uint64_t) hash * shards_.size()) >> 32);
+  }
+
+  cache& shard(uint32_t hash) {
+    return *shards_[shard_index(hash)];
+  }
+
+  cache& shard_at(size_t index) {
+    return *shards_[index];
+  }
+
+private:
+  std::vector<std::unique_ptr<cache>> shards_;
+
+  sharded_cache(const sharded_cache&) = delete;
+  sharded_cache& operator=(const sharded_cache&) = delete;
+};
+}
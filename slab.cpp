@@ -0,0 +1,178 @@
+#include <string.h>
+#include <algorithm>
+
+#include "slab.h"
+
+namespace memcache {
+
+slab_allocator::slab_allocator(size_t page_size, size_t min_chunk, double factor)
+    : page_size_(page_size) {
+  assert(min_chunk >= sizeof(free_chunk));
+  assert(factor > 1.0);
+
+  // Chunk sizes are 8 byte aligned, and the largest class takes a whole page.
+  size_t size = (min_chunk + 7) & ~(size_t) 7;
+  while (size <= page_size_ / 2) {
+    size_class_info c;
+    c.size_ = size;
+    classes_.push_back(std::move(c));
+
+    size_t next = (size_t) (size * factor);
+    size = std::max(size + 8, (next + 7) & ~(size_t) 7);
+  }
+
+  size_class_info c;
+  c.size_ = page_size_;
+  classes_.push_back(std::move(c));
+}
+
+int slab_allocator::size_class(size_t size) const {
+  if (size > page_size_) {
+    return -1;
+  }
+
+  auto it = std::lower_bound(classes_.begin(), classes_.end(), size,
+                             [](const size_class_info &c, size_t s) { return c.size_ < s; });
+  assert(it != classes_.end());
+  return (int) (it - classes_.begin());
+}
+
+void slab_allocator::push_free(size_class_info &c, free_chunk *f) {
+  f->prev_ = nullptr;
+  f->next_ = c.free_;
+  if (c.free_) {
+    c.free_->prev_ = f;
+  }
+  c.free_ = f;
+  ++c.free_count_;
+}
+
+void slab_allocator::unlink_free(size_class_info &c, free_chunk *f) {
+  if (f->prev_) {
+    f->prev_->next_ = f->next_;
+  } else {
+    assert(c.free_ == f);
+    c.free_ = f->next_;
+  }
+
+  if (f->next_) {
+    f->next_->prev_ = f->prev_;
+  }
+
+  assert(c.free_count_);
+  --c.free_count_;
+}
+
+void *slab_allocator::alloc(int cls) {
+  size_class_info &c = classes_[cls];
+  free_chunk *f = c.free_;
+  if (!f) {
+    return nullptr;
+  }
+
+  unlink_free(c, f);
+  return f;
+}
+
+void slab_allocator::free(void *chunk, int cls) {
+  push_free(classes_[cls], static_cast<free_chunk *>(chunk));
+}
+
+bool slab_allocator::add_page(int cls) {
+  size_t p = 0;
+  if (!free_pages_.empty()) {
+    p = free_pages_.back();
+    free_pages_.pop_back();
+  } else {
+    if (allocated_ >= max_pages_) {
+      return false;
+    }
+
+    // Reuse the slot of a page whose memory was given back.
+    auto it = std::find_if(pages_.begin(), pages_.end(),
+                           [](const page &pg) { return !pg.memory_; });
+    p = it - pages_.begin();
+    if (it == pages_.end()) {
+      pages_.emplace_back();
+    }
+
+    pages_[p].memory_.reset(new char[page_size_]);
+    ++allocated_;
+  }
+
+  page &pg = pages_[p];
+  assert(pg.class_ == -1);
+  memset(pg.memory_.get(), 0, page_size_);
+  pg.class_ = cls;
+
+  size_class_info &c = classes_[cls];
+  c.pages_.push_back(p);
+
+  // Carve the page into chunks, in address order.
+  size_t n = page_size_ / c.size_;
+  for (size_t i = n; i > 0; --i) {
+    push_free(c, reinterpret_cast<free_chunk *>(pg.memory_.get() + (i - 1) * c.size_));
+  }
+
+  return true;
+}
+
+void slab_allocator::release_page(size_t p, bool release_memory) {
+  page &pg = pages_[p];
+  assert(pg.class_ != -1);
+
+  size_class_info &c = classes_[pg.class_];
+  size_t n = page_size_ / c.size_;
+  for (size_t i = 0; i < n; ++i) {
+    unlink_free(c, reinterpret_cast<free_chunk *>(pg.memory_.get() + i * c.size_));
+  }
+
+  c.pages_.erase(std::find(c.pages_.begin(), c.pages_.end(), p));
+  pg.class_ = -1;
+
+  if (release_memory) {
+    pg.memory_.reset();
+    --allocated_;
+  } else {
+    free_pages_.push_back(p);
+  }
+}
+
+bool slab_allocator::release_free_page() {
+  if (free_pages_.empty()) {
+    return false;
+  }
+
+  size_t p = free_pages_.back();
+  free_pages_.pop_back();
+
+  pages_[p].memory_.reset();
+  --allocated_;
+  return true;
+}
+
+int slab_allocator::victim_class(int exclude) const {
+  int victim = -1;
+  size_t most = 0;
+  for (size_t i = 0; i < classes_.size(); ++i) {
+    if ((int) i != exclude && classes_[i].pages_.size() > most) {
+      most = classes_[i].pages_.size();
+      victim = (int) i;
+    }
+  }
+
+  return victim;
+}
+
+long slab_allocator::page_of(const void *chunk, int cls) const {
+  const char *p = static_cast<const char *>(chunk);
+  for (auto i : classes_[cls].pages_) {
+    const char *mem = pages_[i].memory_.get();
+    if (p >= mem && p < mem + page_size_) {
+      return (long) i;
+    }
+  }
+
+  return -1;
+}
+}
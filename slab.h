@@ -0,0 +1,208 @@
+//
+// Slab allocator.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+
+#include "limits.h"
+#include "stats.h"
+
+namespace memcache {
+
+/*!
+ * \brief Slab allocator for cache items.
+ *
+ * Memory is handed out in fixed size pages, up to a maximum number of pages.
+ * Each page is assigned to a size class and carved into equal chunks, which
+ * are allocated from and freed to a per-class free list. Chunk sizes grow
+ * geometrically from the smallest class, and the largest class takes up a
+ * whole page.
+ *
+ * Pages can be moved between classes (see release_page), once all of their
+ * chunks have been freed. The allocator is not thread-safe and is expected
+ * to be protected by the owner's lock.
+ *
+ * Page memory is zeroed when a page is (re)assigned to a class, and the
+ * allocator only ever writes the first two pointers of a free chunk
+ * (the free list links), so owners can keep an "in use" marker after those.
+ */
+class slab_allocator {
+public:
+  /*!
+   * \brief Header written in free chunks.
+   */
+  struct free_chunk {
+    free_chunk *prev_;
+    free_chunk *next_;
+  };
+
+  explicit slab_allocator(size_t page_size = SLAB_PAGE_SIZE,
+                          size_t min_chunk = SLAB_MIN_CHUNK_SIZE,
+                          double factor = SLAB_GROWTH_FACTOR);
+  ~slab_allocator() {}
+
+  /*!
+   * \brief Smallest class with chunks large enough for the given size.
+   * @return Class, or -1 if larger than a page.
+   */
+  int size_class(size_t size) const;
+
+  size_t classes() const {
+    return classes_.size();
+  }
+
+  size_t chunk_size(int cls) const {
+    return classes_[cls].size_;
+  }
+
+  size_t page_size() const {
+    return page_size_;
+  }
+
+  /*!
+   * \brief Allocate a chunk from the free list of the class.
+   * @return Chunk, or nullptr if the class has no free chunks.
+   */
+  void *alloc(int cls);
+
+  /*!
+   * \brief Return a chunk to the free list of its class.
+   */
+  void free(void *chunk, int cls);
+
+  /*!
+   * \brief Assign a page to the class, reusing a free page or allocating a
+   * new one if under the page limit.
+   * @return True if a page was assigned.
+   */
+  bool add_page(int cls);
+
+  /*!
+   * \brief Unassign a page, all of whose chunks must be free.
+   * @param page Page index.
+   * @param release_memory True to give the page memory back, false to
+   * keep the page around for reuse by add_page.
+   */
+  void release_page(size_t page, bool release_memory);
+
+  /*!
+   * \brief Give back the memory of a page not assigned to any class.
+   * @return False if there are no such pages.
+   */
+  bool release_free_page();
+
+  /*!
+   * \brief Pick a class to take a page away from: the class with the most pages.
+   * @param exclude Class to leave alone, or -1.
+   * @return Class, or -1 if there are no assigned pages.
+   */
+  int victim_class(int exclude) const;
+
+  /*!
+   * \brief Page holding a chunk.
+   * @return Page index, or -1 if not found.
+   */
+  long page_of(const void *chunk, int cls) const;
+
+  /*!
+   * \brief Set the maximum number of pages to allocate.
+   * Does not release pages over the limit, see release_page.
+   */
+  void set_max_pages(size_t pages) {
+    max_pages_ = pages;
+  }
+
+  size_t max_pages() const {
+    return max_pages_;
+  }
+
+  /*!
+   * \brief Number of pages allocated, assigned or not.
+   */
+  size_t pages() const {
+    return allocated_;
+  }
+
+  /*!
+   * \brief Number of allocated pages not assigned to any class.
+   */
+  size_t free_pages() const {
+    return free_pages_.size();
+  }
+
+  /*!
+   * \brief Number of pages assigned to a class.
+   */
+  size_t pages(int cls) const {
+    return classes_[cls].pages_.size();
+  }
+
+  /*!
+   * \brief Index of the i-th page assigned to a class.
+   */
+  size_t class_page(int cls, size_t i) const {
+    return classes_[cls].pages_[i];
+  }
+
+  /*!
+   * \brief Start of the page memory, and the class it is assigned to.
+   */
+  char *page_memory(size_t page) const {
+    return pages_[page].memory_.get();
+  }
+
+  int page_class(size_t page) const {
+    return pages_[page].class_;
+  }
+
+  /*!
+   * \brief Number of chunks in a page of the class.
+   */
+  size_t chunks_per_page(int cls) const {
+    return page_size_ / classes_[cls].size_;
+  }
+
+  /*!
+   * \brief Number of free chunks in the class.
+   */
+  size_t free_chunks(int cls) const {
+    return classes_[cls].free_count_;
+  }
+
+private:
+  struct page {
+    std::unique_ptr<char[]> memory_;
+    int class_ = -1;
+  };
+
+  struct size_class_info {
+    size_t size_ = 0;
+    std::vector<size_t> pages_;
+    free_chunk *free_ = nullptr;
+    size_t free_count_ = 0;
+  };
+
+  size_t page_size_ = 0;
+  size_t max_pages_ = 0;
+  gauge<size_t> allocated_;
+
+  std::vector<size_class_info> classes_;
+  std::vector<page> pages_;
+
+  /*!
+   * \brief Allocated pages not assigned to any class.
+   */
+  std::vector<size_t> free_pages_;
+
+  void push_free(size_class_info &c, free_chunk *f);
+  void unlink_free(size_class_info &c, free_chunk *f);
+
+  slab_allocator(const slab_allocator&) = delete;
+  slab_allocator& operator=(const slab_allocator&) = delete;
+};
+}
@@ -0,0 +1,89 @@
+//
+// Stats.
+//
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+namespace memcache {
+
+/*!
+ * \brief Stats as name and value pairs, as returned by the STAT command.
+ */
+typedef std::vector<std::pair<std::string, std::string>> stats_list;
+
+/*!
+ * \brief Counter with a single writer at a time (e.g. updated under a lock),
+ * which can be read from any thread.
+ * Avoids the cost of an atomic read-modify-write on updates.
+ */
+struct counter {
+  void add(uint64_t n = 1) {
+    v_.store(v_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const {
+    return v_.load(std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> v_{0};
+};
+
+/*!
+ * \brief Value with a single writer at a time, like counter, which can also
+ * go down or be set (e.g. a number of items). Reads as a plain value, so
+ * it can stand in for one in the data structures whose sizes are stats.
+ */
+template<typename T>
+struct gauge {
+  gauge(T v = 0) : v_(v) {}
+  gauge(const gauge &g) : v_(g.get()) {}
+
+  gauge &operator=(const gauge &g) {
+    set(g.get());
+    return *this;
+  }
+
+  gauge &operator=(T v) {
+    set(v);
+    return *this;
+  }
+
+  operator T() const {
+    return get();
+  }
+
+  T get() const {
+    return v_.load(std::memory_order_relaxed);
+  }
+
+  void set(T v) {
+    v_.store(v, std::memory_order_relaxed);
+  }
+
+  gauge &operator+=(T n) {
+    set(get() + n);
+    return *this;
+  }
+
+  gauge &operator-=(T n) {
+    set(get() - n);
+    return *this;
+  }
+
+  gauge &operator++() {
+    return *this += 1;
+  }
+
+  gauge &operator--() {
+    return *this -= 1;
+  }
+
+  std::atomic<T> v_;
+};
+}
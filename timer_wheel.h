@@ -0,0 +1,183 @@
+//
+// Hierarchical timer wheel.
+//
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace memcache {
+
+/*!
+ * \brief Timer, embedded in the object it is a timer for.
+ * Timers are kept in circular lists, so they can be removed without
+ * knowing which wheel slot they are in.
+ */
+struct timer_node {
+  timer_node *prev_;
+  timer_node *next_;
+
+  /*!
+   * \brief Expiry time, in coarse_clock seconds.
+   */
+  uint32_t expires_;
+
+  bool linked() const {
+    return prev_ != nullptr;
+  }
+};
+
+/*!
+ * \brief Hierarchical timer wheel, with one second ticks.
+ *
+ * The wheel has 4 levels of 64 slots. A slot of level L covers 64^L
+ * seconds, so the wheel spans 64^4 seconds (about 194 days) and timers
+ * further out wait in the last slot of the top level. A timer goes in the
+ * lowest level whose span covers its delay. When the wheel turns over a
+ * slot boundary of a level, the timers in the slot are moved down to the
+ * lower levels. Adding and removing timers is O(1), and expiring them is
+ * O(1) per timer plus one slot move per level, which saves scanning all
+ * the objects to find the expired ones.
+ *
+ * Not thread-safe, expected to be protected by the owner's lock.
+ */
+class timer_wheel {
+public:
+  static const size_t LEVELS = 4;
+  static const size_t SLOT_BITS = 6;
+  static const size_t SLOTS = 1 << SLOT_BITS;
+
+  explicit timer_wheel(uint32_t now = 0) : current_(now) {
+    for (auto &level : slots_) {
+      for (auto &s : level) {
+        s.prev_ = s.next_ = &s;
+      }
+    }
+  }
+
+  /*!
+   * \brief Add a timer, which must not be in the wheel.
+   * Timers expiring at or before the current time fire on the next advance.
+   */
+  void add(timer_node *n, uint32_t expires) {
+    assert(!n->linked());
+    n->expires_ = expires;
+    insert(n);
+    ++size_;
+  }
+
+  /*!
+   * \brief Remove a timer from the wheel.
+   */
+  void remove(timer_node *n) {
+    assert(n->linked());
+    unlink(n);
+    --size_;
+  }
+
+  /*!
+   * \brief Advance the wheel up to the given time, firing the expired timers.
+   * Fired timers are removed from the wheel before being handed to the callback.
+   * @param now Current time.
+   * @param max Most timers to fire. The wheel stops at the current time
+   * if reached, and picks up from there on the next advance.
+   * @param fire Callback, called with each expired timer.
+   * @return Number of timers fired.
+   */
+  template<typename F>
+  size_t advance(uint32_t now, size_t max, F fire) {
+    size_t fired = 0;
+    while (true) {
+      timer_node &s = slots_[0][current_ & (SLOTS - 1)];
+      while (s.next_ != &s) {
+        if (fired == max) {
+          return fired;
+        }
+
+        timer_node *n = s.next_;
+        remove(n);
+        fire(n);
+        ++fired;
+      }
+
+      if ((int32_t) (now - current_) <= 0) {
+        return fired;
+      }
+
+      ++current_;
+      cascade();
+    }
+  }
+
+  /*!
+   * \brief Time the wheel has advanced to.
+   */
+  uint32_t current() const {
+    return current_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+private:
+  uint32_t current_ = 0;
+  size_t size_ = 0;
+  timer_node slots_[LEVELS][SLOTS];
+
+  static void unlink(timer_node *n) {
+    n->prev_->next_ = n->next_;
+    n->next_->prev_ = n->prev_;
+    n->prev_ = n->next_ = nullptr;
+  }
+
+  static void push(timer_node &s, timer_node *n) {
+    n->prev_ = s.prev_;
+    n->next_ = &s;
+    s.prev_->next_ = n;
+    s.prev_ = n;
+  }
+
+  void insert(timer_node *n) {
+    uint32_t expires = n->expires_;
+    if ((int32_t) (expires - current_) < 0) {
+      expires = current_;
+    }
+
+    uint32_t delta = expires - current_;
+    for (size_t level = 0; level < LEVELS; ++level) {
+      if (delta < (uint32_t) 1 << ((level + 1) * SLOT_BITS) || level == LEVELS - 1) {
+        // Too far out: wait in the slot furthest away on the top level.
+        if (level == LEVELS - 1 && delta >= (uint32_t) 1 << (LEVELS * SLOT_BITS)) {
+          expires = current_ - ((uint32_t) 1 << (level * SLOT_BITS));
+        }
+
+        push(slots_[level][(expires >> (level * SLOT_BITS)) & (SLOTS - 1)], n);
+        return;
+      }
+    }
+  }
+
+  /*!
+   * \brief Move the timers of the slots the wheel turned over on the higher
+   * levels down to the lower levels, highest first.
+   */
+  void cascade() {
+    size_t top = 0;
+    while (top + 1 < LEVELS && !(current_ & (((uint32_t) 1 << ((top + 1) * SLOT_BITS)) - 1))) {
+      ++top;
+    }
+
+    for (size_t level = top; level > 0; --level) {
+      timer_node &s = slots_[level][(current_ >> (level * SLOT_BITS)) & (SLOTS - 1)];
+      while (s.next_ != &s) {
+        timer_node *n = s.next_;
+        unlink(n);
+        insert(n);
+      }
+    }
+  }
+};
+}
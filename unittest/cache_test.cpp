@@ -1,7 +1,10 @@
 #include <thread>
 #include <vector>
+#include <chrono>
 
 #include "./../cache.h"
+#include "./../sharded_cache.h"
+#include "./../reclaimer.h"
 #include "../protocol_binary.h"
 
 using namespace memcache;
@@ -11,9 +14,11 @@ using namespace memcache;
  * @param key
  * @param value
  * @param cas
+ * @param exptime
  * @return constructed request.
  */
-static std::string build_set_request(const std::string& key, const std::string& value, uint64_t cas = 0) {
+static std::string build_set_request(const std::string& key, const std::string& value, uint64_t cas = 0,
+                                     uint32_t exptime = 0) {
   protocol_binary_request_header h;
   memset(&h, 0, sizeof(h));
 
@@ -28,7 +33,9 @@ static std::string build_set_request(const std::string& key, const std::string&
 
   std::string ret;
   ret.assign(reinterpret_cast<const char* >(&h), sizeof(h));
-  ret.append(8, 0);
+  ret.append(4, 0);
+  exptime = htonl(exptime);
+  ret.append(reinterpret_cast<const char* >(&exptime), sizeof(exptime));
   ret.append(key);
   ret.append(value);
   return ret;
@@ -65,7 +72,7 @@ void test_basic(int id = 0, uint64_t cas = 0) {
     std::string val("val_" + std::to_string(id) + '_' + std::to_string(i));
     std::string pak = build_set_request(key, val);
     cache::value v(std::move(pak), *util::get_header(pak));
-    std::shared_ptr<cache::value> ret = c.get(v.get_key());
+    cache::item_ptr ret = c.get(v.get_key());
     assert(ret);
     assert(memcmp(val.data(), ret->get_value(), val.length()) == 0);
   }
@@ -85,7 +92,7 @@ void test_basic(int id = 0, uint64_t cas = 0) {
       std::string val("val_" + std::to_string(id) + '_' + std::to_string(10 * i + 1));
       std::string pak = build_set_request(key, val);
       cache::value v(std::move(pak), *util::get_header(pak));
-      std::shared_ptr<cache::value> ret = c.get(v.get_key());
+      cache::item_ptr ret = c.get(v.get_key());
       assert(ret);
       assert(memcmp(val.data(), ret->get_value(), val.length()) == 0);
 
@@ -125,7 +132,7 @@ void test_remove(uint64_t cas = 0) {
     std::string val("val_" + std::to_string(i));
     std::string pak = build_set_request(key, val);
     cache::value v(std::move(pak), *util::get_header(pak));
-    std::shared_ptr<cache::value> ret = c.get(v.get_key());
+    cache::item_ptr ret = c.get(v.get_key());
     assert(ret);
     assert(memcmp(val.data(), ret->get_value(), val.length()) == 0);
   }
@@ -167,52 +174,662 @@ void all_tests(int id = 0) {
   test_remove(999);
 }
 
-static void set(cache& c, std::string key, std::string val) {
-  std::string pak = build_set_request(key, val);
-  c.set(cache::value(std::move(pak), *util::get_header(pak)));
+
+static bool set(cache& c, std::string key, std::string val, uint32_t exptime = 0) {
+  std::string pak = build_set_request(key, val, 0, exptime);
+  return c.set(cache::value(std::move(pak), *util::get_header(pak)));
 }
 
-static std::shared_ptr<cache::value> get(cache& c, std::string key) {
+static cache::item_ptr get(cache& c, std::string key) {
   auto pak = build_set_request(key, "");
   cache::value v(std::move(pak), *util::get_header(pak));
   return c.get(v.get_key());
 }
 
 /*!
- * \brief Test freeing based on LRU.
+ * \brief Test items keep the key, value and flags of the set request, and
+ * the pre-encoded GET response.
+ */
+void test_item(bool encoded) {
+  cache c(0, true, eviction_policy::LRU, admission_policy::NONE, encoded);
+  std::string pak = build_set_request("key", "value", 42);
+  uint32_t flags = htonl(0x1234);
+  memcpy(&pak[sizeof(protocol_binary_request_header)], &flags, sizeof(flags));
+  assert(c.set(cache::value(std::move(pak), *util::get_header(pak))));
+
+  auto ret = get(c, "key");
+  assert(ret);
+  assert(ret->get_key() == cache::key("key", 3));
+  assert(ret->value_len() == 5 && memcmp(ret->get_value(), "value", 5) == 0);
+  assert(ret->client_flags() == flags);
+  assert(ret->encoded() == encoded);
+  if (!encoded) {
+    return;
+  }
+
+  auto r = reinterpret_cast<const protocol_binary_response_header *>(ret->response());
+  assert(r->response.magic == PROTOCOL_BINARY_RES);
+  assert(r->response.extlen == sizeof(flags));
+  assert(ntohl(r->response.bodylen) == sizeof(flags) + 5);
+  assert(ntohll(r->response.cas) == 42);
+  assert(ret->response_len() == sizeof(*r) + sizeof(flags) + 5);
+  assert(!memcmp(ret->response() + sizeof(*r), &flags, sizeof(flags)));
+  assert(ret->response() + sizeof(*r) + sizeof(flags) == ret->get_value());
+}
+
+/*!
+ * \brief Test freeing based on LRU or CLOCK.
+ */
+void test_free(eviction_policy policy) {
+  cache c(0, true, policy);
+
+  // Room for two slab pages, next to the index.
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  const std::string val(100 * KB, 'v');
+  const int items = 100;
+
+  // Set values, keeping key_0 recently used.
+  for (int i = 0;i < items;++i) {
+    std::string key("key_" + std::to_string(i));
+    assert(set(c, key, val));
+    assert(get(c, "key_0"));
+    assert(c.size() <= c.capacity());
+  }
+
+  // Only the most recent values should be in the cache.
+  assert(c.count() < items);
+  assert(c.count() > 5);
+
+  for (int i = items - 5;i < items;++i) {
+    std::string key("key_" + std::to_string(i));
+    auto ret = get(c, key);
+    assert(ret);
+    assert(ret->value_len() == val.length());
+    assert(memcmp(val.data(), ret->get_value(), val.length()) == 0);
+  }
+
+  assert(!get(c, "key_1"));
+}
+
+/*!
+ * \brief Test taking slab pages from another size class.
+ */
+void test_free_pages(eviction_policy policy) {
+  cache c(0, true, policy);
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  // Fill up the slab pages with small values.
+  const std::string small(KB, 's');
+  for (int i = 0;i < 4000;++i) {
+    assert(set(c, "small_" + std::to_string(i), small));
+  }
+
+  // Large values take pages away from the small values.
+  const std::string large(500 * KB, 'l');
+  for (int i = 0;i < 10;++i) {
+    std::string key("large_" + std::to_string(i));
+    assert(set(c, key, large));
+    assert(get(c, key));
+    assert(c.size() <= c.capacity());
+  }
+
+  // Small values are left on the pages which were not taken.
+  assert(c.count() > 10 + 100);
+
+  // Items referenced by other threads are not freed, sets wait for them.
+  std::atomic<bool> held(false);
+  std::thread reader([&] {
+    auto ref = get(c, "large_9");
+    assert(ref);
+    held = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert(memcmp(large.data(), ref->get_value(), large.length()) == 0);
+  });
+  while (!held) {
+    std::this_thread::yield();
+  }
+  for (int i = 0;i < 10;++i) {
+    assert(set(c, "small_" + std::to_string(i), small));
+  }
+  reader.join();
+
+  // Not enough memory for a single page.
+  c.rehash(SLAB_PAGE_SIZE / 2);
+  assert(!set(c, "key", small));
+  assert(c.count() == 0);
+}
+
+/*!
+ * \brief Test background reclaim between the watermarks.
+ */
+void test_reclaim(eviction_policy policy) {
+  cache c(0, true, policy);
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  size_t notified = 0;
+  c.set_watermarks(5, 10, [&notified] { ++notified; });
+
+  // Fill up the slab pages, until the class is under the low watermark.
+  const std::string val(100 * KB, 'v');
+  int items = 0;
+  while (!c.reclaim_wanted()) {
+    assert(set(c, "key_" + std::to_string(items++), val));
+  }
+
+  assert(notified == 1);
+  assert(c.stats().inline_reclaims_.get() == 0);
+
+  // Reclaim in batches, up to the high watermark.
+  assert(c.reclaim(1) == 1);
+  assert(c.reclaim_wanted());
+  while (c.reclaim(1)) {
+  }
+
+  assert(!c.reclaim_wanted());
+  assert(c.stats().background_reclaims_.get() >= 2);
+  assert(!get(c, "key_0"));
+  assert(get(c, "key_" + std::to_string(items - 1)));
+
+  // Sets don't evict while the reclaimer keeps up.
+  for (int i = 0;i < 100;++i) {
+    assert(set(c, "key_" + std::to_string(items++), val));
+    c.reclaim(RECLAIM_BATCH_SIZE);
+  }
+
+  assert(c.stats().inline_reclaims_.get() == 0);
+  assert(notified > 1);
+}
+
+/*!
+ * \brief Test gets sharing the cache lock with CLOCK eviction, next to sets.
  */
-void test_free() {
+void test_clock_concurrent() {
+  cache c(0, true, eviction_policy::CLOCK);
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  const std::string val(10 * KB, 'v');
+  for (int i = 0;i < 10;++i) {
+    assert(set(c, "hot_" + std::to_string(i), val));
+  }
+
+  std::vector<std::thread> ts;
+  std::atomic<int> misses(0);
+  for (int t = 0;t < 4;++t) {
+    ts.emplace_back([&] {
+      for (int n = 0;n < 10000;++n) {
+        auto ret = get(c, "hot_" + std::to_string(n % 10));
+        if (!ret) {
+          ++misses;
+          continue;
+        }
+        assert(memcmp(val.data(), ret->get_value(), val.length()) == 0);
+      }
+    });
+  }
+
+  // Cold items are evicted, while the hot items keep being referenced.
+  for (int i = 0;i < 2000;++i) {
+    assert(set(c, "cold_" + std::to_string(i), val));
+  }
+
+  for (auto& t : ts) {
+    t.join();
+  }
+
+  assert(c.count() < 2010);
+  assert(!get(c, "cold_0"));
+}
+
+/*!
+ * \brief Test items read by other threads are not reused until released,
+ * while they are overwritten and evicted.
+ */
+void test_epoch() {
   cache c;
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  assert(set(c, "key", std::string(10 * KB, 'a')));
+  std::atomic<bool> held(false);
+  std::thread reader([&] {
+    auto ret = get(c, "key");
+    assert(ret);
+    held = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(ret->value_len() == 10 * KB);
+    assert(std::string(ret->get_value(), ret->value_len()) == std::string(10 * KB, 'a'));
+  });
+
+  while (!held) {
+    std::this_thread::yield();
+  }
 
-  std::string key("key_1");
-  std::string val("val_1");
-  std::string pak = build_set_request(key, val);
-  size_t target_size = 5 * pak.length();
+  // Sets wait for the reader once out of memory.
+  for (int i = 0;i < 1000;++i) {
+    assert(set(c, "key", std::string(10 * KB, 'b' + i % 20)));
+  }
+  reader.join();
 
-  c.rehash(target_size);
+  auto ret = get(c, "key");
+  assert(ret && ret->get_value()[0] == 'b' + 999 % 20);
+}
+
+/*!
+ * \brief Test pinned items are not reused until unpinned, without holding
+ * up the other items.
+ */
+void test_pinned(bool locked) {
+  cache c(0, locked);
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  const std::string val(100 * KB, 'p');
+  assert(set(c, "key", val));
+  cache::pinned_item pinned = get(c, "key").pin();
+  assert(pinned);
+
+  for (int i = 0;i < 100;++i) {
+    assert(set(c, "key_" + std::to_string(i), std::string(100 * KB, 'a' + i % 20)));
+  }
+  assert(!get(c, "key"));
+  assert(memcmp(val.data(), pinned.get()->get_value(), val.length()) == 0);
+
+  pinned.reset();
+  for (int i = 0;i < 100;++i) {
+    assert(set(c, "key_" + std::to_string(i), val));
+  }
+}
 
-  // Now set value;
-  c.set(cache::value(std::move(pak), *util::get_header(pak)));
+/*!
+ * \brief Test the value of a set received straight into a reserved item,
+ * which is only seen once committed, and freed if not.
+ */
+void test_reserve() {
+  cache c;
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  const std::string val(100 * KB, 'r');
+  std::string pak = build_set_request("key", val);
+  protocol_binary_request_header h = *util::get_header(pak);
+  const char *body = pak.data() + sizeof(h);
+  uint32_t hash = cache::hash(cache::key("key", 3));
+
+  cache::reserved_item r = c.reserve(h, body, hash);
+  assert(r && r.value_len() == val.size());
+  memcpy(r.value(), val.data(), val.size());
+  assert(!get(c, "key"));
+  assert(r.commit(0));
+  assert(!r);
+
+  auto ret = get(c, "key");
+  assert(ret && ret->value_len() == val.size());
+  assert(memcmp(ret->get_value(), val.data(), val.size()) == 0);
+  ret.reset();
+
+  // The cas is checked on commit.
+  r = c.reserve(h, body, hash);
+  assert(r);
+  assert(!r.commit(1));
+  assert(get(c, "key"));
+
+  // Reservations given up on don't hold on to memory.
+  for (int i = 0;i < 100;++i) {
+    cache::reserved_item ri = c.reserve(h, body, hash);
+    assert(ri);
+  }
   assert(c.count() == 1);
+}
 
-  // Set 10 values. Only last 5 values should be in the cache.
-  {
-    for (int i = 0;i < 10;++i) {
-      std::string key("key_" + std::to_string(i));
-      std::string val("val_" + std::to_string(i));
-      set(c, key, val);
+/*!
+ * \brief Working set items left after a scan.
+ */
+static int scan(eviction_policy policy) {
+  cache c(0, true, policy);
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  // Working set, hit twice.
+  const std::string val(10 * KB, 'v');
+  const int hot = 30;
+  for (int i = 0;i < hot;++i) {
+    assert(set(c, "hot_" + std::to_string(i), val));
+  }
+
+  for (int n = 0;n < 2;++n) {
+    for (int i = 0;i < hot;++i) {
+      assert(get(c, "hot_" + std::to_string(i)));
     }
+  }
 
-    assert(c.count() == 5);
+  // Scan, reading each item once.
+  for (int i = 0;i < 1000;++i) {
+    std::string key("scan_" + std::to_string(i));
+    assert(set(c, key, val));
+    assert(get(c, key));
+  }
 
-    for (int i = 5;i < 10;++i) {
-      std::string key("key_" + std::to_string(i));
-      std::string val("val_" + std::to_string(i));
-      auto ret = get(c, key);
-      assert(ret);
-      assert(memcmp(val.data(), ret->get_value(), val.length()) == 0);
+  int hits = 0;
+  for (int i = 0;i < hot;++i) {
+    hits += get(c, "hot_" + std::to_string(i)) ? 1 : 0;
+  }
+
+  if (policy == eviction_policy::SEGMENTED) {
+    assert(c.segment_count(cache::WARM) == hot);
+    assert(c.segment_count(cache::HOT) + c.segment_count(cache::WARM) +
+        c.segment_count(cache::COLD) == c.count());
+    assert(c.stats().promotions_.get() >= hot);
+  }
+
+  return hits;
+}
+
+/*!
+ * \brief Test that a scan flushes the working set with LRU, but not with
+ * the segmented LRU.
+ */
+void test_segmented() {
+  assert(scan(eviction_policy::LRU) == 0);
+  assert(scan(eviction_policy::SEGMENTED) == 30);
+}
+
+/*!
+ * \brief Test the frequency sketch estimates and aging.
+ */
+void test_sketch() {
+  frequency_sketch s(1024);
+  for (int i = 0;i < 5;++i) {
+    s.increment(42);
+  }
+  assert(s.estimate(42) == 5);
+
+  for (int i = 0;i < 100;++i) {
+    s.increment(42);
+  }
+  assert(s.estimate(42) == frequency_sketch::MAX_COUNT);
+
+  // Other keys age the counts.
+  for (uint32_t i = 0;i < 10 * 1024;++i) {
+    s.increment(1000 + i);
+  }
+  assert(s.estimate(42) < frequency_sketch::MAX_COUNT);
+}
+
+void test_timer_wheel() {
+  timer_wheel w(1);
+  std::vector<timer_node> timers(4);
+  const uint32_t expires[] = {1, 70, 5000, 300000};
+  for (size_t i = 0;i < timers.size();++i) {
+    timers[i].prev_ = timers[i].next_ = nullptr;
+    w.add(&timers[i], expires[i]);
+  }
+
+  std::vector<uint32_t> fired;
+  auto fire = [&](timer_node *n) { fired.push_back(w.current()); assert(n->expires_ == w.current()); };
+
+  // Timers on the higher levels fire on time, once cascaded down.
+  assert(w.advance(69, 10, fire) == 1);
+  assert(w.advance(4999, 10, fire) == 1);
+  w.remove(&timers[3]);
+  assert(w.advance(400000, 10, fire) == 1);
+  assert(fired == std::vector<uint32_t>({1, 70, 5000}));
+  assert(!w.size());
+}
+
+/*!
+ * \brief Test expired items are misses, and are freed by expire.
+ */
+void test_expire() {
+  cache c;
+  assert(set(c, "forever", "v"));
+  assert(set(c, "soon", "v", 10));
+  assert(set(c, "later", "v", 5000));
+  assert(set(c, "past", "v", (uint32_t) -1));
+  assert(get(c, "soon"));
+  assert(!get(c, "past"));
+
+  coarse_clock::advance(10);
+  assert(!get(c, "soon"));
+  assert(get(c, "later"));
+  assert(c.count() == 4);
+
+  assert(c.expire(1) == 1);
+  assert(c.expire(10) == 1);
+  assert(c.count() == 2);
+  assert(c.stats().expired_.get() == 2);
+
+  // Deleting an expired item is a miss.
+  coarse_clock::advance(5000);
+  auto pak = build_set_request("later", "");
+  assert(!c.remove(cache::value(std::move(pak), *util::get_header(pak)), 0));
+  assert(!c.expire(10));
+  assert(c.count() == 1);
+  assert(get(c, "forever"));
+}
+
+/*!
+ * \brief Popular items left after a flood of items set once.
+ */
+static int flood(admission_policy admission) {
+  cache c(0, true, eviction_policy::LRU, admission);
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  const std::string val(10 * KB, 'v');
+  const int popular = 100;
+  for (int i = 0;i < popular;++i) {
+    assert(set(c, "popular_" + std::to_string(i), val));
+  }
+
+  for (int n = 0;n < 5;++n) {
+    for (int i = 0;i < popular;++i) {
+      assert(get(c, "popular_" + std::to_string(i)));
+    }
+  }
+
+  // With background reclaim as well.
+  c.set_watermarks(5, 10);
+  for (int i = 0;i < 2000;++i) {
+    assert(set(c, "once_" + std::to_string(i), val));
+    assert(c.size() <= c.capacity());
+    c.reclaim(RECLAIM_BATCH_SIZE);
+  }
+
+  int hits = 0;
+  for (int i = 0;i < popular;++i) {
+    hits += get(c, "popular_" + std::to_string(i)) ? 1 : 0;
+  }
+
+  if (admission == admission_policy::TINYLFU) {
+    assert(c.stats().rejected_.get() > 0);
+  }
+
+  return hits;
+}
+
+/*!
+ * \brief Test that TinyLFU keeps popular items over items set once.
+ */
+void test_tinylfu() {
+  test_sketch();
+
+  assert(flood(admission_policy::NONE) == 0);
+  assert(flood(admission_policy::TINYLFU) == 100);
+}
+
+/*!
+ * \brief Test the reclaimer thread on a sharded cache.
+ */
+void test_reclaimer() {
+  sharded_cache c(8 * SLAB_PAGE_SIZE, 2);
+  reclaimer r(c);
+  r.start(5, 10);
+
+  const std::string val(100 * KB, 'v');
+  for (int i = 0;i < 1000;++i) {
+    std::string key("key_" + std::to_string(i));
+    std::string pak = build_set_request(key, val);
+    assert(c.set(cache::value(std::move(pak), *util::get_header(pak))));
+  }
+
+  // Wait for the reclaimer to catch up.
+  for (int i = 0;i < 100 && (c.shard_at(0).reclaim_wanted() || c.shard_at(1).reclaim_wanted());++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  assert(!c.shard_at(0).reclaim_wanted() && !c.shard_at(1).reclaim_wanted());
+  assert(c.shard_at(0).stats().background_reclaims_.get() > 0);
+  assert(c.shard_at(1).stats().background_reclaims_.get() > 0);
+
+  stats_list stats;
+  c.get_stats(stats);
+  assert(!stats.empty());
+}
+
+/*!
+ * \brief Test STAT while the shards are being written, growing their index
+ * and adding pages. Unlocked, the shards are written by their owner only,
+ * as by the CPU executors. Best run with -DSANITIZE=thread.
+ */
+void test_stats_concurrent(bool locked) {
+  sharded_cache c(64 * MB, 2, locked);
+  const int items = 20000;
+
+  std::atomic<bool> done(false);
+  std::thread writer([&] {
+    const std::string val(100, 'v');
+    for (int i = 0;i < items;++i) {
+      std::string pak = build_set_request("key_" + std::to_string(i), val);
+      assert(c.set(cache::value(std::move(pak), *util::get_header(pak))));
     }
+    done = true;
+  });
+
+  size_t last = 0;
+  while (!done) {
+    stats_list stats;
+    c.get_stats(stats);
+    assert(stats[0].first == "curr_items");
+    size_t count = std::stoul(stats[0].second);
+    assert(count >= last && count <= (size_t) items);
+    last = count;
+  }
+  writer.join();
+
+  stats_list stats;
+  c.get_stats(stats);
+  assert(stats[0].second == std::to_string(items));
+}
+
+/*!
+ * \brief Test batched sets, evicting once for the batch.
+ */
+void test_set_many(eviction_policy policy) {
+  cache c(0, true, policy);
+  c.rehash(3 * SLAB_PAGE_SIZE);
+
+  // More values than fit, with the room for the last ones made up front.
+  const std::string val(100 * KB, 'v');
+  const size_t n = 40;
+  std::vector<cache::value> v;
+  std::vector<uint32_t> hashes;
+  std::vector<uint32_t> idx;
+  for (size_t i = 0;i < n;++i) {
+    std::string pak = build_set_request("key_" + std::to_string(i), val);
+    v.emplace_back(std::move(pak), *util::get_header(pak));
+    hashes.push_back(cache::hash(v.back().get_key()));
+    idx.push_back((uint32_t) i);
+  }
+
+  std::unique_ptr<bool[]> done(new bool[n]);
+  c.set_many(v.data(), hashes.data(), idx.data(), n, done.get());
+  assert(c.size() <= c.capacity());
+  assert(c.count() > 5 && c.count() < n);
+  for (size_t i = n - 5;i < n;++i) {
+    assert(done[i]);
+    auto ret = get(c, "key_" + std::to_string(i));
+    assert(ret);
+    assert(ret->value_len() == val.length());
   }
+  assert(!get(c, "key_0"));
+
+  // Cas checked against the sets before them in the batch.
+  v.clear();
+  for (uint64_t cas : {5, 6, 5}) {
+    std::string pak = build_set_request("cas_key", std::to_string(cas + v.size()), cas);
+    v.emplace_back(std::move(pak), *util::get_header(pak));
+  }
+
+  hashes.assign(3, cache::hash(v[0].get_key()));
+  c.set_many(v.data(), hashes.data(), idx.data(), 3, done.get());
+  assert(done[0] && !done[1] && done[2]);
+  auto ret = get(c, "cas_key");
+  assert(ret && ret->value_len() == 1 && ret->get_value()[0] == '7');
+}
+
+/*!
+ * \brief Test set, get and remove on a sharded cache.
+ */
+void test_sharded() {
+  const size_t shards = 8;
+  const int items = 1000;
+  sharded_cache c(0, shards);
+  assert(c.shards() == shards);
+
+  for (int i = 0;i < items;++i) {
+    std::string key("key_" + std::to_string(i));
+    std::string val("val_" + std::to_string(i));
+    std::string pak = build_set_request(key, val);
+    c.set(cache::value(std::move(pak), *util::get_header(pak)));
+  }
+
+  assert(c.count() == items);
+
+  // Every shard should get some of the keys.
+  std::vector<size_t> per_shard(shards, 0);
+  for (int i = 0;i < items;++i) {
+    std::string key("key_" + std::to_string(i));
+    ++per_shard[c.shard_index(cache::hash(cache::key(key.data(), key.length())))];
+  }
+
+  for (auto n : per_shard) {
+    assert(n > 0);
+  }
+
+  // Batched gets, with every other key missing.
+  std::vector<std::string> names;
+  std::vector<cache::key> keys;
+  for (int i = 0;i < 2 * items;i += 2) {
+    names.push_back("key_" + std::to_string(i));
+  }
+  for (auto &n : names) {
+    keys.push_back(cache::key(n.data(), n.length()));
+  }
+
+  std::vector<int> seen(keys.size(), 0);
+  c.get_many(keys.data(), keys.size(), [&](size_t i, cache::item_ptr it) {
+    ++seen[i];
+    assert(!it == (i >= items / 2));
+    if (it) {
+      std::string val("val_" + std::to_string(2 * i));
+      assert(it->value_len() == val.length());
+      assert(memcmp(val.data(), it->get_value(), val.length()) == 0);
+    }
+  });
+  for (auto n : seen) {
+    assert(n == 1);
+  }
+
+  for (int i = 0;i < items;++i) {
+    std::string key("key_" + std::to_string(i));
+    std::string val("val_" + std::to_string(i));
+    std::string pak = build_set_request(key, val);
+    cache::value v(std::move(pak), *util::get_header(pak));
+    auto ret = c.get(v.get_key());
+    assert(ret);
+    assert(memcmp(val.data(), ret->get_value(), val.length()) == 0);
+
+    assert(c.remove(v, 0));
+    assert(!c.get(v.get_key()));
+  }
+
+  assert(c.count() == 0);
 }
 
 int main() {
@@ -229,5 +846,27 @@ int main() {
     ts[i].join();
   }
 
-  test_free();
+  test_item(true);
+  test_item(false);
+
+  for (auto policy : {eviction_policy::LRU, eviction_policy::CLOCK, eviction_policy::SEGMENTED}) {
+    test_free(policy);
+    test_free_pages(policy);
+    test_reclaim(policy);
+    test_set_many(policy);
+  }
+
+  test_timer_wheel();
+  test_expire();
+  test_epoch();
+  test_pinned(true);
+  test_pinned(false);
+  test_reserve();
+  test_clock_concurrent();
+  test_segmented();
+  test_tinylfu();
+  test_reclaimer();
+  test_stats_concurrent(true);
+  test_stats_concurrent(false);
+  test_sharded();
 }
\ No newline at end of file
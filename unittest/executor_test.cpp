@@ -1,8 +1,643 @@
+#include <fcntl.h>
+#include <chrono>
+#include <thread>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+
 #include "./../executor.h"
 
 using namespace memcache;
 
+/*!
+ * \brief Build a request packet.
+ */
+static buffer build_request(uint8_t opcode, const std::string& key,
+                            const std::string& value = "") {
+  protocol_binary_request_header h;
+  memset(&h, 0, sizeof(h));
+
+  bool set = opcode == PROTOCOL_BINARY_CMD_SET || opcode == PROTOCOL_BINARY_CMD_SETQ;
+  size_t extlen = set ? PACKET_EXTRAS_SIZE : 0;
+  h.request.magic = (uint8_t) PROTOCOL_BINARY_REQ;
+  h.request.opcode = opcode;
+  h.request.keylen = htons((uint16_t) key.length());
+  h.request.extlen = (uint8_t) extlen;
+  h.request.bodylen = htonl((uint32_t) (key.length() + value.length() + extlen));
+
+  buffer ret((unsigned char *) &h, (unsigned char *) &h + sizeof(h));
+  ret.insert(ret.end(), extlen, 0);
+  ret.insert(ret.end(), key.begin(), key.end());
+  ret.insert(ret.end(), value.begin(), value.end());
+  return ret;
+}
+
+/*!
+ * \brief Read a response and return its status, value and key.
+ */
+static uint16_t read_response(int fd, std::string& value, std::string* key = nullptr) {
+  protocol_binary_response_header h;
+  size_t n = 0;
+  while (n < sizeof(h)) {
+    ssize_t r = ::read(fd, (char *) &h + n, sizeof(h) - n);
+    assert(r > 0);
+    n += r;
+  }
+
+  size_t body = ntohl(h.response.bodylen);
+  std::string b(body, 0);
+  n = 0;
+  while (n < body) {
+    ssize_t r = ::read(fd, &b[n], body - n);
+    assert(r > 0);
+    n += r;
+  }
+
+  value = b.substr(h.response.extlen + ntohs(h.response.keylen));
+  if (key) {
+    *key = b.substr(h.response.extlen, ntohs(h.response.keylen));
+  }
+  return ntohs(h.response.status);
+}
+
+/*!
+ * \brief Send a request to the connection's socket.
+ */
+static void send_request(int fd, const buffer& b) {
+  size_t n = 0;
+  while (n < b.size()) {
+    ssize_t r = ::write(fd, b.data() + n, b.size() - n);
+    assert(r > 0);
+    n += r;
+  }
+}
+
+/*!
+ * \brief Test requests processed on CPU executors owning the cache partitions.
+ */
+void test_cpu_pool() {
+  int fds[2];
+  int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(!err);
+  ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+
+  sharded_cache c(0, 4, false);
+  IOPoolExecutor io(2);
+  CPUPoolExecutor cpu;
+  cpu.init(c, io);
+  assert(cpu.size() == 4);
+
+  connection *conn = new connection(fds[0], c, 1, &cpu);
+  io.add(task(task::NEW, conn), conn->executor_index_);
+
+  std::string value;
+  for (int i = 0; i < 100; ++i) {
+    std::string key("key_" + std::to_string(i));
+    std::string val("val_" + std::to_string(i));
+
+    send_request(fds[1], build_request(PROTOCOL_BINARY_CMD_SET, key, val));
+    io.add(task(task::READ, conn), conn->executor_index_);
+    assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    send_request(fds[1], build_request(PROTOCOL_BINARY_CMD_GET, key));
+    io.add(task(task::READ, conn), conn->executor_index_);
+    assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(value == val);
+  }
+
+  send_request(fds[1], build_request(PROTOCOL_BINARY_CMD_GET, "missing"));
+  io.add(task(task::READ, conn), conn->executor_index_);
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+  assert(c.count() == 100);
+
+  io.add(task(task::CLOSE, conn), conn->executor_index_);
+  ::close(fds[1]);
+}
+
+/*!
+ * \brief Test requests received together, and split over reads.
+ */
+void test_receive() {
+  int fds[2];
+  int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(!err);
+  ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+
+  sharded_cache c(16 * MB, 1, true);
+  connection conn(fds[0], c);
+
+  // Requests in a single write are all processed, in order.
+  buffer b = build_request(PROTOCOL_BINARY_CMD_SET, "a", "1");
+  buffer r = build_request(PROTOCOL_BINARY_CMD_GET, "a");
+  b.insert(b.end(), r.begin(), r.end());
+  r = build_request(PROTOCOL_BINARY_CMD_GET, "b");
+  b.insert(b.end(), r.begin(), r.end());
+  send_request(fds[1], b);
+
+  bool ok = conn.read();
+  assert(ok);
+
+  std::string value;
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+  assert(value == "1");
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+  // With a single write for their responses.
+  assert(conn.writes() == 1);
+
+  // A run of requests cut in the middle of one, processed in order, with a
+  // write per read.
+  b.clear();
+  for (int i = 0; i < 64; ++i) {
+    r = build_request(PROTOCOL_BINARY_CMD_SET, "k" + std::to_string(i), std::to_string(i));
+    b.insert(b.end(), r.begin(), r.end());
+    r = build_request(PROTOCOL_BINARY_CMD_GET, "k" + std::to_string(i));
+    b.insert(b.end(), r.begin(), r.end());
+  }
+
+  size_t half = b.size() / 2 + 3;
+  send_request(fds[1], buffer(b.begin(), b.begin() + half));
+  ok = conn.read();
+  assert(ok);
+  send_request(fds[1], buffer(b.begin() + half, b.end()));
+  ok = conn.read();
+  assert(ok);
+  assert(conn.writes() == 3);
+
+  for (int i = 0; i < 64; ++i) {
+    assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(value == std::to_string(i));
+  }
+
+  // A request split over reads, byte by byte through the header, with a
+  // value larger than the receive buffer.
+  std::string val(RECV_BUFFER_SIZE * 4, 'v');
+  b = build_request(PROTOCOL_BINARY_CMD_SET, "b", val);
+  r = build_request(PROTOCOL_BINARY_CMD_GET, "b");
+  b.insert(b.end(), r.begin(), r.end());
+
+  size_t n = 0;
+  while (n < b.size()) {
+    size_t chunk = n < sizeof(protocol_binary_request_header) ? 1 : RECV_BUFFER_SIZE + 1;
+    chunk = std::min(chunk, b.size() - n);
+    send_request(fds[1], buffer(b.begin() + n, b.begin() + n + chunk));
+    n += chunk;
+
+    ok = conn.read();
+    assert(ok);
+  }
+
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+  assert(value == val);
+
+  // A large set is only seen once received in full.
+  b = build_request(PROTOCOL_BINARY_CMD_SET, "c", val);
+  send_request(fds[1], buffer(b.begin(), b.begin() + RECV_BUFFER_SIZE));
+  ok = conn.read();
+  assert(ok);
+  assert(!c.get(sharded_cache::key("c", 1)));
+
+  // Closed by the peer, in the middle of the set.
+  ::close(fds[1]);
+  assert(!conn.read());
+  assert(!c.get(sharded_cache::key("c", 1)));
+}
+
+/*!
+ * \brief Test quiet commands, with their responses held back until a NOOP.
+ */
+void test_quiet() {
+  int fds[2];
+  int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(!err);
+  ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+
+  sharded_cache c(16 * MB, 1, true);
+  connection conn(fds[0], c);
+
+  // Quiet sets don't answer successes.
+  buffer b, r;
+  for (int i = 0; i < 10; ++i) {
+    r = build_request(PROTOCOL_BINARY_CMD_SETQ, "k" + std::to_string(i), "v" + std::to_string(i));
+    b.insert(b.end(), r.begin(), r.end());
+  }
+  send_request(fds[1], b);
+  bool ok = conn.read();
+  assert(ok);
+  assert(c.count() == 10);
+  assert(conn.writes() == 0);
+
+  // Multi-get over two reads, the hits only written once the NOOP is in.
+  b.clear();
+  for (int i = 0; i < 20; ++i) {
+    r = build_request(PROTOCOL_BINARY_CMD_GETKQ, "k" + std::to_string(i));
+    b.insert(b.end(), r.begin(), r.end());
+  }
+
+  size_t half = b.size() / 2 + 3;
+  send_request(fds[1], buffer(b.begin(), b.begin() + half));
+  ok = conn.read();
+  assert(ok);
+  send_request(fds[1], buffer(b.begin() + half, b.end()));
+  ok = conn.read();
+  assert(ok);
+  assert(conn.writes() == 0);
+
+  send_request(fds[1], build_request(PROTOCOL_BINARY_CMD_NOOP, ""));
+  ok = conn.read();
+  assert(ok);
+  assert(conn.writes() == 1);
+
+  std::string value, key;
+  for (int i = 0; i < 10; ++i) {
+    assert(read_response(fds[1], value, &key) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(key == "k" + std::to_string(i));
+    assert(value == "v" + std::to_string(i));
+  }
+  assert(read_response(fds[1], value, &key) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+  assert(key.empty() && value.empty());
+
+  // Quiet deletes answer errors, and a command that isn't quiet gets them out.
+  b = build_request(PROTOCOL_BINARY_CMD_DELETEQ, "k0");
+  r = build_request(PROTOCOL_BINARY_CMD_DELETEQ, "k0");
+  b.insert(b.end(), r.begin(), r.end());
+  r = build_request(PROTOCOL_BINARY_CMD_GET, "k1");
+  b.insert(b.end(), r.begin(), r.end());
+  send_request(fds[1], b);
+  ok = conn.read();
+  assert(ok);
+
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+  assert(value == "v1");
+  assert(c.count() == 9);
+
+  ::close(fds[1]);
+}
+
+/*!
+ * \brief Test the wire bytes of hits answered with the pre-encoded response
+ * of the item, patched for the request.
+ */
+void test_encoded_get() {
+  int fds[2];
+  int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(!err);
+  ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+
+  sharded_cache c(16 * MB, 1, true, eviction_policy::LRU, admission_policy::NONE, true);
+  connection conn(fds[0], c);
+
+  // Client flags, sent back as they are.
+  const unsigned char flags[] = {1, 2, 3, 4};
+  buffer b = build_request(PROTOCOL_BINARY_CMD_SET, "key", "value");
+  std::copy(flags, flags + sizeof(flags), b.begin() + sizeof(protocol_binary_request_header));
+  send_request(fds[1], b);
+  bool ok = conn.read();
+  assert(ok);
+  std::string value;
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+  // A GET, and a GETQ batched with the NOOP behind it.
+  const uint8_t opcodes[] = {PROTOCOL_BINARY_CMD_GET, PROTOCOL_BINARY_CMD_GETQ};
+  const uint32_t opaques[] = {0x11223344, 0x55667788};
+  b.clear();
+  for (int i = 0; i < 2; ++i) {
+    buffer r = build_request(opcodes[i], "key");
+    reinterpret_cast<protocol_binary_request_header *>(r.data())->request.opaque = opaques[i];
+    b.insert(b.end(), r.begin(), r.end());
+  }
+  buffer r = build_request(PROTOCOL_BINARY_CMD_NOOP, "");
+  b.insert(b.end(), r.begin(), r.end());
+  send_request(fds[1], b);
+  ok = conn.read();
+  assert(ok);
+
+  for (int i = 0; i < 2; ++i) {
+    unsigned char wire[sizeof(protocol_binary_response_header) + sizeof(flags) + 5];
+    size_t n = 0;
+    while (n < sizeof(wire)) {
+      ssize_t cnt = ::read(fds[1], wire + n, sizeof(wire) - n);
+      assert(cnt > 0);
+      n += cnt;
+    }
+
+    auto *h = reinterpret_cast<protocol_binary_response_header *>(wire);
+    assert(h->response.magic == PROTOCOL_BINARY_RES);
+    assert(h->response.opcode == opcodes[i]);
+    assert(h->response.keylen == 0);
+    assert(h->response.extlen == sizeof(flags));
+    assert(h->response.datatype == PROTOCOL_BINARY_RAW_BYTES);
+    assert(h->response.status == 0);
+    assert(ntohl(h->response.bodylen) == sizeof(flags) + 5);
+    assert(h->response.opaque == opaques[i]);
+    assert(h->response.cas == 0);
+    assert(!memcmp(wire + sizeof(*h), flags, sizeof(flags)));
+    assert(!memcmp(wire + sizeof(*h) + sizeof(flags), "value", 5));
+  }
+
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+  assert(value.empty());
+  ::close(fds[1]);
+}
+
+/*!
+ * \brief Test responses queued while the reader is slow, and the connection
+ * throttled while too much output is queued.
+ */
+void test_output_queue() {
+  int fds[2];
+  int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(!err);
+  ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+
+  sharded_cache c(16 * MB, 1, true);
+  connection conn(fds[0], c);
+
+  // The value doesn't fit in the socket buffer, send it while reading.
+  std::string val(MAX_VALUE_SIZE / 2, 'v');
+  std::thread writer([&]() {
+    send_request(fds[1], build_request(PROTOCOL_BINARY_CMD_SET, "key", val));
+  });
+
+  bool ok = true;
+  while (ok && !c.count()) {
+    ok = conn.read();
+  }
+  assert(ok);
+  writer.join();
+
+  // Nobody reads, the responses pile up once the socket is full.
+  std::string value;
+  assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+  size_t gets = 0;
+  while (!conn.throttled()) {
+    send_request(fds[1], build_request(PROTOCOL_BINARY_CMD_GET, "key"));
+    ok = conn.read();
+    assert(ok);
+    ++gets;
+  }
+
+  assert(conn.queued() >= MAX_QUEUED_OUTPUT);
+  assert(connection::stats_.throttled_ == 1);
+  assert(connection::stats_.queued_bytes_ == (int64_t) conn.queued());
+
+  // Responses come out whole and in order, as the socket drains.
+  std::thread reader([&]() {
+    for (size_t i = 0; i < gets; ++i) {
+      assert(read_response(fds[1], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+      assert(value == val);
+    }
+  });
+
+  while (conn.queued()) {
+    ok = conn.flush();
+    assert(ok);
+  }
+  reader.join();
+
+  assert(!conn.throttled());
+  assert(connection::stats_.throttled_ == 0);
+  assert(connection::stats_.throttles_ == 1);
+  assert(connection::stats_.queued_bytes_ == 0);
+  ::close(fds[1]);
+}
+
+/*!
+ * \brief Test executors running their own epoll loop, each listening on the
+ * same port.
+ */
+void test_listen(bool partitioned) {
+  // Find a free port.
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  int err = ::bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+  assert(!err);
+  err = ::getsockname(fd, (struct sockaddr *) &addr, &len);
+  assert(!err);
+  ::close(fd);
+
+  sharded_cache c(0, 2, !partitioned);
+  IOPoolExecutor io;
+  CPUPoolExecutor cpu;
+  if (partitioned) {
+    cpu.init(c, io);
+  }
+  bool ok = io.listen(2, "127.0.0.1", ntohs(addr.sin_port), c, partitioned ? &cpu : nullptr);
+  assert(ok);
+
+  std::vector<int> clients;
+  for (int i = 0; i < 8; ++i) {
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    err = ::connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    assert(!err);
+    clients.push_back(fd);
+  }
+
+  std::string value;
+  for (int i = 0; i < 100; ++i) {
+    int fd = clients[i % clients.size()];
+    std::string key("key_" + std::to_string(i));
+    std::string val("val_" + std::to_string(i));
+
+    buffer b = build_request(PROTOCOL_BINARY_CMD_SET, key, val);
+    assert(::write(fd, b.data(), b.size()) == (ssize_t) b.size());
+    assert(read_response(fd, value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    b = build_request(PROTOCOL_BINARY_CMD_GET, key);
+    assert(::write(clients[(i + 1) % clients.size()], b.data(), b.size()) == (ssize_t) b.size());
+    assert(read_response(clients[(i + 1) % clients.size()], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(value == val);
+  }
+  assert(c.count() == 100);
+
+  for (int fd : clients) {
+    ::close(fd);
+  }
+}
+
+/*!
+ * \brief Test IO executors stealing connections from each other, with all
+ * the connections assigned to one executor.
+ */
+void test_steal(bool partitioned) {
+  sharded_cache c(0, 4, !partitioned);
+  IOPoolExecutor io;
+  io.init(2, true);
+  assert(io.stealing());
+  CPUPoolExecutor cpu;
+  if (partitioned) {
+    cpu.init(c, io);
+  }
+
+  const int clients = 4;
+  std::vector<int> fds;
+  std::vector<connection *> conns;
+  for (int i = 0; i < clients; ++i) {
+    int pair[2];
+    int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(!err);
+    ::fcntl(pair[0], F_SETFL, ::fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
+
+    conns.push_back(new connection(pair[0], c, 0, partitioned ? &cpu : nullptr));
+    fds.push_back(pair[1]);
+    io.add(task(task::NEW, conns.back()), 0);
+  }
+
+  // The requests of each connection are still processed in order.
+  std::vector<std::thread> ts;
+  for (int n = 0; n < clients; ++n) {
+    ts.push_back(std::thread([&, n]() {
+      std::string value;
+      for (int i = 0; i < 200; ++i) {
+        std::string key("key_" + std::to_string(n) + "_" + std::to_string(i));
+        buffer b = build_request(PROTOCOL_BINARY_CMD_SET, key, std::to_string(i));
+        buffer r = build_request(PROTOCOL_BINARY_CMD_GET, key);
+        b.insert(b.end(), r.begin(), r.end());
+
+        send_request(fds[n], b);
+        io.add(task(task::READ, conns[n]), 0);
+        assert(read_response(fds[n], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(read_response(fds[n], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        assert(value == std::to_string(i));
+      }
+    }));
+  }
+
+  for (auto &t : ts) {
+    t.join();
+  }
+  assert(c.count() == clients * 200);
+
+  for (int i = 0; i < clients; ++i) {
+    io.add(task(task::CLOSE, conns[i]), 0);
+    ::close(fds[i]);
+  }
+}
+
+/*!
+ * \brief Test closing connections with the responses of the CPU executors
+ * in flight, with stealing: the last response is queued on a connection
+ * about to be deleted. Best run with -DSANITIZE=address or thread.
+ */
+void test_close_inflight() {
+  sharded_cache c(0, 4, false);
+  IOPoolExecutor io;
+  io.init(2, true);
+  CPUPoolExecutor cpu;
+  cpu.init(c, io);
+
+  buffer b;
+  for (int i = 0; i < 8; ++i) {
+    buffer r = build_request(PROTOCOL_BINARY_CMD_GET, "key_" + std::to_string(i));
+    b.insert(b.end(), r.begin(), r.end());
+  }
+
+  for (int n = 0; n < 2000; ++n) {
+    int pair[2];
+    int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(!err);
+    ::fcntl(pair[0], F_SETFL, ::fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
+
+    int index = n % 2;
+    connection *s = new connection(pair[0], c, index, &cpu);
+    io.add(task(task::NEW, s), index);
+    send_request(pair[1], b);
+    io.add(task(task::READ, s), index);
+    io.add(task(task::CLOSE, s), index);
+    ::close(pair[1]);
+  }
+
+  // All deleted, once their responses are in.
+  while (io.executors_[0]->connection_count() || io.executors_[1]->connection_count()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+/*!
+ * \brief Test placing connections on the least loaded executor, and moving
+ * busy connections off an overloaded one.
+ */
+void test_balance() {
+  sharded_cache c(0, 4);
+  IOPoolExecutor io;
+  io.init(2, false, true);
+  assert(!io.stealing());
+
+  // With no load yet, the executor with the fewest connections.
+  int pair[2];
+  int err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+  assert(!err);
+  int first = io.place();
+  connection *placed = new connection(pair[0], c, first);
+  io.add(task(task::NEW, placed), first);
+  assert(io.place() != first);
+  io.add(task(task::CLOSE, placed), first);
+  ::close(pair[1]);
+
+  // Two busy connections on executor 0, until one is moved to executor 1.
+  const int clients = 2;
+  std::vector<int> fds;
+  std::vector<connection *> conns;
+  for (int i = 0; i < clients; ++i) {
+    err = ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(!err);
+    ::fcntl(pair[0], F_SETFL, ::fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
+
+    conns.push_back(new connection(pair[0], c, 0));
+    fds.push_back(pair[1]);
+    io.add(task(task::NEW, conns.back()), 0);
+  }
+
+  auto end = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  std::vector<std::thread> ts;
+  for (int n = 0; n < clients; ++n) {
+    ts.push_back(std::thread([&, n]() {
+      std::string value;
+      buffer b;
+      for (int i = 0; i < 64; ++i) {
+        buffer r = build_request(PROTOCOL_BINARY_CMD_SET, "key_" + std::to_string(n) + "_" + std::to_string(i),
+                                 std::to_string(i));
+        b.insert(b.end(), r.begin(), r.end());
+      }
+
+      // The requests are still answered in order, across moves.
+      while (!io.migrations() && std::chrono::steady_clock::now() < end) {
+        send_request(fds[n], b);
+        io.add(task(task::READ, conns[n]), conns[n]->executor_index_);
+        for (int i = 0; i < 64; ++i) {
+          assert(read_response(fds[n], value) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        }
+      }
+    }));
+  }
+
+  for (auto &t : ts) {
+    t.join();
+  }
+  assert(io.migrations());
+  assert(conns[0]->executor_index_ != conns[1]->executor_index_);
+  assert(io.executors_[0]->connection_count() == 1);
+  assert(io.executors_[1]->connection_count() == 1);
+
+  for (int i = 0; i < clients; ++i) {
+    io.add(task(task::CLOSE, conns[i]), conns[i]->executor_index_);
+    ::close(fds[i]);
+  }
+}
+
 int main() {
+  // Responses written to connections closed by the peer.
+  signal(SIGPIPE, SIG_IGN);
+
   const int size = 8;
   memcache::IOPoolExecutor pool;
   pool.init(size);
@@ -11,4 +646,16 @@ int main() {
   for (int i = 0;i < 8;++i) {
     assert(pool.pick() == i);
   }
-}
\ No newline at end of file
+
+  test_cpu_pool();
+  test_receive();
+  test_quiet();
+  test_encoded_get();
+  test_output_queue();
+  test_listen(false);
+  test_listen(true);
+  test_steal(false);
+  test_steal(true);
+  test_close_inflight();
+  test_balance();
+}
@@ -0,0 +1,96 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "./../hash_index.h"
+#include "./../murmur3_hash.h"
+
+using namespace memcache;
+
+struct hasher {
+  size_t operator()(const std::string& k) const {
+    return MurmurHash3_x86_32(k.data(), k.length());
+  }
+};
+
+typedef hash_index<std::string, int, hasher> index_t;
+
+static uint32_t hash(const std::string& k) {
+  return (uint32_t) hasher()(k);
+}
+
+/*!
+ * \brief Test insert, find and erase, including growth.
+ */
+void test_basic() {
+  index_t idx;
+  assert(idx.empty());
+  assert(!idx.find("missing", hash("missing")));
+
+  const int items = 10000;
+  for (int i = 0;i < items;++i) {
+    std::string k("key_" + std::to_string(i));
+    auto r = idx.insert(k, i, hash(k));
+    assert(r.second);
+    assert(*r.first == i);
+  }
+
+  assert(idx.size() == items);
+  assert(idx.capacity() >= items);
+
+  // Duplicate insert returns the existing value.
+  auto r = idx.insert("key_0", -1, hash("key_0"));
+  assert(!r.second);
+  assert(*r.first == 0);
+
+  for (int i = 0;i < items;++i) {
+    std::string k("key_" + std::to_string(i));
+    int *v = idx.find(k, hash(k));
+    assert(v && *v == i);
+  }
+
+  for (int i = 0;i < items;i += 2) {
+    std::string k("key_" + std::to_string(i));
+    assert(idx.erase(k, hash(k)));
+    assert(!idx.erase(k, hash(k)));
+  }
+
+  assert(idx.size() == items / 2);
+
+  for (int i = 0;i < items;++i) {
+    std::string k("key_" + std::to_string(i));
+    int *v = idx.find(k, hash(k));
+    assert((i % 2 == 0) == !v);
+  }
+}
+
+/*!
+ * \brief Test that churn reuses deleted slots instead of growing.
+ */
+void test_churn() {
+  index_t idx(1000);
+  size_t capacity = idx.capacity();
+
+  for (int i = 0;i < 100000;++i) {
+    std::string k("key_" + std::to_string(i));
+    assert(idx.insert(k, i, hash(k)).second);
+
+    if (i >= 500) {
+      std::string old("key_" + std::to_string(i - 500));
+      assert(idx.erase(old, hash(old)));
+    }
+  }
+
+  assert(idx.size() == 500);
+  assert(idx.capacity() == capacity);
+
+  for (int i = 100000 - 500;i < 100000;++i) {
+    std::string k("key_" + std::to_string(i));
+    assert(idx.find(k, hash(k)));
+  }
+}
+
+int main() {
+  test_basic();
+  test_churn();
+}
@@ -0,0 +1,122 @@
+#include <assert.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+#include "./../iobuf.h"
+
+using namespace memcache;
+
+static std::string str(const iobuf &b) {
+  struct iovec v[16];
+  int n = b.iov(v, 16);
+
+  std::string s;
+  for (int i = 0; i < n; ++i) {
+    s.append((const char *) v[i].iov_base, v[i].iov_len);
+  }
+  assert(s.size() == b.size());
+  return s;
+}
+
+/*!
+ * \brief Test writing at the tail, and splitting off the front.
+ */
+void test_split() {
+  iobuf b = iobuf::create(16);
+  assert(b.empty());
+  assert(b.tailroom() == 16);
+
+  memcpy(b.tail(), "hello world", 11);
+  b.commit(11);
+  assert(b.size() == 11);
+  assert(b.tailroom() == 5);
+
+  const char *p = b.data();
+  iobuf front = b.split(6);
+  assert(str(front) == "hello ");
+  assert(str(b) == "world");
+
+  // No copies, the slices share the block.
+  assert(front.data() == p);
+  assert(b.data() == p + 6);
+
+  // The front part ends before the last byte written, so it can't be written to.
+  assert(!front.tailroom());
+  assert(b.tailroom() == 5);
+
+  // The block is only reused once the front part is gone.
+  iobuf rest = b.split(5);
+  assert(b.empty());
+  assert(!b.reset());
+  front.clear();
+  rest.clear();
+  assert(b.reset());
+  assert(b.tailroom() == 16);
+}
+
+/*!
+ * \brief Test chaining, copying and coalescing.
+ */
+void test_append() {
+  iobuf b(std::string("abc"));
+  iobuf c(std::string("def"));
+  const char *p = c.data();
+
+  b.append(std::move(c));
+  assert(c.empty());
+  assert(!b.contiguous());
+  assert(str(b) == "abcdef");
+
+  struct iovec v[2];
+  assert(b.iov(v, 2) == 2);
+  assert(v[1].iov_base == p);
+
+  // Copies go to a new block when there is no tailroom.
+  b.append("ghi", 3);
+  assert(str(b) == "abcdefghi");
+
+  iobuf d = iobuf::create(32);
+  d.append(b);
+  assert(d.contiguous());
+  assert(str(d) == "abcdefghi");
+
+  assert(std::string(b.coalesce(), b.size()) == "abcdefghi");
+  assert(b.contiguous());
+
+  // Splitting across slices.
+  iobuf e(std::string("123"));
+  e.append(iobuf(std::string("456")));
+  iobuf f = e.split(4);
+  assert(str(f) == "1234");
+  assert(str(e) == "56");
+}
+
+/*!
+ * \brief Test blocks released by other threads.
+ */
+void test_threads() {
+  iobuf b = iobuf::create(1024);
+  memset(b.tail(), 'x', 1024);
+  b.commit(1024);
+
+  std::thread t[4];
+  for (int i = 0; i < 4; ++i) {
+    iobuf part = b.split(256);
+    t[i] = std::thread([](iobuf p) {
+      assert(str(p) == std::string(256, 'x'));
+    }, std::move(part));
+  }
+
+  for (auto &th : t) {
+    th.join();
+  }
+  assert(b.empty());
+  assert(b.reset());
+}
+
+int main() {
+  test_split();
+  test_append();
+  test_threads();
+}
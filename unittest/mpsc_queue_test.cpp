@@ -0,0 +1,99 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./../mpsc_queue.h"
+
+using namespace memcache;
+
+/*!
+ * \brief Test FIFO order, including past the ring capacity.
+ */
+void test_basic() {
+  mpsc_queue<std::string> q(4);
+  assert(q.capacity() == 4);
+  assert(q.empty());
+
+  for (int i = 0;i < 10;++i) {
+    q.push("item_" + std::to_string(i));
+  }
+  assert(!q.empty());
+  assert(q.pop() == "item_0");
+
+  // Items pushed while others overflowed go behind them.
+  mpsc_queue<std::string>::queue out;
+  q.pop_all(out);
+  assert(out.size() == 9);
+  for (int i = 1;i < 10;++i) {
+    assert(out[i - 1] == "item_" + std::to_string(i));
+  }
+  assert(q.empty());
+
+  for (int i = 0;i < 3;++i) {
+    q.push("again_" + std::to_string(i));
+    assert(q.pop() == "again_" + std::to_string(i));
+  }
+  assert(q.empty());
+}
+
+/*!
+ * \brief Test parking: the producer of the next item is told to wake the consumer.
+ */
+void test_park() {
+  mpsc_queue<int> q;
+
+  // Parked at first.
+  assert(q.push(1));
+  assert(!q.park());
+  assert(!q.push(2));
+
+  mpsc_queue<int>::queue out;
+  q.pop_all(out);
+  assert(out.size() == 2);
+  assert(q.park());
+  assert(q.push(3));
+  assert(!q.push(4));
+}
+
+/*!
+ * \brief Test producers pushing concurrently, with the consumer sleeping
+ * and overflowing a small ring.
+ */
+void test_producers() {
+  const uint64_t producers = 4;
+  const uint64_t items = 100000;
+  mpsc_queue<uint64_t> q(64);
+
+  std::vector<std::thread> ts;
+  for (uint64_t p = 0;p < producers;++p) {
+    ts.push_back(std::thread([&q, p]() {
+      for (uint64_t i = 0;i < items;++i) {
+        q.push(p << 32 | i);
+        if (i % 1000 == 0) {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+
+  // The items of a producer come in order.
+  std::vector<uint64_t> next(producers, 0);
+  for (uint64_t n = 0;n < producers * items;++n) {
+    uint64_t v = q.pop();
+    uint64_t p = v >> 32;
+    assert(p < producers);
+    assert((v & 0xffffffff) == next[p]);
+    ++next[p];
+  }
+
+  for (auto &t : ts) {
+    t.join();
+  }
+  assert(q.empty());
+}
+
+int main() {
+  test_basic();
+  test_park();
+  test_producers();
+}
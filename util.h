@@ -7,6 +7,7 @@
 #include <arpa/inet.h>
 #include <endian.h>
 #include <byteswap.h>
+#include <string.h>
 
 #include "protocol_binary.h"
 
@@ -32,11 +33,57 @@ namespace memcache {
 
 typedef std::vector<unsigned char> buffer;
 
+/*!
+ * \brief Cache eviction policy.
+ */
+enum class eviction_policy {
+  /*!
+   * Least recently used, with hits moving items to the head of the LRU.
+   */
+  LRU,
+  /*!
+   * CLOCK, with hits only setting a reference bit on the item.
+   */
+  CLOCK,
+  /*!
+   * Segmented LRU, with hot, warm and cold segments. Items are promoted to
+   * warm on their second hit, so a scan only flushes hot and cold.
+   */
+  SEGMENTED,
+};
+
+/*!
+ * \brief Cache admission policy, deciding whether new items may take the
+ * place of existing ones.
+ */
+enum class admission_policy {
+  /*!
+   * Admit all items.
+   */
+  NONE,
+  /*!
+   * W-TinyLFU: items enter a small window LRU, and leave it for the main
+   * cache only if their estimated access frequency beats the one of the
+   * item they would evict.
+   */
+  TINYLFU,
+};
+
 struct options {
   unsigned int port = 11211;
   unsigned int threads = 0;
-  unsigned int cachemem = DEFAULT_CACHE_CAPACITY;
+  size_t cachemem = DEFAULT_CACHE_CAPACITY;
   unsigned int max_connections = MAX_CONNECTIONS;
+  unsigned int shards = 0;
+  unsigned int cpu_threads = 0;
+  size_t low_watermark = DEFAULT_LOW_WATERMARK;
+  size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+  eviction_policy policy = eviction_policy::LRU;
+  admission_policy admission = admission_policy::NONE;
+  bool encoded_responses = true;
+  bool reuse_port = false;
+  bool steal = false;
+  bool balance = false;
   std::string ip = "127.0.0.1";
 };
 
@@ -103,17 +150,127 @@ public:
           if (i + 1 == argc) {
             return false;
           }
-          // Memory
-          o.cachemem = atoi(argv[++i]);
+          // Memory, in MB
+          o.cachemem = (size_t) atoi(argv[++i]) * MB;
           if (!o.cachemem) {
             return false;
           }
           break;
+        case 's':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Cache shards
+          o.shards = atoi(argv[++i]);
+          if (!o.shards) {
+            return false;
+          }
+          break;
+        case 'c':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // CPU executors owning cache partitions
+          o.cpu_threads = atoi(argv[++i]);
+          break;
+        case 'w':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Low watermark for background reclaim, in percent
+          o.low_watermark = atoi(argv[++i]);
+          break;
+        case 'W':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // High watermark for background reclaim, in percent
+          o.high_watermark = atoi(argv[++i]);
+          break;
+        case 'e':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Eviction policy
+          ++i;
+          if (!strcmp(argv[i], "lru")) {
+            o.policy = eviction_policy::LRU;
+          } else if (!strcmp(argv[i], "clock")) {
+            o.policy = eviction_policy::CLOCK;
+          } else if (!strcmp(argv[i], "slru")) {
+            o.policy = eviction_policy::SEGMENTED;
+          } else {
+            return false;
+          }
+          break;
+        case 'a':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Admission policy
+          ++i;
+          if (!strcmp(argv[i], "none")) {
+            o.admission = admission_policy::NONE;
+          } else if (!strcmp(argv[i], "tinylfu")) {
+            o.admission = admission_policy::TINYLFU;
+          } else {
+            return false;
+          }
+          break;
+        case 'r':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Pre-encoded GET responses
+          o.encoded_responses = atoi(argv[++i]) != 0;
+          break;
+        case 'l':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Listening socket and epoll loop per IO thread
+          o.reuse_port = atoi(argv[++i]) != 0;
+          break;
+        case 'S':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Work stealing between the IO threads
+          o.steal = atoi(argv[++i]) != 0;
+          break;
+        case 'B':
+          if (i + 1 == argc) {
+            return false;
+          }
+          // Load-aware placement and rebalancing of the connections
+          o.balance = atoi(argv[++i]) != 0;
+          break;
         default:
           return false;
       }
     }
 
+    if (o.low_watermark > o.high_watermark || o.high_watermark > 100) {
+      return false;
+    }
+
+    // Each thread reading the cache takes an epoch slot, and some IO
+    // threads are left for the default.
+    if (o.threads > MAX_WORKER_THREADS || o.cpu_threads >= MAX_WORKER_THREADS ||
+        o.threads + o.cpu_threads > MAX_WORKER_THREADS) {
+      return false;
+    }
+
+    // Connections stay on the epoll loop of the thread which accepted them.
+    if (o.reuse_port && (o.steal || o.balance)) {
+      return false;
+    }
+
+    // TinyLFU counts accesses under the exclusive cache lock, which CLOCK gets don't take.
+    if (o.admission == admission_policy::TINYLFU && o.policy == eviction_policy::CLOCK) {
+      return false;
+    }
+
     return true;
   }
 
@@ -137,24 +294,61 @@ public:
     return buffer((unsigned char *) &r, (unsigned char *) &r + sizeof(r));
   }
 
+  /*!
+   * \brief True for the quiet commands, whose responses are held back until
+   * a command which isn't quiet, and only sent for some outcomes: hits for
+   * GETQ and GETKQ, errors for SETQ and DELETEQ.
+   */
+  static bool is_quiet(uint8_t opcode) {
+    switch (opcode) {
+      case PROTOCOL_BINARY_CMD_GETQ:
+      case PROTOCOL_BINARY_CMD_GETKQ:
+      case PROTOCOL_BINARY_CMD_SETQ:
+      case PROTOCOL_BINARY_CMD_DELETEQ:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /*!
+   * \brief True for GET and its quiet and key variants.
+   */
+  static bool is_get(uint8_t opcode) {
+    return opcode == PROTOCOL_BINARY_CMD_GET || opcode == PROTOCOL_BINARY_CMD_GETQ ||
+        opcode == PROTOCOL_BINARY_CMD_GETK || opcode == PROTOCOL_BINARY_CMD_GETKQ;
+  }
+
+  /*!
+   * \brief True for SET and SETQ.
+   */
+  static bool is_set(uint8_t opcode) {
+    return opcode == PROTOCOL_BINARY_CMD_SET || opcode == PROTOCOL_BINARY_CMD_SETQ;
+  }
+
   /*!
    * \brief Validate the header according to protocol.
    * @return
    */
   static protocol_binary_response_status
     validate_header(const protocol_binary_request_header& header_) {
-    if (header_.request.keylen == 0) {
+    if (header_.request.keylen == 0 && header_.request.opcode != PROTOCOL_BINARY_CMD_STAT &&
+        header_.request.opcode != PROTOCOL_BINARY_CMD_NOOP) {
       return PROTOCOL_BINARY_RESPONSE_E2BIG;
     }
 
     switch (header_.request.opcode) {
       case PROTOCOL_BINARY_CMD_GET:
+      case PROTOCOL_BINARY_CMD_GETQ:
+      case PROTOCOL_BINARY_CMD_GETK:
+      case PROTOCOL_BINARY_CMD_GETKQ:
         if (header_.request.extlen != 0 ||
             header_.request.bodylen != header_.request.keylen) {
           return PROTOCOL_BINARY_RESPONSE_EINVAL;
         }
         break;
       case PROTOCOL_BINARY_CMD_SET:
+      case PROTOCOL_BINARY_CMD_SETQ:
         if (header_.request.extlen != 8 ||
             header_.request.bodylen < header_.request.keylen + PACKET_EXTRAS_SIZE ||
             header_.request.keylen > MAX_KEY_SIZE) {
@@ -166,11 +360,24 @@ public:
         }
         break;
       case PROTOCOL_BINARY_CMD_DELETE:
+      case PROTOCOL_BINARY_CMD_DELETEQ:
         if (header_.request.extlen != 0 ||
             header_.request.bodylen != header_.request.keylen) {
           return PROTOCOL_BINARY_RESPONSE_EINVAL;
         }
         break;
+      case PROTOCOL_BINARY_CMD_STAT:
+        if (header_.request.extlen != 0 ||
+            header_.request.bodylen != header_.request.keylen) {
+          return PROTOCOL_BINARY_RESPONSE_EINVAL;
+        }
+        break;
+      case PROTOCOL_BINARY_CMD_NOOP:
+        if (header_.request.extlen != 0 || header_.request.keylen != 0 ||
+            header_.request.bodylen != 0) {
+          return PROTOCOL_BINARY_RESPONSE_EINVAL;
+        }
+        break;
       default:
         return PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND;
         break;